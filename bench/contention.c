@@ -0,0 +1,151 @@
+/*
+ * Contention benchmark for per-cabin state layouts
+ *
+ * A dispatcher thread updates the position of every cabin round robin under
+ * the cabins mutex while each elevator thread does the same for its own cabin.
+ * This is run once with the old layout, parallel arrays indexed by cabin, and
+ * once with cache line aligned struct cabin contexts.
+ *
+ * Usage: contention [seconds] [cabins ...]
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cabin.h"
+
+/* Old layout, one array per field */
+struct packed {
+    pthread_mutex_t *mutex;
+    int *position;
+};
+
+struct worker {
+    int id;
+    long ops;
+};
+
+static int num_cabins;
+static volatile int running;
+
+static struct packed packed;
+static struct cabin *aligned;
+
+/* Selects the layout used by the workers */
+static int use_aligned;
+
+static inline void update(int id)
+{
+    if (use_aligned) {
+        pthread_mutex_lock(&aligned[id].event_buffer_mutex);
+        aligned[id].info.position += HW_POSITION_SCALE;
+        pthread_mutex_unlock(&aligned[id].event_buffer_mutex);
+    } else {
+        pthread_mutex_lock(&packed.mutex[id]);
+        packed.position[id] += HW_POSITION_SCALE;
+        pthread_mutex_unlock(&packed.mutex[id]);
+    }
+}
+
+static void *elevator(void *arg)
+{
+    struct worker *w = arg;
+
+    while (running) {
+        update(w->id);
+        w->ops++;
+    }
+
+    return NULL;
+}
+
+static void *dispatcher(void *arg)
+{
+    struct worker *w = arg;
+    int i;
+
+    while (running) {
+        for (i = 0; i < num_cabins; i++)
+            update(i);
+        w->ops += num_cabins;
+    }
+
+    return NULL;
+}
+
+/* Returns total updates per second for the current layout */
+static double run(int seconds)
+{
+    int i;
+    long total = 0;
+    pthread_t *threads = malloc((num_cabins+1)*sizeof(pthread_t));
+    struct worker *workers = calloc(num_cabins+1, sizeof(struct worker));
+
+    running = 1;
+
+    for (i = 0; i < num_cabins; i++) {
+        workers[i].id = i;
+        pthread_create(&threads[i], NULL, elevator, &workers[i]);
+    }
+    pthread_create(&threads[num_cabins], NULL, dispatcher, &workers[num_cabins]);
+
+    sleep(seconds);
+    running = 0;
+
+    for (i = 0; i <= num_cabins; i++) {
+        pthread_join(threads[i], NULL);
+        total += workers[i].ops;
+    }
+
+    free(threads);
+    free(workers);
+
+    return (double) total / seconds;
+}
+
+int main(int argc, char **argv)
+{
+    int i, j;
+    int seconds = 1;
+    int default_cabins[] = { 32, 64, 128 };
+    double before, after;
+
+    if (argc > 1)
+        seconds = atoi(argv[1]);
+
+    printf("%8s %16s %16s %8s\n", "cabins", "packed ops/s", "aligned ops/s", "ratio");
+
+    for (j = 0; j < (argc > 2 ? argc-2 : 3); j++) {
+        num_cabins = argc > 2 ? atoi(argv[j+2]) : default_cabins[j];
+
+        packed.mutex = malloc(num_cabins*sizeof(pthread_mutex_t));
+        packed.position = calloc(num_cabins, sizeof(int));
+        if (posix_memalign((void**) &aligned, CACHE_LINE_SIZE,
+                           num_cabins*sizeof(struct cabin)))
+            return 1;
+
+        for (i = 0; i < num_cabins; i++) {
+            pthread_mutex_init(&packed.mutex[i], NULL);
+            pthread_mutex_init(&aligned[i].event_buffer_mutex, NULL);
+            aligned[i].info.position = 0;
+        }
+
+        use_aligned = 0;
+        before = run(seconds);
+        use_aligned = 1;
+        after = run(seconds);
+
+        printf("%8d %16.0f %16.0f %8.2f\n", num_cabins, before, after, after/before);
+
+        free(packed.mutex);
+        free(packed.position);
+        free(aligned);
+    }
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * Latency of emergency stops under full output load
+ *
+ * Load threads keep the output scheduler saturated with motor and door
+ * commands for many cabins while emergency stops are issued, once
+ * through the reserved emergency slot and once as ordinary motor stops. A
+ * reader thread decodes the frames written to one end of a socket pair and
+ * times every stop from being issued to being read.
+ *
+ * Usage: emergency [stops] [cabins] [load threads]
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "hardwareAPI.h"
+#include "output.h"
+
+/* Commands the load threads keep queued ahead of the sender */
+#define DEPTH 256
+
+static int num_stops = 2000;
+static int num_cabins = 64;
+static int num_load = 4;
+
+static int fds[2];
+static int loading;
+static long issued;             /* load commands queued */
+static long received;           /* frames read */
+
+/* Commands sent to each load cabin */
+static int *rounds;
+
+/* Time each cabin's stop was issued, 0 once read */
+static long *issued_at;
+static double *latencies;
+
+static long now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Cabins 2 and up take the load, cabin 1 the stops. Every load thread owns
+ * some of the cabins and changes their state on every command, so that none
+ * are suppressed and each ends up as a frame.
+ */
+static void *load(void *arg)
+{
+    static const int motor[4] = { MotorUp, MotorStop, MotorDown, MotorStop };
+    int id = (int) (long) arg;
+    int cabin = 2+id, n;
+
+    while (__atomic_load_n(&loading, __ATOMIC_RELAXED)) {
+        if (__atomic_load_n(&issued, __ATOMIC_RELAXED) -
+                __atomic_load_n(&received, __ATOMIC_RELAXED) > DEPTH) {
+            sched_yield();
+            continue;
+        }
+
+        /* Motor and door commands by turns, round robin over the cabins */
+        n = rounds[cabin]++;
+        if ((n & 1) == 0)
+            output_send('m', cabin, motor[(n/2) % 4]);
+        else
+            output_send('d', cabin, ((n/2) & 1) ? DoorClose : DoorOpen);
+
+        __atomic_add_fetch(&issued, 1, __ATOMIC_RELAXED);
+
+        cabin += num_load;
+        if (cabin > num_cabins)
+            cabin = 2+id;
+    }
+
+    return NULL;
+}
+
+static void *reader(void *arg)
+{
+    HWFrame frame;
+    int got, count;
+    long t;
+
+    while (1) {
+        for (got = 0; got < (int) sizeof(frame); got += count)
+            if ((count = read(fds[1], (char*) &frame+got, sizeof(frame)-got)) <= 0)
+                return NULL;
+
+        t = now();
+        __atomic_add_fetch(&received, 1, __ATOMIC_RELAXED);
+
+        if (frame.type == 'm' && ntohs(frame.cabin) == 1 && ntohl(frame.value) == MotorStop)
+            __atomic_store_n(&issued_at[1], t-issued_at[1], __ATOMIC_RELEASE);
+    }
+}
+
+static int compare(const void *a, const void *b)
+{
+    double x = *(double*) a, y = *(double*) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Issue the stops one at a time, by emergency slot or as ordinary commands */
+static void run(int emergency)
+{
+    int i;
+    long latency, t;
+
+    for (i = 0; i < num_stops; i++) {
+        /* Get the motor going, so the stop is not suppressed */
+        if (emergency)
+            output_resume(1);
+        output_send('m', 1, MotorUp);
+        usleep(500);
+
+        t = now();
+        __atomic_store_n(&issued_at[1], t, __ATOMIC_RELEASE);
+
+        if (emergency)
+            output_emergency_stop(1);
+        else
+            output_send('m', 1, MotorStop);
+
+        /* Read stops hold the latency instead of the issue time */
+        while ((latency = __atomic_load_n(&issued_at[1], __ATOMIC_ACQUIRE)) == t)
+            sched_yield();
+
+        latencies[i] = latency/1e3;
+    }
+
+    qsort(latencies, num_stops, sizeof(double), compare);
+
+    printf("%10s %10d %10.1f %10.1f %10.1f\n", emergency ? "emergency" : "queued",
+           num_stops, latencies[num_stops/2], latencies[(int) (0.99*(num_stops-1))],
+           latencies[num_stops-1]);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    pthread_t read_thread, *load_threads;
+
+    if (argc > 1)
+        num_stops = atoi(argv[1]);
+    if (argc > 2)
+        num_cabins = atoi(argv[2]);
+    if (argc > 3)
+        num_load = atoi(argv[3]);
+
+    if (num_stops < 1 || num_cabins < 2 || num_load < 0 || num_load > num_cabins-1) {
+        fprintf(stderr, "Usage: %s [stops] [cabins >= 2] [load threads < cabins]\n", argv[0]);
+        exit(1);
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+
+    issued_at = calloc(num_cabins+1, sizeof(long));
+    rounds = calloc(num_cabins+1, sizeof(int));
+    latencies = malloc(num_stops*sizeof(double));
+    load_threads = malloc(num_load*sizeof(pthread_t));
+
+    attachHW(fds[0], 1);
+    if (output_open(num_cabins)) {
+        fprintf(stderr, "Cannot start output scheduler\n");
+        exit(1);
+    }
+
+    pthread_create(&read_thread, NULL, reader, NULL);
+
+    loading = 1;
+    for (i = 0; i < num_load; i++)
+        pthread_create(&load_threads[i], NULL, load, (void*) (long) i);
+
+    printf("%10s %10s %10s %10s %10s\n", "lane", "stops", "p50 us", "p99 us", "max us");
+    run(0);
+    run(1);
+
+    __atomic_store_n(&loading, 0, __ATOMIC_RELAXED);
+    for (i = 0; i < num_load; i++)
+        pthread_join(load_threads[i], NULL);
+
+    output_close();
+    close(fds[0]);
+    pthread_join(read_thread, NULL);
+
+    return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * Cost of a log call on the hot path
+ *
+ * A single thread logs a position record in a loop while the drain thread
+ * writes the binary log to /dev/null. Also measures the cost of a call whose
+ * level is disabled.
+ *
+ * Usage: log [iterations]
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "log.h"
+
+static double elapsed_ns(struct timespec *a, struct timespec *b)
+{
+    return (b->tv_sec-a->tv_sec)*1e9 + (b->tv_nsec-a->tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+    long i;
+    long iterations = 1000000;
+    struct timespec a, b;
+
+    if (argc > 1)
+        iterations = atol(argv[1]);
+
+    if (log_open("/dev/null", LOG_DEBUG))
+        return 1;
+
+    /* Drain thread may fall behind, dropped records still count as calls */
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for (i = 0; i < iterations; i++)
+        log_msg(LOG_DEBUG, LOG_POSITION, (int) (i & 7), i*0.001);
+    clock_gettime(CLOCK_MONOTONIC, &b);
+
+    printf("enabled:  %6.1f ns/call\n", elapsed_ns(&a, &b)/iterations);
+
+    log_set_level(LOG_ERROR);
+
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for (i = 0; i < iterations; i++)
+        log_msg(LOG_DEBUG, LOG_POSITION, (int) (i & 7), i*0.001);
+    clock_gettime(CLOCK_MONOTONIC, &b);
+
+    printf("disabled: %6.1f ns/call\n", elapsed_ns(&a, &b)/iterations);
+
+    log_close();
+
+    return 0;
+}
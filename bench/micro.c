@@ -0,0 +1,513 @@
+/*
+ * Microbenchmarks of the hot functions of the controller
+ *
+ * Each function is timed in isolation over a range of queue lengths or fleet
+ * sizes, without a simulator or network. waitForEvent() parses events from
+ * an in-memory file. Allocations are counted by wrapping malloc(), calloc()
+ * and realloc() at link time.
+ *
+ * Scores read from the plans of the stop queues are first checked against
+ * walking the stops, and cabins found by the spatial index against ranking
+ * every cabin. Either differing exits with an error.
+ *
+ * Results are printed as a table and, given a file, written as JSON for
+ * comparing commits. 'make micro' runs it.
+ *
+ * Usage: micro [json file] [commit]
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "hardwareAPI.h"
+#include "cabin.h"
+#include "controller.h"
+#include "spatial.h"
+#include "eta.h"
+
+/* Each measurement runs for at least this long, ns */
+#define MIN_DURATION 50000000L
+
+/* Events parsed by waitForEvent() per measurement */
+#define NUM_EVENTS 1000000
+
+/* Precomputed random input, a power of two */
+#define NUM_INPUTS 4096
+
+#define FLOORS 20
+#define MAX_RESULTS 64
+
+/* Random changes to a stop queue checked against walking it, and its length */
+#define VERIFY_STEPS 200000
+#define VERIFY_STOPS 64
+
+/* Allocation counting, see the wrap flags in the Makefile */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static long allocations = 0;
+
+void *__wrap_malloc(size_t size)
+{
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+struct result {
+    const char *name;
+    const char *param;
+    int value;
+    double ns;
+    double allocs;
+};
+
+static struct result results[MAX_RESULTS];
+static int num_results = 0;
+
+static FloorButtonPressDesc calls[NUM_INPUTS];
+static int floors[NUM_INPUTS];
+
+static long now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+static void record(const char *name, const char *param, int value, long ns, long ops,
+                   long allocs)
+{
+    struct result *r = &results[num_results++];
+
+    r->name = name;
+    r->param = param;
+    r->value = value;
+    r->ns = (double) ns/ops;
+    r->allocs = (double) allocs/ops;
+
+    printf("%-24s %8s %6d %12.1f %12.2f\n", name, param, value, r->ns, r->allocs);
+    fflush(stdout);
+}
+
+/*
+ * Run op(iterations) with growing iteration counts until it takes long
+ * enough, then record the last run
+ */
+static void measure(const char *name, const char *param, int value, void (*op)(long))
+{
+    long iterations = 1000, start, allocs;
+
+    while (1) {
+        allocs = allocations;
+        start = now();
+        op(iterations);
+        start = now()-start;
+        allocs = allocations-allocs;
+
+        if (start >= MIN_DURATION)
+            break;
+        iterations *= 2;
+    }
+
+    record(name, param, value, start, iterations, allocs);
+}
+
+/*
+ * A fleet of idle cabins at random floors, each with length stops. Large
+ * fleets are put in the spatial index, as the elevators do.
+ */
+static void setup_fleet(int size, int length)
+{
+    int i, j;
+
+    spatial_close();
+
+    for (i = 1; i <= num_elevators; i++) {
+        while (size_stop_queue(cabins[i]->info.queue))
+            pop_stop_queue(cabins[i]->info.queue);
+        destroy_stop_queue(cabins[i]->info.queue);
+        destroy_cabin(cabins[i]);
+    }
+    free(cabins);
+
+    num_elevators = size;
+    num_floors = FLOORS;
+    cabins = calloc(size+1, sizeof(struct cabin*));
+
+    for (i = 1; i <= size; i++) {
+        cabins[i] = new_cabin(FLOORS);
+        cabins[i]->info.queue = new_stop_queue();
+        cabins[i]->info.position = FLOOR_POSITION(floors[i % NUM_INPUTS]);
+
+        for (j = 0; j < length; j++)
+            push_stop_queue(floors[(i*length+j) % NUM_INPUTS], 0,
+                            cabins[i]->info.position, &cabins[i]->info);
+    }
+
+    if (size >= SPATIAL_MIN_CABINS && !spatial_open(size, FLOORS))
+        for (i = 1; i <= size; i++)
+            spatial_update(i, cabins[i]->info.position, cabins[i]->info.queue);
+}
+
+/*
+ * Exit if the spatial index picks another cabin than ranking every cabin does,
+ * under either score model
+ */
+static void verify_spatial()
+{
+    int i, j, score, e, linear, best;
+
+    for (i = 0; i < 2*NUM_INPUTS; i++) {
+        score_model = i < NUM_INPUTS ? SCORE_DISTANCE : SCORE_ETA;
+
+        if (!(e = spatial_search(&calls[i%NUM_INPUTS], 1, num_elevators, &score)))
+            break;
+
+        for (linear = 0, best = 0, j = 1; j <= num_elevators; j++) {
+            score = distance_to_floor(&calls[i%NUM_INPUTS], &cabins[j]->info);
+            if (!linear || score < best) {
+                linear = j;
+                best = score;
+            }
+        }
+
+        if (e != linear) {
+            fprintf(stderr, "Spatial index picked cabin %d, not %d, for floor %d\n", e,
+                    linear, calls[i%NUM_INPUTS].floor);
+            exit(1);
+        }
+    }
+
+    score_model = SCORE_ETA;
+}
+
+/*
+ * Score of a call under SCORE_DISTANCE by walking every stop, as scored before
+ * the stop queues kept plans
+ */
+static int walk_stops(FloorButtonPressDesc *call, elevator_information *info)
+{
+    int num_stops = 0;
+    int distance = 0;
+    int current_floor = position_floor(info->position);
+    int old_pos = current_floor;
+    node_stop_queue *stop = info->queue->first;
+
+    if (!stop)
+        distance = abs(call->floor - current_floor);
+
+    for (; stop; old_pos = stop->floor, stop = stop->next) {
+        if (old_pos < stop->floor ? stop->floor > call->floor && call->type == GoingUp :
+                                    stop->floor < call->floor && call->type == GoingDown) {
+            distance += abs(old_pos - call->floor);
+            break;
+        }
+
+        num_stops++;
+        distance += abs(old_pos - stop->floor);
+    }
+
+    return distance*score_weight_distance + num_stops*score_weight_stops;
+}
+
+/*
+ * Exit if distance_to_floor scores a call from the plan differently than
+ * walking the stops does, after random pushes, pops and removals which
+ * insert into, pop and rebuild the plan
+ */
+static void verify_plan()
+{
+    int i, j, step, expected, score;
+    int weight_distance = score_weight_distance, weight_stops = score_weight_stops;
+    FloorButtonPressDesc removed[VERIFY_STOPS], *call;
+    elevator_information *info;
+
+    setup_fleet(1, 0);
+    info = &cabins[1]->info;
+
+    /* Weighted apart so that equal scores are equal distances and stops */
+    score_model = SCORE_DISTANCE;
+    score_weight_distance = 1;
+    score_weight_stops = 1 << 16;
+
+    for (i = 0; i < VERIFY_STEPS; i++) {
+        step = rand() % 32;
+
+        if (step < 16 && size_stop_queue(info->queue) < VERIFY_STOPS)
+            push_stop_queue(rand() % FLOORS, rand() % 3 - 1, info->position, info);
+        else if (step < 28)
+            pop_stop_queue(info->queue);
+        else if (step < 30)
+            remove_stop_queue(info->queue, rand() % FLOORS, rand() % 3 - 1);
+        else if (step < 31)
+            remove_hall_calls_stop_queue(info->queue, removed);
+        else
+            info->position = rand() % (FLOOR_POSITION(FLOORS-1) + 1);
+
+        for (j = 0; j < 4; j++) {
+            call = &calls[rand() & (NUM_INPUTS-1)];
+            expected = walk_stops(call, info);
+
+            if ((score = distance_to_floor(call, info)) != expected) {
+                fprintf(stderr, "Plan scores floor %d type %d as %d, not %d, after %d "
+                        "steps with %d stops\n", call->floor, (int) call->type, score,
+                        expected, i+1, size_stop_queue(info->queue));
+                exit(1);
+            }
+        }
+    }
+
+    score_weight_distance = weight_distance;
+    score_weight_stops = weight_stops;
+    score_model = SCORE_ETA;
+}
+
+/* Enqueue an event behind the others and take the first, as the elevator does */
+static void op_enqueue_event(long iterations)
+{
+    long i;
+    struct event event;
+    struct cabin *cabin = cabins[1];
+    int depth = cabin->num_events;
+
+    event.type = CabinButton;
+    event.desc.cbp.cabin = 1;
+
+    for (i = 0; i < iterations; i++) {
+        event.desc.cbp.floor = floors[i & (NUM_INPUTS-1)];
+        enqueue_event(1, &event);
+
+        /* Merged buttons leave nothing to take */
+        if (cabin->num_events > depth)
+            dequeue_event(cabin, &event);
+    }
+}
+
+/* Push a stop and pop the first, keeping the length */
+static void op_stop_queue(long iterations)
+{
+    long i;
+    elevator_information *info = &cabins[1]->info;
+
+    for (i = 0; i < iterations; i++) {
+        push_stop_queue(floors[i & (NUM_INPUTS-1)], 0, info->position, info);
+        pop_stop_queue(info->queue);
+    }
+}
+
+static volatile int sink;
+
+static void op_distance_to_floor(long iterations)
+{
+    long i;
+
+    for (i = 0; i < iterations; i++)
+        sink = distance_to_floor(&calls[i & (NUM_INPUTS-1)], &cabins[1]->info);
+}
+
+/* A call the cabin takes only after all of its stops, the worst case */
+static void op_distance_past_stops(long iterations)
+{
+    long i;
+    FloorButtonPressDesc call = { 0, GoingDown };
+
+    for (i = 0; i < iterations; i++)
+        sink = distance_to_floor(&call, &cabins[1]->info);
+}
+
+static void op_get_suitable_elevator(long iterations)
+{
+    long i;
+
+    for (i = 0; i < iterations; i++)
+        sink = get_suitable_elevator(&calls[i & (NUM_INPUTS-1)]);
+}
+
+/*
+ * An in-memory file of position reports with some button presses, the mix
+ * the dispatcher sees while cabins move
+ */
+static int event_file(int binary)
+{
+    int fd, len;
+    long i;
+    char line[64];
+    HWFrame frame;
+    FILE *file;
+
+    if ((fd = memfd_create("events", 0)) < 0) {
+        perror("memfd_create");
+        exit(1);
+    }
+    file = fdopen(dup(fd), "w");
+
+    for (i = 0; i < NUM_EVENTS; i++) {
+        frame.reserved = 0;
+
+        if (i % 16 == 0) {
+            frame.type = 'b';
+            frame.cabin = floors[i & (NUM_INPUTS-1)];
+            frame.value = GoingUp;
+            len = sprintf(line, "b %d %d\n", frame.cabin, frame.value);
+        } else if (i % 16 == 8) {
+            frame.type = 'p';
+            frame.cabin = i % 8 + 1;
+            frame.value = floors[i & (NUM_INPUTS-1)];
+            len = sprintf(line, "p %d %d\n", frame.cabin, frame.value);
+        } else {
+            frame.type = 'f';
+            frame.cabin = i % 8 + 1;
+            frame.value = (int) ((i % 500) * 0.04 * HW_FRAME_SCALE);
+            len = sprintf(line, "f %d %.17g\n", frame.cabin, (i % 500) * 0.04);
+        }
+
+        if (binary) {
+            frame.cabin = htons(frame.cabin);
+            frame.value = htonl(frame.value);
+            fwrite(&frame, sizeof(frame), 1, file);
+        } else {
+            fwrite(line, len, 1, file);
+        }
+    }
+
+    fclose(file);
+    lseek(fd, 0, SEEK_SET);
+
+    return fd;
+}
+
+static void measure_wait_for_event(int binary)
+{
+    int fd = event_file(binary);
+    long i, start, allocs;
+    EventDesc desc;
+
+    attachHW(fd, binary);
+
+    allocs = allocations;
+    start = now();
+    for (i = 0; i < NUM_EVENTS; i++)
+        if (waitForEvent(&desc) == Error) {
+            fprintf(stderr, "Bad event %ld: %s\n", i, desc.e.str);
+            exit(1);
+        }
+    start = now()-start;
+    allocs = allocations-allocs;
+
+    record("waitForEvent", binary ? "binary" : "text", NUM_EVENTS, start, NUM_EVENTS, allocs);
+
+    close(fd);
+}
+
+static void write_json(const char *path, const char *commit)
+{
+    int i;
+    FILE *file;
+
+    if ((file = fopen(path, "w")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    fprintf(file, "{\n  \"commit\": \"%s\",\n  \"results\": [\n", commit);
+
+    for (i = 0; i < num_results; i++)
+        fprintf(file, "    {\"name\": \"%s\", \"%s\": %d, \"ns_per_op\": %.2f, "
+                "\"allocs_per_op\": %.3f}%s\n", results[i].name, results[i].param,
+                results[i].value, results[i].ns, results[i].allocs,
+                i < num_results-1 ? "," : "");
+
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+int main(int argc, char **argv)
+{
+    static const int lengths[] = { 0, 1, 4, 16, 64 };
+    static const int depths[] = { 0, 1, 4, 16, CABIN_QUEUE_SATURATED };
+    static const int fleets[] = { 1, 4, 16, 64, 256 };
+    int i, j;
+
+    /* Scored as after runs at a floor a second with 1.5 s of acceleration */
+    eta_open(FLOORS);
+    for (i = 0; i < 2*ETA_MIN_RUNS; i++)
+        eta_run(FLOOR_POSITION(1 + i%FLOORS), 1000*(1 + i%FLOORS) + 1500);
+
+    srand(1);
+    for (i = 0; i < NUM_INPUTS; i++) {
+        floors[i] = rand() % FLOORS;
+        calls[i].floor = floors[i];
+        calls[i].type = (rand() & 1) ? GoingUp : GoingDown;
+    }
+
+    verify_plan();
+
+    printf("%-24s %8s %6s %12s %12s\n", "function", "", "", "ns/op", "allocs/op");
+
+    for (i = 0; i < sizeof(depths)/sizeof(int); i++) {
+        struct event event = { Destination };
+
+        /* Passengers are never merged, buttons are merged up to FLOORS */
+        setup_fleet(1, 0);
+        for (j = 0; j < depths[i]; j++)
+            enqueue_event(1, &event);
+        measure("enqueue_event", "events", depths[i], op_enqueue_event);
+
+        while (dequeue_event(cabins[1], &event))
+            ;
+    }
+
+    for (i = 0; i < sizeof(lengths)/sizeof(int); i++) {
+        setup_fleet(1, lengths[i]);
+        measure("push+pop_stop_queue", "stops", lengths[i], op_stop_queue);
+    }
+
+    for (i = 0; i < sizeof(lengths)/sizeof(int); i++) {
+        setup_fleet(1, lengths[i]);
+        measure("distance_to_floor", "stops", lengths[i], op_distance_to_floor);
+    }
+
+    for (i = 0; i < sizeof(lengths)/sizeof(int); i++) {
+        setup_fleet(1, lengths[i]);
+        measure("distance_past_stops", "stops", lengths[i], op_distance_past_stops);
+    }
+
+    for (i = 0; i < sizeof(fleets)/sizeof(int); i++) {
+        setup_fleet(fleets[i], 4);
+        verify_spatial();
+        measure("get_suitable_elevator", "cabins", fleets[i], op_get_suitable_elevator);
+    }
+
+    measure_wait_for_event(0);
+    measure_wait_for_event(1);
+
+    if (argc > 1)
+        write_json(argv[1], argc > 2 ? argv[2] : "");
+
+    return 0;
+}
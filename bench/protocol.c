@@ -0,0 +1,120 @@
+/*
+ * Throughput of the hardware protocol encodings
+ *
+ * A writer thread encodes position reports, as text lines the way the Java
+ * simulator prints them or as binary frames, into one end of a socket pair
+ * while waitForEvent() parses them from the other end.
+ *
+ * Usage: protocol [events] [cabins]
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "hardwareAPI.h"
+
+#define BATCH 4096
+
+static long num_events = 1000000;
+static int num_cabins = 64;
+static int binary;
+static long bytes;
+
+static void *writer(void *arg)
+{
+    int fd = (int) (long) arg;
+    char out[BATCH+64];
+    int len = 0, done, count;
+    long i;
+    double position;
+    HWFrame frame;
+
+    bytes = 0;
+
+    for (i = 0; i < num_events; i++) {
+        position = (i % 1000) * 0.04;
+
+        if (binary) {
+            frame.type = 'f';
+            frame.reserved = 0;
+            frame.cabin = htons(i % num_cabins + 1);
+            frame.value = htonl((int) (position*HW_FRAME_SCALE));
+            memcpy(out+len, &frame, sizeof(frame));
+            len += sizeof(frame);
+        } else {
+            len += sprintf(out+len, "f %ld %.17g\n", i % num_cabins + 1, position);
+        }
+
+        if (len >= BATCH || i == num_events-1) {
+            for (done = 0; done < len; done += count) {
+                if ((count = write(fd, out+done, len-done)) <= 0)
+                    exit(1);
+            }
+            bytes += len;
+            len = 0;
+        }
+    }
+
+    return NULL;
+}
+
+static double run()
+{
+    int fds[2];
+    long i;
+    pthread_t thread;
+    EventDesc desc;
+    struct timespec a, b;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        exit(1);
+
+    attachHW(fds[0], binary);
+
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    pthread_create(&thread, NULL, writer, (void*) (long) fds[1]);
+
+    for (i = 0; i < num_events; i++) {
+        if (waitForEvent(&desc) != Position) {
+            fprintf(stderr, "Bad event %ld\n", i);
+            exit(1);
+        }
+    }
+
+    pthread_join(thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &b);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    return (b.tv_sec-a.tv_sec) + (b.tv_nsec-a.tv_nsec)/1e9;
+}
+
+int main(int argc, char **argv)
+{
+    double seconds;
+
+    if (argc > 1)
+        num_events = atol(argv[1]);
+    if (argc > 2)
+        num_cabins = atoi(argv[2]);
+
+    printf("%8s %14s %12s %12s\n", "encoding", "events/s", "ns/event", "bytes/event");
+
+    for (binary = 0; binary <= 1; binary++) {
+        seconds = run();
+        printf("%8s %14.0f %12.1f %12.1f\n", binary ? "binary" : "text",
+               num_events/seconds, seconds*1e9/num_events, (double) bytes/num_events);
+    }
+
+    return 0;
+}
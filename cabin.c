@@ -0,0 +1,137 @@
+/*
+ * Allocation and placement of per-cabin contexts
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cabin.h"
+#include "rt.h"
+
+/*
+ * Returns a new initialized cabin context, aligned to a cache line, with
+ * room for a cabin call to every floor on top of the other events
+ */
+struct cabin *new_cabin(int num_floors)
+{
+    struct cabin *cabin;
+    pthread_condattr_t attr;
+
+    if (posix_memalign((void**) &cabin, CACHE_LINE_SIZE, sizeof(struct cabin)))
+        return NULL;
+
+    /* Touch all of it here, see header regarding NUMA placement */
+    memset(cabin, 0, sizeof(struct cabin));
+
+    cabin->size_events = CABIN_QUEUE_SIZE + num_floors + CABIN_QUEUE_CONTROL;
+    if ((cabin->events = calloc(cabin->size_events, sizeof(struct event))) == NULL) {
+        free(cabin);
+        return NULL;
+    }
+
+    rt_mutex_init(&cabin->event_buffer_mutex);
+    /* Door dwell is waited for on the monotonic clock */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cabin->signal, &attr);
+    pthread_condattr_destroy(&attr);
+
+    cabin->head = cabin->num_events = 0;
+    cabin->position_pending = cabin->door_state_pending = 0;
+    cabin->saturated = 0;
+    cabin->in_service = 1;
+
+    cabin->info.position = 0;
+    cabin->info.queue = NULL;
+
+    cabin->door.position = cabin->info.position;
+    cabin->door.repetitions = 0;
+    cabin->door.state = -1;
+    cabin->door.commanded = -1;
+
+    return cabin;
+}
+
+/* Destroys a cabin context, the stop queue is left to its owner */
+void destroy_cabin(struct cabin *cabin)
+{
+    pthread_mutex_destroy(&cabin->event_buffer_mutex);
+    pthread_cond_destroy(&cabin->signal);
+
+    free(cabin->events);
+    free(cabin);
+}
+
+int cabin_cpu(struct affinity *affinity, int id)
+{
+    if (!affinity->num_cabin_cpus)
+        return -1;
+
+    return affinity->cabin_cpus[(id-1) % affinity->num_cabin_cpus];
+}
+
+int parse_cpu_list(const char *list, int **cpus)
+{
+    int count = 0;
+    int first, last, cpu;
+    const char *curr = list;
+    char *end;
+
+    *cpus = NULL;
+
+    while (*curr) {
+        first = last = strtol(curr, &end, 10);
+        if (end == curr || first < 0)
+            goto error;
+
+        /* Range of cpus */
+        if (*end == '-') {
+            curr = end+1;
+            last = strtol(curr, &end, 10);
+            if (end == curr || last < first)
+                goto error;
+        }
+
+        *cpus = realloc(*cpus, (count+last-first+1)*sizeof(int));
+        for (cpu = first; cpu <= last; cpu++)
+            (*cpus)[count++] = cpu;
+
+        if (*end == ',')
+            end++;
+        else if (*end)
+            goto error;
+
+        curr = end;
+    }
+
+    return count;
+
+error:
+    free(*cpus);
+    *cpus = NULL;
+
+    return -1;
+}
+
+int pin_thread(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return 0;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+}
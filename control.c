@@ -0,0 +1,621 @@
+/*
+ * Local control socket
+ *
+ * Served by a thread of its own, one client at a time. Commands take effect
+ * while the controller keeps running, no state is lost.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "controller.h"
+#include "dwell.h"
+#include "eta.h"
+#include "steal.h"
+#include "group.h"
+#include "handoff.h"
+#include "headway.h"
+#include "journal.h"
+#include "pipeline.h"
+#include "rt.h"
+#include "log.h"
+#include "output.h"
+#include "telemetry.h"
+#include "traffic.h"
+
+static int control_fd = -1;
+static char control_path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+static pthread_t control_thread;
+
+/* Write a formatted reply line */
+static void reply(int fd, const char *format, ...)
+{
+    char line[CONTROL_LINE_SIZE];
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(line, sizeof(line)-1, format, args);
+    va_end(args);
+
+    if (len < 0)
+        return;
+    if (len > sizeof(line)-2)
+        len = sizeof(line)-2;
+
+    line[len++] = '\n';
+    if (write(fd, line, len) < 0)
+        return;
+}
+
+/* Cabin id from a command argument, 0 if not valid */
+static int parse_cabin(const char *arg)
+{
+    int id = arg ? atoi(arg) : 0;
+
+    return (id >= 1 && id <= num_elevators) ? id : 0;
+}
+
+/* Score function weight from a command argument, -1 if not valid */
+static int parse_weight(const char *arg)
+{
+    char *end;
+    long weight = strtol(arg, &end, 10);
+
+    return (end != arg && *end == '\0' && weight >= 0 && weight <= INT_MAX) ? weight : -1;
+}
+
+static void set_service(int fd, int id, int in_service)
+{
+    struct event event;
+
+    __atomic_store_n(&cabins[id]->in_service, in_service, __ATOMIC_RELAXED);
+
+    /* Wake the elevator so it hands over its hall calls right away */
+    event.type = Service;
+    event.desc.sd.cabin = id;
+    event.desc.sd.in_service = in_service;
+
+    /* Merged with a change not yet taken, see include/cabin.h */
+    if (enqueue_event(id, &event)) {
+        reply(fd, "error cabin %d has no room", id);
+        return;
+    }
+    pthread_cond_signal(&cabins[id]->signal);
+
+    reply(fd, "ok");
+}
+
+static void dump(int fd)
+{
+    int i, j, len;
+    char stops[CONTROL_LINE_SIZE];
+    struct telemetry_cabin state;
+
+    reply(fd, "weights %d %d", score_weight_distance, score_weight_stops);
+    reply(fd, "level %d", log_level);
+
+    for (i = 1; i <= num_elevators; i++) {
+        if (telemetry_read_cabin(i, &state)) {
+            reply(fd, "cabin %d %s position %.4f", i, cabins[i]->in_service ? "in" : "out",
+                  (double) cabins[i]->info.position/HW_POSITION_SCALE);
+            continue;
+        }
+
+        len = 0;
+        stops[0] = '\0';
+        for (j = 0; j < state.num_stops && j < TELEMETRY_MAX_STOPS; j++)
+            len += snprintf(stops+len, sizeof(stops)-len, " %d", state.stops[j]);
+
+        reply(fd, "cabin %d %s position %.4f direction %d door %d events %d%s stops %d:%s",
+              i, cabins[i]->in_service ? "in" : "out", state.position,
+              state.direction, state.door_state, state.queue_depth,
+              cabins[i]->saturated ? " saturated" : "", state.num_stops, stops);
+    }
+
+    reply(fd, "ok");
+}
+
+/* Calibrated time of arrival, and whether hall calls are scored by it */
+static void eta(int fd)
+{
+    struct eta_model model;
+
+    eta_model(&model);
+
+    reply(fd, "score %s", score_model == SCORE_ETA ? "eta" : "distance");
+    reply(fd, "speed %.3f floor %d ms acceleration %d ms runs %llu %s",
+          model.speed, model.floor_ms, model.accel_ms, (unsigned long long) model.runs,
+          model.fitted ? "fitted" : "averaged");
+    reply(fd, "door open %d ms dwell %d ms close %d ms", model.door_open_ms,
+          model.dwell_ms, model.door_close_ms);
+    reply(fd, "ok");
+}
+
+static void trace(int fd)
+{
+    int i;
+    struct telemetry_cabin state;
+
+    for (i = 1; i <= num_elevators; i++) {
+        if (telemetry_read_cabin(i, &state)) {
+            state.position = (double) cabins[i]->info.position/HW_POSITION_SCALE;
+            state.queue_depth = 0;
+            state.num_stops = 0;
+        }
+
+        /* Logged as errors so snapshots are kept at every level */
+        if (state.num_stops)
+            log_msg(LOG_ERROR, LOG_SNAPSHOT, i, cabins[i]->in_service, state.position,
+                    state.queue_depth, state.num_stops, state.stops[0]);
+        else
+            log_msg(LOG_ERROR, LOG_SNAPSHOT, i, cabins[i]->in_service, state.position,
+                    state.queue_depth, state.num_stops);
+    }
+
+    reply(fd, "ok");
+}
+
+/* Queueing delay of each output class, nonzero buckets only */
+static void output(int fd)
+{
+    static const char *names[OUTPUT_NUM_CLASSES] = {
+        "emergency", "stop", "motion", "indicator"
+    };
+    int i, j, len;
+    char buckets[CONTROL_LINE_SIZE];
+    struct output_stats stats;
+
+    for (i = 0; i < OUTPUT_NUM_CLASSES; i++) {
+        output_stats(i, &stats);
+
+        len = 0;
+        buckets[0] = '\0';
+        for (j = 0; j < OUTPUT_HISTOGRAM_BUCKETS && len < sizeof(buckets); j++)
+            if (stats.histogram[j])
+                len += snprintf(buckets+len, sizeof(buckets)-len, " <%lluus:%llu",
+                                1ull << j, (unsigned long long) stats.histogram[j]);
+
+        reply(fd, "%s sent %llu replaced %llu suppressed %llu p99 <%lluus%s", names[i],
+              (unsigned long long) stats.sent, (unsigned long long) stats.replaced,
+              (unsigned long long) stats.suppressed,
+              (unsigned long long) output_percentile(&stats, 0.99), buckets);
+    }
+
+    reply(fd, "ok");
+}
+
+/* Events each cabin conflated, merged and shed, see include/cabin.h */
+static void overload(int fd)
+{
+    int i;
+    struct telemetry_cabin state;
+
+    for (i = 1; i <= num_elevators; i++) {
+        if (telemetry_read_cabin(i, &state)) {
+            reply(fd, "error no telemetry");
+            return;
+        }
+
+        reply(fd, "cabin %d events %d conflated %llu merged %llu shed %llu saturated %llu",
+              i, state.queue_depth, (unsigned long long) state.conflated,
+              (unsigned long long) state.merged, (unsigned long long) state.shed,
+              (unsigned long long) state.saturated);
+    }
+
+    reply(fd, "held hall calls %d passengers %d",
+          __atomic_load_n(&num_held_calls, __ATOMIC_RELAXED),
+          __atomic_load_n(&num_backlog, __ATOMIC_RELAXED));
+    reply(fd, "ok");
+}
+
+/* Hall calls every cabin claimed from others and lost to them */
+static void steals(int fd)
+{
+    int i;
+    struct steal_stats stats;
+
+    if (!steal_enabled()) {
+        reply(fd, "error stealing disabled");
+        return;
+    }
+
+    for (i = 1; i <= num_elevators; i++) {
+        steal_stats(i, &stats);
+        reply(fd, "cabin %d claimed %llu lost %llu", i,
+              (unsigned long long) stats.claimed, (unsigned long long) stats.lost);
+    }
+
+    reply(fd, "ok");
+}
+
+/* Where every cabin is on the loop, its gap and what was done to keep it */
+static void headway(int fd)
+{
+    int i;
+    struct headway_stats stats;
+
+    if (!headway_enabled()) {
+        reply(fd, "error headway control disabled");
+        return;
+    }
+
+    for (i = 1; i <= num_elevators; i++) {
+        headway_stats(i, &stats);
+        reply(fd, "cabin %d loop %1.2f gap %1.2f penalized %llu holds %llu held %llu ms parks %llu",
+              i, stats.position < 0 ? -1.0 : (double) stats.position/HW_POSITION_SCALE,
+              stats.gap < 0 ? -1.0 : (double) stats.gap/HW_POSITION_SCALE,
+              (unsigned long long) stats.penalized, (unsigned long long) stats.holds,
+              (unsigned long long) stats.held_ms, (unsigned long long) stats.parks);
+    }
+
+    reply(fd, "ok");
+}
+
+/* Pattern of the traffic, the mode it runs and the sector of every cabin */
+static void traffic(int fd)
+{
+    int i, m, low, high;
+    struct traffic_stats stats;
+
+    if (!traffic_enabled()) {
+        reply(fd, "error traffic classifier not running");
+        return;
+    }
+
+    traffic_stats(&stats);
+
+    reply(fd, "pattern %s mode %s%s rate %1.1f calls/min from lobby %1.2f down %1.2f",
+          traffic_pattern_name(stats.pattern), traffic_mode_name(stats.mode),
+          stats.pinned ? " (pinned)" : "", stats.rate, stats.from_lobby, stats.down);
+    reply(fd, "switches %llu", (unsigned long long) stats.switches);
+
+    for (m = 0; m < TRAFFIC_NUM_MODES; m++)
+        reply(fd, "mode %s %llu ms", traffic_mode_name(m), (unsigned long long) stats.ms[m]);
+
+    for (i = 1; i <= num_elevators; i++) {
+        traffic_sector(i, &low, &high);
+        reply(fd, "cabin %d sector %d-%d express %d", i, low, high, traffic_express(i));
+    }
+
+    reply(fd, "ok");
+}
+
+/* What was replayed from the journal and how often it is checkpointed */
+static void journal(int fd)
+{
+    struct journal_stats stats;
+
+    if (!journal_enabled()) {
+        reply(fd, "error journal not open");
+        return;
+    }
+
+    journal_stats(&stats);
+
+    if (stats.replayed < 0)
+        reply(fd, "replay rejected");
+    else
+        reply(fd, "replayed %d cabins %d stops resumed %d cabins in %1.1f ms",
+              stats.replayed, stats.stops, stats.cabins, stats.resume_ms);
+
+    reply(fd, "checkpoints %llu unchanged %llu truncated %llu",
+          (unsigned long long) stats.checkpoints, (unsigned long long) stats.unchanged,
+          (unsigned long long) stats.truncated);
+
+    reply(fd, "ok");
+}
+
+/* Zones of the groups and the hall calls they settled */
+static void groups(int fd)
+{
+    int g;
+    struct group_stats stats;
+
+    for (g = 0; g < group_count(); g++) {
+        group_stats(g, &stats);
+
+        reply(fd, "group %d cabins %d-%d floors %d-%d bids %llu assigned %llu contested %llu",
+              g, stats.first, stats.last, stats.low, stats.high,
+              (unsigned long long) stats.bids, (unsigned long long) stats.assigned,
+              (unsigned long long) stats.contested);
+    }
+
+    reply(fd, "ok");
+}
+
+/* Events taken by every stage of the pipeline and waiting for it */
+static void pipeline(int fd)
+{
+    int i;
+    struct pipeline_stats stats;
+
+    for (i = 0; i < pipeline_count(); i++) {
+        pipeline_stats(i, &stats);
+
+        reply(fd, "%s %d events %llu batches %llu depth %llu max %llu",
+              i ? "scorer" : "fan-out", i,
+              (unsigned long long) stats.events, (unsigned long long) stats.batches,
+              (unsigned long long) stats.depth, (unsigned long long) stats.max_depth);
+    }
+
+    reply(fd, "ok");
+}
+
+/* Scheduling mode and how late the elevator threads woke, by powers of two us */
+static void realtime(int fd)
+{
+    int i;
+    struct rt_stats stats;
+    static const char *modes[] = { "off", "fallback", "fifo" };
+
+    rt_stats(&stats);
+
+    if (stats.mode == RT_OFF) {
+        reply(fd, "error real-time scheduling not asked for");
+        return;
+    }
+
+    reply(fd, "mode %s priorities %d %d %d locked %d threads %d", modes[stats.mode],
+          stats.priorities[RT_DISPATCHER], stats.priorities[RT_OUTPUT],
+          stats.priorities[RT_CABIN], stats.locked, stats.threads);
+    reply(fd, "wakeups %llu max late %llu us", (unsigned long long) stats.samples,
+          (unsigned long long) stats.max_us);
+
+    for (i = 0; i < RT_JITTER_BUCKETS; i++)
+        if (stats.buckets[i])
+            reply(fd, "late %s %llu us %llu", i < RT_JITTER_BUCKETS-1 ? "<" : ">=",
+                  i < RT_JITTER_BUCKETS-1 ? 1ULL << i : 1ULL << (i-1),
+                  (unsigned long long) stats.buckets[i]);
+
+    reply(fd, "ok");
+}
+
+static void control_command(int fd, char *line)
+{
+    char *save;
+    char *cmd = strtok_r(line, " \t\r\n", &save);
+    char *arg1 = strtok_r(NULL, " \t\r\n", &save);
+    char *arg2 = strtok_r(NULL, " \t\r\n", &save);
+    int id;
+    const char *reason;
+
+    if (!cmd) {
+        reply(fd, "error empty command");
+    }
+    else if (!strcmp(cmd, "weights")) {
+        int distance, stops;
+
+        if (!arg1 || !arg2) {
+            reply(fd, "error usage: weights <distance> <stops>");
+            return;
+        }
+
+        if ((distance = parse_weight(arg1)) < 0 || (stops = parse_weight(arg2)) < 0) {
+            reply(fd, "error weights need to be integers >= 0");
+            return;
+        }
+
+        __atomic_store_n(&score_weight_distance, distance, __ATOMIC_RELAXED);
+        __atomic_store_n(&score_weight_stops, stops, __ATOMIC_RELAXED);
+        log_msg(LOG_INFO, LOG_WEIGHTS, score_weight_distance, score_weight_stops);
+
+        reply(fd, "ok");
+    }
+    else if (!strcmp(cmd, "service")) {
+        if (!(id = parse_cabin(arg1)) || !arg2 || (strcmp(arg2, "on") && strcmp(arg2, "off"))) {
+            reply(fd, "error usage: service <cabin> <on|off>");
+            return;
+        }
+
+        set_service(fd, id, !strcmp(arg2, "on"));
+    }
+    else if (!strcmp(cmd, "level")) {
+        if (!arg1 || atoi(arg1) < LOG_ERROR || atoi(arg1) > LOG_DEBUG) {
+            reply(fd, "error usage: level <%d-%d>", LOG_ERROR, LOG_DEBUG);
+            return;
+        }
+
+        log_set_level(atoi(arg1));
+        reply(fd, "ok");
+    }
+    else if (!strcmp(cmd, "dump")) {
+        dump(fd);
+    }
+    else if (!strcmp(cmd, "trace")) {
+        trace(fd);
+    }
+    else if (!strcmp(cmd, "output")) {
+        output(fd);
+    }
+    else if (!strcmp(cmd, "resync")) {
+        if (arg1 && !(id = parse_cabin(arg1))) {
+            reply(fd, "error usage: resync [cabin]");
+            return;
+        }
+
+        output_resync(arg1 ? id : 0);
+        reply(fd, "ok");
+    }
+    else if (!strcmp(cmd, "dwell")) {
+        char *arg3 = strtok_r(NULL, " \t\r\n", &save);
+        struct dwell_config config;
+
+        if (arg1 && (!arg2 || !arg3)) {
+            reply(fd, "error usage: dwell [<min ms> <max ms> <ms per passenger>]");
+            return;
+        }
+
+        if (arg1) {
+            config.min = atoi(arg1);
+            config.max = atoi(arg2);
+            config.per_passenger = atoi(arg3);
+
+            if (dwell_set(&config)) {
+                reply(fd, "error dwell needs 0 <= min <= max and ms per passenger >= 0");
+                return;
+            }
+        }
+
+        dwell_get(&config);
+        reply(fd, "dwell min %d max %d per passenger %d", config.min, config.max,
+              config.per_passenger);
+        reply(fd, "ok");
+    }
+    else if (!strcmp(cmd, "eta")) {
+        eta(fd);
+    }
+    else if (!strcmp(cmd, "overload")) {
+        overload(fd);
+    }
+    else if (!strcmp(cmd, "steals")) {
+        steals(fd);
+    }
+    else if (!strcmp(cmd, "headway")) {
+        headway(fd);
+    }
+    else if (!strcmp(cmd, "traffic")) {
+        traffic(fd);
+    }
+    else if (!strcmp(cmd, "handoff")) {
+        /* Answered by the main thread once stopped, see include/handoff.h */
+        if (handoff_request(fd, arg1 ? atoi(arg1) : 0, arg2 ? atoi(arg2) : 0, &reason))
+            reply(fd, "error %s", reason);
+    }
+    else if (!strcmp(cmd, "journal")) {
+        journal(fd);
+    }
+    else if (!strcmp(cmd, "rt")) {
+        realtime(fd);
+    }
+    else if (!strcmp(cmd, "groups")) {
+        groups(fd);
+    }
+    else if (!strcmp(cmd, "pipeline")) {
+        pipeline(fd);
+    }
+    else if (!strcmp(cmd, "help")) {
+        reply(fd, "weights <distance> <stops>");
+        reply(fd, "service <cabin> <on|off>");
+        reply(fd, "level <%d-%d>", LOG_ERROR, LOG_DEBUG);
+        reply(fd, "dump");
+        reply(fd, "trace");
+        reply(fd, "output");
+        reply(fd, "resync [cabin]");
+        reply(fd, "dwell [<min ms> <max ms> <ms per passenger>]");
+        reply(fd, "eta");
+        reply(fd, "overload");
+        reply(fd, "steals");
+        reply(fd, "headway");
+        reply(fd, "traffic");
+        reply(fd, "journal");
+        reply(fd, "handoff <cabins> <floors>");
+        reply(fd, "rt");
+        reply(fd, "groups");
+        reply(fd, "pipeline");
+        reply(fd, "ok");
+    }
+    else {
+        reply(fd, "error unknown command: %s", cmd);
+    }
+}
+
+/* Serve a client until it disconnects */
+static void serve(int fd)
+{
+    char line[CONTROL_LINE_SIZE];
+    char *newline;
+    int len = 0, count;
+
+    while ((count = read(fd, line+len, sizeof(line)-1-len)) > 0) {
+        len += count;
+        line[len] = '\0';
+
+        /* Execute every complete line */
+        while ((newline = strchr(line, '\n')) != NULL) {
+            *newline = '\0';
+            control_command(fd, line);
+
+            len -= newline+1-line;
+            memmove(line, newline+1, len+1);
+        }
+
+        /* Line too long */
+        if (len == sizeof(line)-1) {
+            reply(fd, "error line too long");
+            len = 0;
+        }
+    }
+}
+
+static void *controller(void *arg)
+{
+    int fd;
+
+    while ((fd = accept(control_fd, NULL, NULL)) >= 0) {
+        serve(fd);
+        close(fd);
+    }
+
+    return ((void*) NULL);
+}
+
+int control_open(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((control_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return 1;
+
+    /* Remove a stale socket left by a previous run */
+    unlink(path);
+
+    if (bind(control_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+            listen(control_fd, 4) < 0) {
+        close(control_fd);
+        control_fd = -1;
+        return 1;
+    }
+
+    strcpy(control_path, path);
+
+    if (pthread_create(&control_thread, NULL, controller, NULL) != 0) {
+        control_close();
+        return 1;
+    }
+    pthread_detach(control_thread);
+
+    return 0;
+}
+
+void control_close()
+{
+    if (control_fd < 0)
+        return;
+
+    unlink(control_path);
+    close(control_fd);
+    control_fd = -1;
+}
@@ -15,134 +15,138 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
-#include <math.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
 
 #include "hardwareAPI.h"
+#include "cabin.h"
+#include "controller.h"
+#include "control.h"
+#include "dwell.h"
+#include "eta.h"
+#include "log.h"
+#include "group.h"
+#include "handoff.h"
+#include "headway.h"
+#include "journal.h"
+#include "output.h"
+#include "pipeline.h"
+#include "rt.h"
+#include "spatial.h"
+#include "steal.h"
+#include "telemetry.h"
+#include "traffic.h"
 
 /* Elevator has arrived at next floor if abs(position-next_floor) 
-   is smaller than this interval */
-#define DIFF_AT_FLOOR 0.05
+   is smaller than this interval, in 1/HW_POSITION_SCALE floor */
+#define DIFF_AT_FLOOR (HW_POSITION_SCALE/20)
 
 /* Number times are position events sent to indicate the door opening */
 #define DOOR_OPENING_REPETITIONS 4
 
-/* Weights for elevator score function */
-#ifndef SCORE_WEIGHT_DISTANCE
-#define SCORE_WEIGHT_DISTANCE 1
-#endif
-#ifndef SCORE_WEIGHT_STOPS
-#define SCORE_WEIGHT_STOPS 3
-#endif
+/* How long to wait for the hardware to accept binary framing, ms */
+#define BINARY_NEGOTIATION_TIMEOUT 1000
 
-/* Structure for passing events between threads */
-struct event {
-    EventType type;
-    EventDesc desc;
-};
+/* How long to wait for the hardware to accept destination dispatch, ms */
+#define DESTINATION_NEGOTIATION_TIMEOUT 1000
 
-/*
- * Linked buffer definition
- * Used to buffer commands to be processed independently by elevator
- */
-struct event_buffer {
-    struct event_buffer *next;
-    struct event event;
-} event_buffer;
+/* Cabins not answering whereIs are asked again this often, and given up on
+   after SYNC_TIMEOUT, ms */
+#define SYNC_RETRY   1000
+#define SYNC_TIMEOUT 10000
 
-/*
- * Stop queue structures
- * TODO: Move to a separate file
- */
-typedef struct node_stop_queue {
-    int floor;
-    struct node_stop_queue* next;
-} node_stop_queue;
+/* Elevator information global variable */
+short running = 1;
+pthread_mutex_t term_cnt_mutex;
+int num_terminated = 0;
 
-typedef struct {
-    int size;
-    node_stop_queue* first;
-} stop_queue;
+short num_elevators = 0;
+short num_floors = 0;
 
-/* Structure for saving a partial state of an elevator */
-typedef struct
-{
-    double position;
-    stop_queue *queue;
-} elevator_information;
+double speed = 0.0;
 
-/* Structure for interpret door openings */
-struct door_state_counter {
-    double position;
-    short repetitions;
-    int state;
-};
+/* Score function, set by --score, and weights of the distance model */
+int score_model = SCORE_ETA;
+int score_weight_distance = SCORE_WEIGHT_DISTANCE;
+int score_weight_stops = SCORE_WEIGHT_STOPS;
 
-/* Worker functions */
-void *dispatcher(void *arg);
-void *elevator(void *arg);
+/* Per-cabin contexts, indexed by cabin id and allocated by its own thread */
+struct cabin **cabins;
 
-/* Helper functions */
-void enqueue_event(int elevator, struct event *event);
-int distance_to_floor(FloorButtonPressDesc *floor_button, elevator_information* info);
-int get_suitable_elevator(FloorButtonPressDesc *floor_button);
-void printq(int id, stop_queue *q);
+/* CPU placement of threads, set by --affinity */
+struct affinity affinity = { -1, 0, NULL };
 
-/* Thread safe wrapper for elevator control functions */
-void handle_door(int cabin, DoorAction action);
-void handle_motor(int cabin, MotorAction action);
-void handle_scale(int cabin, int floor);
+/* All elevator threads have allocated their context */
+pthread_barrier_t cabins_ready;
 
-/*
- * Stop queue API
- * TODO: Move to a separate file
- */
-stop_queue* new_stop_queue();
-int destroy_stop_queue(stop_queue*);
+/* Groups of cabins dispatching their own zone, set by --groups */
+int num_groups = 1;
 
-int push_stop_queue(int floor, int direction, double position, elevator_information* info);
-int pop_stop_queue(stop_queue* q);
-int peek_stop_queue(stop_queue* q);
+/* Threads scoring hall calls in the pipeline, set by --workers, 0 if serial */
+int num_workers = 0;
 
-int size_stop_queue(stop_queue* q);
+/* Flag for verbosity */
+short verbose = 0;
 
+/* Flag for asking the hardware for binary framing */
+short binary = 0;
 
-/* Elevator information global variable */
-short running = 1;
-pthread_mutex_t term_cnt_mutex;
-int num_terminated = 0;
+/* Flag for asking the hardware for destination dispatch */
+short destination = 0;
 
-short num_elevators = 0;
-short num_floors = 0;
+/* Flag for keeping hall calls with the cabin first assigned, no stealing */
+short no_steal = 0;
 
-elevator_information *elevator_info;
+/* Flag for dispatching without regard to the spacing of cabins */
+short no_headway = 0;
 
-struct door_state_counter *door_state_counter;
+/* Flag for real-time scheduling, priorities set by --realtime */
+short realtime = 0;
 
-/* Flag for verbosity */
-short verbose = 0;
+/* Binary log file, text on stdout if not given */
+char *log_path = NULL;
+
+/* Name of the shared memory telemetry region */
+char *telemetry_name = TELEMETRY_DEFAULT_NAME;
+
+/* Path of the control socket, none if not given */
+char *control_path = NULL;
+
+/* Checkpoint journal of the cabin plans, in memory if not given */
+char *journal_path = NULL;
+
+/* Control socket of the controller to take over from, none if not given */
+char *upgrade_path = NULL;
+
+/*
+ * Destination dispatch, passengers arriving while all cabins are full. Only
+ * touched by the thread dispatching events, the fan-out stage if pipelined.
+ */
+DestinationPressDesc *backlog = NULL;
+int num_backlog = 0;
+
+/*
+ * Hall calls arriving while all cabins are full, held back by whichever
+ * thread assigns them and dispatched again along with the passengers
+ */
+pthread_mutex_t held_calls_mutex = PTHREAD_MUTEX_INITIALIZER;
+FloorButtonPressDesc *held_calls = NULL;
+int num_held_calls = 0;
 
 /* Thread inter communications */
 
 /*
- * Calls to API functions are critical sections, need mutex to assure correct
- * execution.
+ * Calls to API functions are critical sections, they are all queued to the
+ * output scheduler which sends them one at a time by priority.
  *
  * Each elevator thread will receive a unique conditional variable to wait upon
  * new commands and information to act upon
  *
  * These commands will be placed in shared address space while mutually excluded
- * using a elevator unique mutex
+ * using a elevator unique mutex, both kept in the cabin context
  */
-pthread_mutex_t api_send_mutex;
-
-pthread_mutex_t *elevator_event_buffer_mutex;
-pthread_cond_t *elevator_signal;
-
-/* Elevator-independent buffer of events to be processed */
-struct event_buffer **elevator_event_buffer;
-
 /* Handle SIGTERM events */
 void sigterm_callback_handler(int signum) 
 {
@@ -154,6 +158,15 @@ void sigterm_callback_handler(int signum)
         running = 0;
 }
 
+/* Raise (SIGUSR1) or lower (SIGUSR2) the log level at runtime */
+void sigusr_callback_handler(int signum)
+{
+    if (signum == SIGUSR1 && log_level < LOG_DEBUG)
+        log_set_level(log_level+1);
+    else if (signum == SIGUSR2 && log_level > LOG_ERROR)
+        log_set_level(log_level-1);
+}
+
 /* Parse the command line arguments for operational flags */
 void parse_flags(int argc, char **argv, char **hostname, short *port)
 {
@@ -178,20 +191,120 @@ void parse_flags(int argc, char **argv, char **hostname, short *port)
                 num_elevators = atoi(argv[i+1]);
                 i++;                    /* Skip next position as it was a value */
             }
+            else if (!strcmp(argv[i], "-l") || !strcmp(argv[i], "--log")) {
+                log_path = argv[i+1];
+                i++;                    /* Skip next position as it was a value */
+            }
+            else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--telemetry")) {
+                telemetry_name = argv[i+1];
+                i++;                    /* Skip next position as it was a value */
+            }
+            else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--control")) {
+                control_path = argv[i+1];
+                i++;                    /* Skip next position as it was a value */
+            }
+            else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--journal")) {
+                journal_path = argv[i+1];
+                i++;                    /* Skip next position as it was a value */
+            }
+            else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--upgrade")) {
+                upgrade_path = argv[i+1];
+                i++;                    /* Skip next position as it was a value */
+            }
+            else if (!strcmp(argv[i], "-g") || !strcmp(argv[i], "--groups")) {
+                num_groups = atoi(argv[i+1]);
+                i++;                    /* Skip next position as it was a value */
+            }
+            else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--score")) {
+                if (!strcmp(argv[i+1], "eta"))
+                    score_model = SCORE_ETA;
+                else if (!strcmp(argv[i+1], "distance"))
+                    score_model = SCORE_DISTANCE;
+                else {
+                    fprintf(stderr, "Unknown score: %s - Exiting...\n", argv[i+1]);
+                    exit(1);
+                }
+                i++;                    /* Skip next position as it was a value */
+            }
+            else if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--workers")) {
+                num_workers = atoi(argv[i+1]);
+                i++;                    /* Skip next position as it was a value */
+            }
+            else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--affinity")) {
+                int *cpus;
+                int num_cpus = parse_cpu_list(argv[i+1], &cpus);
+
+                if (num_cpus <= 0) {
+                    fprintf(stderr, "Bad cpu list: %s - Exiting...\n", argv[i+1]);
+                    exit(1);
+                }
+
+                /* First cpu runs the dispatcher, the rest are shared by elevators */
+                affinity.dispatcher_cpu = cpus[0];
+                affinity.num_cabin_cpus = num_cpus-1;
+                affinity.cabin_cpus = cpus+1;
+                i++;                    /* Skip next position as it was a value */
+            }
+            else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--mode")) {
+                if (traffic_parse(argv[i+1])) {
+                    fprintf(stderr, "Unknown mode: %s - Exiting...\n", argv[i+1]);
+                    exit(1);
+                }
+                i++;                    /* Skip next position as it was a value */
+            }
+            else if (!strcmp(argv[i], "-R") || !strcmp(argv[i], "--realtime")) {
+                if (rt_parse(argv[i+1])) {
+                    fprintf(stderr, "Bad priorities: %s - Exiting...\n", argv[i+1]);
+                    exit(1);
+                }
+
+                realtime = 1;
+                i++;                    /* Skip next position as it was a value */
+            }
             else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
                 verbose = 1;
             }
+            else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--binary")) {
+                binary = 1;
+            }
+            else if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--destination")) {
+                destination = 1;
+            }
+            else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--no-steal")) {
+                no_steal = 1;
+            }
+            else if (!strcmp(argv[i], "-H") || !strcmp(argv[i], "--no-headway")) {
+                no_headway = 1;
+            }
         }
         else { /* not value base as it's last */
             if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
                 verbose = 1;
             }
+            else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--binary")) {
+                binary = 1;
+            }
+            else if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--destination")) {
+                destination = 1;
+            }
+            else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--no-steal")) {
+                no_steal = 1;
+            }
+            else if (!strcmp(argv[i], "-H") || !strcmp(argv[i], "--no-headway")) {
+                no_headway = 1;
+            }
             else {
                 fprintf(stderr, "Unrecognized flag: %s - Exiting...\n", argv[i]);
                 exit(1);
             }
         }
     }
+
+    /* Destinations are counted per floor, see assign_destination */
+    if (destination && num_floors <= 0) {
+        fprintf(stderr, "Destination dispatch needs the floors (-f) - Exiting...\n");
+        exit(1);
+    }
 }
 
 /*
@@ -202,6 +315,7 @@ void parse_flags(int argc, char **argv, char **hostname, short *port)
 int main(int argc, char **argv)
 {
     long i;
+    int handing_over;
     struct event event;
 
     /* Default connection info to Java GUI */
@@ -217,27 +331,54 @@ int main(int argc, char **argv)
     /* Parse arguments */
     parse_flags(argc, argv, &hostname, &port);
 
-    /* Init shared space variables */
-    elevator_event_buffer_mutex = malloc((num_elevators+1)*sizeof(pthread_mutex_t));
-    elevator_signal = malloc((num_elevators+1)*sizeof(pthread_cond_t));
+    /* Before any thread is started, runs as usual if not permitted */
+    if (realtime) {
+        rt_open();
+        atexit(rt_close);
+    }
+
+    /* Start logging, everything logged is drained also on exit() */
+    signal(SIGUSR1, sigusr_callback_handler);
+    signal(SIGUSR2, sigusr_callback_handler);
+
+    if (log_open(log_path, verbose ? LOG_DEBUG : LOG_ERROR)) {
+        perror("Cannot open log\n");
+        exit(2);
+    }
+    atexit(log_close);
 
-    door_state_counter = malloc((num_elevators+1)*sizeof(struct door_state_counter));
-    elevator_event_buffer = malloc((num_elevators+1)*sizeof(struct event_buffer*));
-    elevator_info = malloc((num_elevators+1)*sizeof(elevator_information));
+    /* Publish live state, the controller runs fine without it */
+    if (telemetry_open(telemetry_name, num_elevators, num_floors))
+        fprintf(stderr, "Cannot open telemetry %s\n", telemetry_name);
+    atexit(telemetry_close);
 
-    for (i = 1; i <= num_elevators; i++) {
-        pthread_mutex_init(&elevator_event_buffer_mutex[i], NULL);
-        pthread_cond_init(&elevator_signal[i], NULL);
+    /*
+     * Before the elevators are up to checkpoint into it. Not closed on exit(),
+     * a journal closed is clean and not replayed. Kept in memory to hand over
+     * without a file.
+     */
+    if ((journal_path || control_path || upgrade_path) &&
+            journal_open(journal_path, num_elevators, num_floors))
+        fprintf(stderr, "Cannot open journal %s\n", journal_path ? journal_path : "in memory");
 
-        elevator_event_buffer[i] = NULL;
+    /* Init shared space variables, the contexts are filled in by each thread */
+    cabins = calloc(num_elevators+1, sizeof(struct cabin*));
+    pthread_barrier_init(&cabins_ready, NULL, num_elevators+1);
 
-        elevator_info[i].position = 0.0;
-        elevator_info[i].queue = new_stop_queue();
+    /* Rank large fleets by the cabins near each call, linearly without it */
+    if (num_elevators >= SPATIAL_MIN_CABINS && spatial_open(num_elevators, num_floors))
+        fprintf(stderr, "Cannot allocate spatial index\n");
 
-        door_state_counter[i].position = elevator_info[i].position;
-        door_state_counter[i].repetitions = 0;
-        door_state_counter[i].state = -1;
-    }
+    /* Times of arrival are estimated linearly by floors without the table */
+    if (eta_open(num_floors))
+        fprintf(stderr, "Cannot allocate travel time table\n");
+
+    /* Doors dwell on the calls at each stop alone without learned rates */
+    if (dwell_open(num_floors))
+        fprintf(stderr, "Cannot allocate door dwell rates\n");
+
+    if (pin_thread(affinity.dispatcher_cpu))
+        fprintf(stderr, "Cannot pin dispatcher to cpu %d\n", affinity.dispatcher_cpu);
 
     /*
      * Spawn threads to handle elevators
@@ -252,37 +393,164 @@ int main(int argc, char **argv)
         }
     }
 
-    if (verbose) 
+    pthread_barrier_wait(&cabins_ready);
+
+    /* Accept commands once all elevators are up, taking over the socket of
+       the controller handing over once it has */
+    if (control_path && !upgrade_path) {
+        if (control_open(control_path))
+            fprintf(stderr, "Cannot open control socket %s\n", control_path);
+        atexit(control_close);
+    }
+
+    /* Reads and dispatches from here on, threads left to start set their own */
+    rt_thread(RT_DISPATCHER);
+
+    if (verbose && score_model == SCORE_ETA)
+        printf("Score function: time of arrival\n");
+    else if (verbose) 
         printf("Score function weights:\nweigth_distance = %i\nweigth_stops = %i\n", 
-               SCORE_WEIGHT_DISTANCE, SCORE_WEIGHT_STOPS);
+               score_weight_distance, score_weight_stops);
     
-    printf("Init connection to \"hardware\"\n");
-    fflush(stdout);
+    if (upgrade_path) {
+        printf("Taking over \"hardware\" from %s\n", upgrade_path);
+        fflush(stdout);
+
+        /* Connected and negotiated as the controller handing over was */
+        if (handoff_receive(upgrade_path)) {
+            fprintf(stderr, "Cannot take over from %s\n", upgrade_path);
+            exit(1);
+        }
+
+        if (control_path) {
+            if (control_open(control_path))
+                fprintf(stderr, "Cannot open control socket %s\n", control_path);
+            atexit(control_close);
+        }
+    }
+    else {
+        printf("Init connection to \"hardware\"\n");
+        fflush(stdout);
+
+        /* Init connection to java gui, retried until it accepts */
+        initHW(hostname, port);
+
+        /* Falls back on hall buttons if not supported, negotiated in text */
+        if (destination) {
+            destination = negotiateDestinationHW(DESTINATION_NEGOTIATION_TIMEOUT);
+            printf("Using %s\n", destination ? "destination dispatch" : "hall buttons");
+        }
+
+        /* Falls back on the text protocol if not supported */
+        if (binary) {
+            binary = negotiateBinaryHW(BINARY_NEGOTIATION_TIMEOUT);
+            printf("Using %s protocol\n", binary ? "binary" : "text");
+        }
+    }
+
+    if (output_open(num_elevators)) {
+        fprintf(stderr, "Failed to start output scheduler\n");
+        exit(1);
+    }
+
+    /* Zones dispatch their hall calls themselves, held back calls included */
+    if (num_groups > 1 && group_open(num_groups)) {
+        fprintf(stderr, "Cannot split %d elevators and %d floors into %d groups\n",
+                num_elevators, num_floors, num_groups);
+        exit(1);
+    }
+
+    /* Hall calls stay with the cabin first assigned without the board, in
+       place before plans are resumed during sync */
+    if (!no_steal && steal_open(num_floors, num_elevators))
+        fprintf(stderr, "Cannot allocate hall call board\n");
 
-    /* Init connection to java gui */
-    initHW(hostname, port);
+    /* Cabins are dispatched as if alone without the loop */
+    if (!no_headway && headway_open(num_floors, num_elevators))
+        fprintf(stderr, "Cannot allocate headway loop\n");
 
-    printf("Wait for 5s for java gui to initialize\n");
+    /* Collective control all day without the classifier */
+    if (traffic_open(num_floors, num_elevators))
+        fprintf(stderr, "Cannot allocate traffic classifier\n");
+
+    /* The gui is ready once it answers, no need to wait any longer */
+    printf("Synchronizing with \"hardware\"\n");
     fflush(stdout);
-    sleep(5);
+    sync_hardware();
+
+    /* Positions are known, hall calls may be scored while reading goes on */
+    if (num_workers && pipeline_open(num_workers)) {
+        fprintf(stderr, "Cannot start a pipeline of %d workers\n", num_workers);
+        exit(1);
+    }
+
+    if (upgrade_path) {
+        log_msg(LOG_INFO, LOG_HANDOFF_PAUSE, handoff_pause());
+        printf("Took over in %1.1f ms\n", handoff_pause());
+        fflush(stdout);
+    }
 
     /* Enter dispatcher function */
     dispatcher(NULL);
 
+    /* Stopped for a new controller to take over, see include/handoff.h */
+    handing_over = handoff_pending();
+
+    pipeline_close();
+    group_close();
+
+    /* Hall calls held back for want of room reach the elevators before they
+       stop, their plans are checkpointed and handed over in full */
+    while (__atomic_load_n(&num_held_calls, __ATOMIC_ACQUIRE)) {
+        dispatch_backlog();
+        usleep(1000);
+    }
+
     /* Send shutdown request and await termination of elevators */
     event.type = Shutdown;
 
     for (i = 1; i <= num_elevators; i++) {
-        enqueue_event(i, &event);
-        pthread_cond_signal(&elevator_signal[i]);
+        /* Always fits, see include/cabin.h, else it would be waited for forever */
+        if (enqueue_event(i, &event)) {
+            fprintf(stderr, "Cannot stop elevator %ld, exiting\n", i);
+            exit(1);
+        }
+        pthread_cond_signal(&cabins[i]->signal);
     }
     
-    while (num_terminated != num_elevators) sleep(1);
+    while (num_terminated != num_elevators) usleep(1000);
+
+    spatial_close();
+    dwell_close();
+    steal_close();
+    headway_close();
+    traffic_close();
+    eta_close();
+
+    /* Send what the elevators left behind before the terminate */
+    output_close();
+
+    /*
+     * The journal is left as is for the new controller, the control socket
+     * and telemetry are its own by now, so exit without the handlers but
+     * the log's.
+     */
+    if (handing_over) {
+        if (handoff_send()) {
+            fprintf(stderr, "Cannot hand over, exiting\n");
+            exit(1);
+        }
+
+        log_close();
+        _exit(0);
+    }
+
+    journal_close();
 
     /* Kill elevator */
     if (verbose)
         printf("Shutting down GUI.\n");
-    
+
     terminate();
 
     return 0;
@@ -305,130 +573,322 @@ void *dispatcher(void *arg)
     /* Buffer between socket and elevator-specific buffer */
     struct event event;
 
-    if (verbose)
-        printf("dispatcher up and running\n");
+    log_msg(LOG_INFO, LOG_DISPATCHER_UP);
 
     while (running) {
         event.type = waitForEvent(&event.desc);
 
-        switch(event.type) {
-        case FloorButton:
-            if (verbose) {
-                printf("floor button pressed: floor %d, type %d\n", event.desc.fbp.floor,
-                        (int) event.desc.fbp.type);
-            }
+        /* Dispatched further down the pipeline if running */
+        if (!pipeline_read(&event))
+            continue;
 
-            int e = get_suitable_elevator(&event.desc.fbp);
+        dispatch_event(&event);
 
-            if (verbose)
-                printf("found suitable elevator %d\n", e);
+        /* Room may have been made, events keep coming while cabins move */
+        if (num_backlog || __atomic_load_n(&num_held_calls, __ATOMIC_RELAXED))
+            dispatch_backlog();
+    }
 
-            /* Send event to elevator */
-            enqueue_event(e, &event);
+    log_msg(LOG_INFO, LOG_DISPATCHER_DOWN);
 
-            /* Wake elevator to handle event */
-            pthread_cond_signal(&elevator_signal[e]);
-            break;
-        case CabinButton:
-            if (verbose) {
-                printf("cabin button pressed: cabin %d, floor %d\n", event.desc.cbp.cabin,
-                        (int) event.desc.cbp.floor);
-            }
+    return ((void*) NULL);
+}
 
-            /* Simple button press from within the elevator, just forward it */
-            enqueue_event(event.desc.cbp.cabin, &event);
+/* Milliseconds passed since a time on the monotonic clock */
+static int elapsed_ms(struct timespec *since)
+{
+    struct timespec now;
 
-            /* Wake elevator to handle event */
-            pthread_cond_signal(&elevator_signal[event.desc.cbp.cabin]);
-            break;
-        case Position:
-            if (verbose) {
-                printf("cabin position: cabin %d, position %1.4f\n", event.desc.cp.cabin,
-                        event.desc.cp.position);
-            }
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-            /* Parse for door state changes */
-            if (door_state_counter[event.desc.cp.cabin].position == event.desc.cp.position) {
-                door_state_counter[event.desc.cp.cabin].repetitions++;
+    return (now.tv_sec-since->tv_sec)*1000 + (now.tv_nsec-since->tv_nsec)/1000000;
+}
 
-                if (door_state_counter[event.desc.cp.cabin].repetitions == DOOR_OPENING_REPETITIONS) {
-                    /* Door was probably opened */
-                    door_state_counter[event.desc.cp.cabin].repetitions = 1;
+/*
+ * Ask the hardware for the position of every cabin and the speed and wait
+ * until all of them have answered, rather than assuming every cabin starts
+ * at floor 0.
+ *
+ * Button presses arriving meanwhile are held back until all positions are
+ * known so that they are not dispatched using wrong positions.
+ *
+ * Cabins not answering are asked again every SYNC_RETRY ms. Once none has
+ * answered for SYNC_TIMEOUT ms, e.g. as the hardware has fewer cabins than
+ * given by '-e', they are named and the controller exits.
+ */
+void sync_hardware()
+{
+    int i, cabin;
+    int remaining = num_elevators+1;
+    int num_held = 0;
+    char *synced = calloc(num_elevators+1, sizeof(char));
+    struct event event;
+    struct event *held = NULL;
+    struct timespec start, end, answered, asked;
 
-                    /* Notify elevator of new door state */
-                    event.type = Door;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    answered = asked = start;
 
-                    /* Result of desc being a union, just being carefull */
-                    event.desc.ds.cabin = event.desc.cp.cabin;
+    for (i = 1; i <= num_elevators; i++)
+        output_send('w', i, 0);
+    output_send('v', 0, 0);
 
-                    event.desc.ds.state = door_state_counter[event.desc.ds.cabin].state * -1;
-                    door_state_counter[event.desc.ds.cabin].state *= -1;
+    while (remaining && running) {
+        if (elapsed_ms(&answered) >= SYNC_TIMEOUT)
+            break;
 
-                    enqueue_event(event.desc.ds.cabin, &event);
-                }
-            } else {
-                /* Forward elevator position */
-                enqueue_event(event.desc.cbp.cabin, &event);
+        if (elapsed_ms(&asked) >= SYNC_RETRY) {
+            for (i = 1; i <= num_elevators; i++)
+                if (!synced[i])
+                    output_send('w', i, 0);
+            if (!synced[0])
+                output_send('v', 0, 0);
+            clock_gettime(CLOCK_MONOTONIC, &asked);
+        }
 
-                /* Set new count */
-                door_state_counter[event.desc.cp.cabin].position = event.desc.cp.position;
-                door_state_counter[event.desc.cp.cabin].repetitions = 1;
-            }
+        if (!pollHW(SYNC_RETRY - elapsed_ms(&asked)))
+            continue;
 
+        event.type = waitForEvent(&event.desc);
 
-            /* Wake elevator to handle event */
-            pthread_cond_signal(&elevator_signal[event.desc.cbp.cabin]);
+        switch (event.type) {
+        case FloorButton:
+        case CabinButton:
+        case Destination:
+            held = realloc(held, (num_held+1)*sizeof(struct event));
+            held[num_held++] = event;
+            continue;
+        case Position:
+            cabin = event.desc.cp.cabin;
+            if (cabin < 1 || cabin > num_elevators)
+                continue;
 
+            /*
+             * The elevator is idle, give it the position right away so that
+             * the held back buttons are scored correctly
+             */
+            if (!synced[cabin]) {
+                synced[cabin] = 1;
+                remaining--;
+                clock_gettime(CLOCK_MONOTONIC, &answered);
+                cabins[cabin]->info.position = event.desc.cp.position;
+            }
             break;
         case Speed:
-            if (verbose) {
-                printf("speed %f\n", event.desc.s.speed);
+            if (!synced[0]) {
+                synced[0] = 1;
+                remaining--;
+                clock_gettime(CLOCK_MONOTONIC, &answered);
             }
-
-            /*
-             * TODO: Examine if different strategies has to be implemented
-             * depending on the elevators speeds. Perhaps breaking out the
-             * calculations on which elevator is best fitted for handling
-             * a floor button request to a separate thread is needed for
-             * higher speeds??
-             */
             break;
-        case Error:
-                printf("error: \"%s\"\n", event.desc.e.str);
+        default:
             break;
+        }
 
-        default:
-            if (verbose)
-                printf("Received unknown event (type %d)\n", event.type);
+        dispatch_event(&event);
+    }
+
+    if (remaining && running) {
+        fprintf(stderr, "No answer from the \"hardware\" in %d ms:", SYNC_TIMEOUT);
+        for (i = 1; i <= num_elevators; i++)
+            if (!synced[i])
+                fprintf(stderr, " cabin %d", i);
+        if (!synced[0])
+            fprintf(stderr, " speed");
+        fprintf(stderr, ", does it have %d cabins?\n", num_elevators);
+        exit(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    log_msg(LOG_INFO, LOG_SYNCED, (end.tv_sec-start.tv_sec)*1e3 +
+            (end.tv_nsec-start.tv_nsec)/1e6, speed);
+
+    /*
+     * Positions are known, hand every cabin its plan from the run before
+     * ahead of the buttons held back, see include/journal.h
+     */
+    if (journal_enabled()) {
+        journal_replay();
+
+        event.type = Resume;
+        for (i = 1; i <= num_elevators; i++) {
+            if (enqueue_event(i, &event)) {
+                fprintf(stderr, "Cannot resume elevator %d, exiting\n", i);
+                exit(1);
+            }
+            pthread_cond_signal(&cabins[i]->signal);
         }
     }
 
-    if (verbose)
-        printf("Dispatcher has terminated.\n");
+    for (i = 0; i < num_held; i++)
+        dispatch_event(&held[i]);
 
-    return ((void*) NULL);
+    free(held);
+    free(synced);
+}
+
+/* Dispatch a single event from the hardware */
+void dispatch_event(struct event *event)
+{
+    int id = route_event(event);
+
+    /* Wake elevator to handle event */
+    if (id)
+        pthread_cond_signal(&cabins[id]->signal);
+}
+
+/*
+ * Dispatch an event without waking the elevator it was given to, returns
+ * that elevator or 0. Hall calls are scored by the pipeline if running.
+ */
+int route_event(struct event *event)
+{
+    struct door_state_counter *door;
+    int state;
+
+    switch(event->type) {
+    case FloorButton:
+        log_msg(LOG_DEBUG, LOG_FLOOR_BUTTON, event->desc.fbp.floor,
+                (int) event->desc.fbp.type);
+
+        telemetry_hall_call(event->desc.fbp.floor, event->desc.fbp.type);
+        traffic_hall(event->desc.fbp.floor, event->desc.fbp.type);
+
+        if (pipeline_score(event))
+            dispatch_floor_button(event);
+        break;
+    case Destination:
+        /* Floors index the plans, a trip nowhere would never be scored */
+        if (event->desc.dp.floor < 0 || event->desc.dp.floor >= num_floors ||
+                event->desc.dp.destination < 0 ||
+                event->desc.dp.destination >= num_floors ||
+                event->desc.dp.floor == event->desc.dp.destination) {
+            log_msg(LOG_ERROR, LOG_BAD_DESTINATION, event->desc.dp.floor,
+                    event->desc.dp.destination);
+            break;
+        }
+
+        telemetry_hall_call(event->desc.dp.floor,
+                            event->desc.dp.destination > event->desc.dp.floor ?
+                            GoingUp : GoingDown);
+        traffic_hall(event->desc.dp.floor,
+                     event->desc.dp.destination > event->desc.dp.floor ? GoingUp : GoingDown);
+        traffic_trip(event->desc.dp.floor, event->desc.dp.destination);
+
+        dispatch_destination(event);
+        break;
+    case CabinButton:
+        log_msg(LOG_DEBUG, LOG_CABIN_BUTTON, event->desc.cbp.cabin,
+                event->desc.cbp.floor);
+
+        if (event->desc.cbp.floor == EMERGENCY_STOP) {
+            emergency_stop(event->desc.cbp.cabin);
+            break;
+        }
+
+        /*
+         * The next cabin call after an emergency stop releases the cabin,
+         * before it is queued so that the motor start it leads to is sent.
+         * Cabin calls always fit, see include/cabin.h.
+         */
+        if (__atomic_load_n(&cabins[event->desc.cbp.cabin]->emergency, __ATOMIC_RELAXED)) {
+            output_resume(event->desc.cbp.cabin);
+            __atomic_store_n(&cabins[event->desc.cbp.cabin]->emergency, 0, __ATOMIC_RELEASE);
+        }
+
+        /* A trip from the floor the cabin is at */
+        traffic_trip(position_floor(cabins[event->desc.cbp.cabin]->door.position),
+                     event->desc.cbp.floor);
+
+        /* Simple button press from within the elevator, just forward it */
+        enqueue_event(event->desc.cbp.cabin, event);
+
+        return event->desc.cbp.cabin;
+    case Position:
+        log_msg(LOG_DEBUG, LOG_POSITION, event->desc.cp.cabin,
+                (double) event->desc.cp.position/HW_POSITION_SCALE);
+
+        /* Parse for door state changes */
+        door = &cabins[event->desc.cp.cabin]->door;
+
+        if (door->position == event->desc.cp.position) {
+            door->repetitions++;
+
+            if (door->repetitions == DOOR_OPENING_REPETITIONS) {
+                door->repetitions = 1;
+
+                /*
+                 * Doors moved the way they were last told. Merely flipping the
+                 * state loses track for good once doors are reopened before
+                 * done closing, which takes fewer reports.
+                 */
+                state = __atomic_load_n(&door->commanded, __ATOMIC_ACQUIRE);
+                if (state == door->state)
+                    return event->desc.cp.cabin;
+
+                /* Notify elevator of new door state */
+                event->type = Door;
+
+                /* Result of desc being a union, just being carefull */
+                event->desc.ds.cabin = event->desc.cp.cabin;
+
+                event->desc.ds.state = state;
+                door->state = state;
+
+                enqueue_event(event->desc.ds.cabin, event);
+            }
+        } else {
+            /* Forward elevator position */
+            enqueue_event(event->desc.cbp.cabin, event);
+
+            /* Set new count */
+            door->position = event->desc.cp.position;
+            door->repetitions = 1;
+        }
+
+        return event->desc.cp.cabin;
+    case Speed:
+        log_msg(LOG_DEBUG, LOG_SPEED, event->desc.s.speed);
+
+        speed = event->desc.s.speed;
+        eta_speed(speed);
+
+        /*
+         * TODO: Examine if different strategies has to be implemented
+         * depending on the elevators speeds. Scoring floor button requests
+         * on separate threads is done by the pipeline, see --workers.
+         */
+        break;
+    case Error:
+            printf("error: \"%s\"\n", event->desc.e.str);
+        break;
+
+    default:
+        log_msg(LOG_ERROR, LOG_UNKNOWN_EVENT, event->type);
+    }
+
+    return 0;
 }
 
-/* Print stop queue for elevator id */
+/* Log stop queue for elevator id, at most its first four stops */
 void printq(int id, stop_queue *q)
 {
-    if (!verbose)
+    int i;
+    double args[LOG_MAX_ARGS];
+    node_stop_queue* curr_node = q->first;
+
+    if (log_level < LOG_DEBUG)
         return;
 
-    printf("Queue %i: ", id);
-    
-    node_stop_queue* curr_node = q->first;
-    if (curr_node == NULL)
-        printf("no elements.");
+    args[0] = id;
+    args[1] = q->size;
 
-    else {
-        while (curr_node != NULL)  {
-            printf("%i, ", curr_node->floor);
-            curr_node = curr_node->next;
-        }
+    for (i = 2; i < LOG_MAX_ARGS && curr_node != NULL; i++) {
+        args[i] = curr_node->floor;
+        curr_node = curr_node->next;
     }
-    
-    printf("\n");
+
+    log_write(LOG_DEBUG, LOG_QUEUE, i, args);
 }
 
 /*
@@ -438,57 +898,160 @@ void printq(int id, stop_queue *q)
 void *elevator(void *arg)
 {
     struct event event;
-    double next_floor, diff_floor;
+    int next_floor, diff_floor;
 
-    double position = 0.0;
+    int position = 0;
     int direction = 0;
     int door_state = DoorStop;
     short floor_visited = 1;
     short stop = 0;
+    int emergency_stops = 0;
+
+    /* Door dwell at the floor visited, see include/dwell.h */
+    short dwelling = 0;
+    int dwell_floor = 0, demand = 0, boarded = 0;
+    int served_direction;
+    struct timespec now, close_at;
+
+    /* Runs and doors being timed for the ETA model, see include/eta.h */
+    short run_timed = 0, door_timed = 0;
+    int run_from = 0;
+    struct timespec run_start, door_command;
+
+    /* Hall calls claimed from and by other cabins, see include/steal.h */
+    int calls_stolen = 0;
+    struct timespec scan_at = { 0, 0 };
+
+    /* Spacing to the other cabins, see include/headway.h */
+    int heading = 0;
+    int park = -1, idle_scans = 0;
+    node_stop_queue *node;
+
+    /* Doors when the run before ended, see include/journal.h */
+    int doors_left = JOURNAL_DOORS_CLOSED;
+
+    /* Taking calls from others waits for the plan of the run before */
+    int resumed = !journal_enabled();
 
     int id = (int)(long)arg;
-    stop_queue *queue = elevator_info[id].queue;
+    struct cabin *cabin;
+    stop_queue *queue;
 
-    if (verbose)
-        printf("elevator %d up and running\n", id);
+    /* Pin before allocating so the context ends up on the local NUMA node */
+    if (pin_thread(cabin_cpu(&affinity, id)))
+        fprintf(stderr, "Cannot pin elevator %d to cpu %d\n", id, cabin_cpu(&affinity, id));
+
+    rt_thread(RT_CABIN);
+
+    if ((cabin = new_cabin(num_floors)) == NULL || (queue = new_stop_queue()) == NULL) {
+        perror("Cannot allocate elevator context\n");
+        exit(2);
+    }
+
+    cabin->info.queue = queue;
+    cabin->planned = calloc(num_floors, sizeof(int));
+    cabin->riding = calloc(num_floors, sizeof(int));
+    cabins[id] = cabin;
+
+    pthread_barrier_wait(&cabins_ready);
+
+    log_msg(LOG_INFO, LOG_ELEVATOR_UP, id);
 
     while (1) {
-        /* Wait until message is received */
-        pthread_mutex_lock(&elevator_event_buffer_mutex[id]);
-        pthread_cond_wait(&elevator_signal[id], &elevator_event_buffer_mutex[id]);
+        /* Publish the outcome of the last iteration */
+        telemetry_cabin(id, position, direction, door_state, queue);
+        journal_checkpoint(id, position, direction, floor_visited ? JOURNAL_DOORS_CLOSED :
+                           door_state == DoorOpen ? JOURNAL_DOORS_OPEN : JOURNAL_DOORS_MOVING,
+                           queue);
+        spatial_update(id, position, queue);
+        __atomic_store_n(&cabin->info.direction, direction, __ATOMIC_RELAXED);
+
+        /* Heading for the next stop, if not moving yet */
+        if (direction)
+            heading = direction;
+        else if (!queue->size)
+            heading = 0;
+        else if (peek_stop_queue(queue) != position_floor(position))
+            heading = FLOOR_POSITION(peek_stop_queue(queue)) > position ? 1 : -1;
+        headway_update(id, position, heading);
+        traffic_update(id, position_floor(position), heading);
+
+        /* Wait until message is received, unless some already are */
+        pthread_mutex_lock(&cabin->event_buffer_mutex);
+        if (!cabin->num_events && !cabin->position_pending && !cabin->door_state_pending &&
+                __atomic_load_n(&cabin->calls_stolen, __ATOMIC_ACQUIRE) == calls_stolen) {
+            /* Wake-ups on the timeouts are timed, see include/rt.h */
+            if (dwelling)
+                rt_timedwait(&cabin->signal, &cabin->event_buffer_mutex, &close_at);
+            else if (floor_visited && !direction && !stop && !queue->size &&
+                     (steal_enabled() || headway_enabled() || traffic_enabled()))
+                rt_timedwait(&cabin->signal, &cabin->event_buffer_mutex, &scan_at);
+            else
+                pthread_cond_wait(&cabin->signal, &cabin->event_buffer_mutex);
+        }
 
         /* Handle all new events */
-        while (elevator_event_buffer[id] != NULL) {
-            event = elevator_event_buffer[id]->event;
+        while (dequeue_event(cabin, &event)) {
 
-            if (verbose)
-                printf("elevator %d received type %d\n", id, event.type);
+            log_msg(LOG_DEBUG, LOG_ELEVATOR_EVENT, id, event.type);
 
             switch (event.type) {
                 case FloorButton:
-                    push_stop_queue(event.desc.fbp.floor, (int) event.desc.fbp.type, position, &elevator_info[id]);
-                    if (verbose) printq(id, queue);
+                    push_stop_queue(event.desc.fbp.floor, (int) event.desc.fbp.type, position, &cabin->info);
+                    steal_post(id, &event.desc.fbp);
+                    printq(id, queue);
                     break;
                 case CabinButton:
-                    if (event.desc.cbp.floor == 32000) {
-                        stop = 1;
-                        break;
-                    }
-                    else if (stop == 1)
-                        stop = 0;
-                    
-                    push_stop_queue(event.desc.cbp.floor, 0, position, &elevator_info[id]);
+                    /* Pressed by passengers boarding at the floor visited */
+                    if (!floor_visited)
+                        boarded++;
 
-                    if (verbose) 
-                        printq(id, queue);
+                    push_stop_queue(event.desc.cbp.floor, 0, position, &cabin->info);
+
+                    printq(id, queue);
             
+                    break;
+                case Destination:
+                    add_passenger(id, &event.desc.dp);
+                    printq(id, queue);
                     break;
                 case Position:
-                    position = elevator_info[id].position = event.desc.cp.position;
+                    position = cabin->info.position = event.desc.cp.position;
                     break;
                 case Door:
                     door_state = event.desc.ds.state;
-                    break;
+
+                    /* Doors timed from the command until reported open or closed */
+                    if (door_timed && door_state != DoorStop) {
+                        eta_door(door_state == DoorOpen, elapsed_ms(&door_command));
+                        door_timed = 0;
+                    }
+                    break;
+                case Service:
+                    log_msg(LOG_INFO, LOG_SERVICE, id, event.desc.sd.in_service);
+                    break;
+                case Resume:
+                    /* Where the run before left off, see include/journal.h */
+                    direction = journal_resume(id, &cabin->info, &doors_left);
+                    resumed = 1;
+
+                    /* Dwell at the floor once open, reopening doors moving */
+                    if (doors_left != JOURNAL_DOORS_CLOSED) {
+                        floor_visited = 0;
+                        dwelling = 0;
+                        dwell_floor = position_floor(position);
+                        demand = boarded = 0;
+                        door_state = DoorOpen;
+                    }
+                    if (doors_left == JOURNAL_DOORS_MOVING) {
+                        handle_door(id, 1);
+                        door_state = DoorStop;
+                    }
+                    if (direction)
+                        handle_motor(id, direction);
+
+                    printq(id, queue);
+                    break;
                 case Shutdown:
                     /* Yes I know it's a goto, but this might arguably its only 
                        valid use and it's also far better than complicating the
@@ -496,19 +1059,37 @@ void *elevator(void *arg)
                     goto shutdown;
                     break;
                 default:
-                    if (verbose)
-                        printf("Elevator %d received unknown event (type %d)\n",
-                                id, event.type);
+                    log_msg(LOG_ERROR, LOG_ELEVATOR_UNKNOWN, id, event.type);
             }
+        }
+
+        telemetry_events(id, 0, 0);
+
+        pthread_mutex_unlock(&cabin->event_buffer_mutex);
 
-            /* Dequeue */
-            struct event_buffer* tmp = elevator_event_buffer[id];
-            elevator_event_buffer[id] = elevator_event_buffer[id]->next;
-            if (tmp)
-                free(tmp);
+        /*
+         * Emergency stops are handled by the dispatcher, which has already
+         * stopped the motor. Catch up with it, the cabin stays put until the
+         * next cabin call.
+         */
+        if (__atomic_load_n(&cabin->emergency_stops, __ATOMIC_ACQUIRE) != emergency_stops) {
+            emergency_stops = __atomic_load_n(&cabin->emergency_stops, __ATOMIC_ACQUIRE);
+            direction = 0;
+            run_timed = 0;
+            park = -1;
         }
+        stop = __atomic_load_n(&cabin->emergency, __ATOMIC_ACQUIRE);
 
-        pthread_mutex_unlock(&elevator_event_buffer_mutex[id]);
+        /* Drop the hall calls other cabins claimed */
+        if (__atomic_load_n(&cabin->calls_stolen, __ATOMIC_ACQUIRE) != calls_stolen) {
+            calls_stolen = __atomic_load_n(&cabin->calls_stolen, __ATOMIC_ACQUIRE);
+            steal_drop(id);
+            printq(id, queue);
+        }
+
+        /* Out of service, let others take the hall calls but finish the rest */
+        if (!__atomic_load_n(&cabin->in_service, __ATOMIC_RELAXED))
+            hand_over_hall_calls(id);
 
         /* Elevator logic */
         if (floor_visited) {
@@ -516,52 +1097,195 @@ void *elevator(void *arg)
                 if (direction) {
                     handle_motor(id, 0);
                     direction = 0;
+                    run_timed = 0;
                 }
 
                 continue;
             }
 
+            /*
+             * Claim the hall calls this cabin beats their owners to, idle or
+             * on the move, and once idle for long enough park where the
+             * traffic wants it or away from the others
+             */
+            if (resumed && (steal_enabled() || headway_enabled() || traffic_enabled())) {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+
+                if (now.tv_sec > scan_at.tv_sec ||
+                        (now.tv_sec == scan_at.tv_sec && now.tv_nsec >= scan_at.tv_nsec)) {
+                    if (steal_scan(id))
+                        printq(id, queue);
+
+                    if (direction || queue->size || park >= 0 ||
+                            !cabin_available(cabin))
+                        idle_scans = 0;
+                    else if (++idle_scans >= TRAFFIC_PARK_SCANS &&
+                             traffic_mode() != TRAFFIC_COLLECTIVE) {
+                        park = traffic_park(id);
+                        idle_scans = 0;
+                    }
+                    else if (idle_scans >= HEADWAY_PARK_SCANS) {
+                        park = headway_park(id);
+                        idle_scans = 0;
+                    }
+
+                    traffic_tick();
+
+                    scan_at.tv_sec = now.tv_sec + STEAL_INTERVAL/1000;
+                    scan_at.tv_nsec = now.tv_nsec + STEAL_INTERVAL%1000*1000000L;
+                    if (scan_at.tv_nsec >= 1000000000L) {
+                        scan_at.tv_sec++;
+                        scan_at.tv_nsec -= 1000000000L;
+                    }
+                }
+            }
+
             /* Update scale (floor indicator) */
-            if (fabs(position-round(position)) < DIFF_AT_FLOOR)
-                handle_scale(id, (int) roundl(position));
+            if (abs(position - FLOOR_POSITION(position_floor(position))) < DIFF_AT_FLOOR)
+                handle_scale(id, position_floor(position));
+
+            next_floor = peek_stop_queue(queue);
 
-            next_floor = (double) peek_stop_queue(queue);
-            diff_floor = next_floor-position;
+            /* Park without opening the doors, unless given stops meanwhile */
+            if (next_floor != -1)
+                park = -1;
+            else if (park >= 0) {
+                diff_floor = FLOOR_POSITION(park)-position;
+
+                if (abs(diff_floor) < DIFF_AT_FLOOR || diff_floor*direction < 0) {
+                    if (direction) {
+                        handle_motor(id, 0);
+                        direction = 0;
+
+                        if (run_timed)
+                            eta_run(abs(position-run_from), elapsed_ms(&run_start));
+                        run_timed = 0;
+                    }
+                    park = -1;
+                }
+                else if (!direction) {
+                    direction = diff_floor > 0 ? 1 : -1;
+                    handle_motor(id, direction);
+
+                    clock_gettime(CLOCK_MONOTONIC, &run_start);
+                    run_from = position;
+                    run_timed = 1;
+                }
+
+                continue;
+            }
+
+            /* Halt if the stops ahead were taken by other cabins */
+            if (next_floor == -1 && direction) {
+                handle_motor(id, 0);
+                direction = 0;
+                run_timed = 0;
+            }
 
             if (next_floor == -1)
                 continue;
 
-            if (fabs(diff_floor) < DIFF_AT_FLOOR)
+            diff_floor = FLOOR_POSITION(next_floor)-position;
+
+            if (abs(diff_floor) < DIFF_AT_FLOOR)
                 diff_floor = 0;
 
+            /* Likewise if what is left of them is behind */
+            if (direction && diff_floor*direction < 0) {
+                handle_motor(id, 0);
+                direction = 0;
+                run_timed = 0;
+            }
+
             /* Arrived at next floor stop (if moving) and open door */
             if (diff_floor == 0) {
                 if (direction) {
                     handle_motor(id, 0);
                     direction = 0;
+
+                    if (run_timed)
+                        eta_run(abs(position-run_from), elapsed_ms(&run_start));
+                    run_timed = 0;
                 }
                 
                 handle_door(id, 1);
                 door_state = DoorStop;
-                
-                pop_stop_queue(queue);
-                if (verbose) printq(id, queue);
+                clock_gettime(CLOCK_MONOTONIC, &door_command);
+                door_timed = 1;
+
+                /* Every stop in a row at the floor is served by one opening */
+                dwell_floor = next_floor;
+                demand = boarded = 0;
+                while (size_stop_queue(queue) && peek_stop_queue(queue) == dwell_floor) {
+                    served_direction = queue->first->direction;
+
+                    if (served_direction) {
+                        FloorButtonPressDesc served = { dwell_floor,
+                                                        (FloorButtonType) served_direction };
+
+                        steal_served(id, &served);
+                    }
+
+                    telemetry_floor_served(pop_stop_queue(queue), served_direction);
+                    demand++;
+                }
+
+                if (destination && dwell_floor >= 0 && dwell_floor < num_floors) {
+                    demand = cabin->riding[dwell_floor];
+                    boarded = board_passengers(id, dwell_floor);
+                    demand += boarded;
+                }
+
+                telemetry_count(id, TELEMETRY_STOPS);
+                printq(id, queue);
 
                 floor_visited = 0;
             }
 
             /* Elevator is not moving, start motor */
             else if (!direction) {
-                direction = (int) lround(diff_floor/fabs(diff_floor));
+                direction = diff_floor > 0 ? 1 : -1;
                 handle_motor(id, direction);
+
+                clock_gettime(CLOCK_MONOTONIC, &run_start);
+                run_from = position;
+                run_timed = 1;
             }
         }
         else {
-            /* Handle closing doors */
+            /* Handle closing doors, once open for the dwell decided */
             if (door_state == DoorOpen) {
-                sleep(3);
-                handle_door(id, -1);
-                door_state = DoorStop;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+
+                if (!dwelling) {
+                    int dwell = dwell_time(id, dwell_floor, demand);
+
+                    eta_dwell(dwell);
+
+                    /* Empty cabins wait for the gap to the one ahead to open */
+                    for (node = queue->first; node && node->direction; node = node->next)
+                        ;
+                    if (!node)
+                        dwell += headway_hold(id);
+
+                    close_at.tv_sec = now.tv_sec + dwell/1000;
+                    close_at.tv_nsec = now.tv_nsec + dwell%1000*1000000L;
+                    if (close_at.tv_nsec >= 1000000000L) {
+                        close_at.tv_sec++;
+                        close_at.tv_nsec -= 1000000000L;
+                    }
+                    dwelling = 1;
+                }
+                else if (now.tv_sec > close_at.tv_sec ||
+                         (now.tv_sec == close_at.tv_sec && now.tv_nsec >= close_at.tv_nsec)) {
+                    handle_door(id, -1);
+                    door_state = DoorStop;
+                    dwelling = 0;
+                    door_command = now;
+                    door_timed = 1;
+
+                    dwell_learn(dwell_floor, boarded);
+                }
             }
             else if (door_state == DoorClose)
                 floor_visited = 1;
@@ -570,6 +1294,11 @@ void *elevator(void *arg)
 
 /* Shutdown and cleanup */
 shutdown:
+    /* The events taken along with the shutdown as well */
+    journal_checkpoint(id, position, direction, floor_visited ? JOURNAL_DOORS_CLOSED :
+                       door_state == DoorOpen ? JOURNAL_DOORS_OPEN : JOURNAL_DOORS_MOVING,
+                       queue);
+
     while (size_stop_queue(queue))
         pop_stop_queue(queue);
 
@@ -579,8 +1308,7 @@ shutdown:
     ++num_terminated;
     pthread_mutex_unlock(&term_cnt_mutex);
 
-    if (verbose)
-        printf("Elevator %i has terminated.\n", id);
+    log_msg(LOG_INFO, LOG_ELEVATOR_DOWN, id);
 
     return ((void*) NULL);
 }
@@ -590,124 +1318,684 @@ shutdown:
  *
  * Returns the index of the most suitable elevator to handle floor button press
  *
+ * Elevators out of service or saturated are only considered if all of them are.
+ *
  * TODO: Check for servicing the same floor (in the same direction) with
  *       several elevators, might not be neccessary to send several eleveators?
  */
 int get_suitable_elevator(FloorButtonPressDesc *floor_button)
+{
+    int score;
+
+    return get_group_elevator(floor_button, 1, num_elevators, &score);
+}
+
+/* The most suitable of elevators first to last, and its score */
+int get_group_elevator(FloorButtonPressDesc *floor_button, int first, int last, int *score)
 {
     int i;
-    int elevator = 1;
+    int elevator = 0;
     int best_range = 0;
+    int any = 0;
 
-    best_range = round(distance_to_floor(floor_button, &elevator_info[1]));
+    /* Picks the same elevator, scoring only those near the floor */
+    if ((elevator = spatial_search(floor_button, first, last, score)))
+        return elevator;
 
-    for (i = 2; i <= num_elevators; i++) {
-        int current_range;
+    while (!elevator) {
+        for (i = first; i <= last; i++) {
+            int current_range;
+
+            if (!any && !cabin_available(cabins[i]))
+                continue;
 
-        current_range = distance_to_floor(floor_button, &elevator_info[i]);
+            current_range = hall_call_score(floor_button, i);
 
-        if (current_range < best_range) {
-            best_range = current_range;
-            elevator = i;
+            if (!elevator || current_range < best_range) {
+                best_range = current_range;
+                elevator = i;
+            }
         }
+
+        any = 1;
     }
 
+    *score = best_range;
+
     return elevator;
 }
 
 /*
- * Add event to elevators event queue, typical linked list FIFO implementation
+ * Score of cabin id for a hall call, bunching with the cabin behind it and
+ * the mode of the traffic included
+ */
+int hall_call_score(FloorButtonPressDesc *floor_button, int id)
+{
+    return distance_to_floor(floor_button, &cabins[id]->info) + headway_penalty(id) +
+           traffic_penalty(id, floor_button->floor);
+}
+
+/*
+ * Assign a floor button press to the most suitable elevator and wake it. In
+ * groups the press is posted on the board instead, the groups of its zone
+ * settle which of their elevators takes it.
+ */
+void dispatch_floor_button(struct event *event)
+{
+    int e;
+
+    /* Closed meanwhile if -1, group_close may be sweeping the board */
+    if (group_count() && group_post(&event->desc.fbp) >= 0)
+        return;
+
+    e = get_suitable_elevator(&event->desc.fbp);
+
+    log_msg(LOG_DEBUG, LOG_SUITABLE, e);
+
+    /* Held back for the next elevator with room once every one is full */
+    if (enqueue_event(e, event)) {
+        hold_hall_call(&event->desc.fbp);
+        return;
+    }
+
+    /* Wake elevator to handle event */
+    pthread_cond_signal(&cabins[e]->signal);
+}
+
+/*
+ * Stop a cabin right away, without waiting for its elevator thread which may
+ * be busy or asleep. The stop is sent ahead of every queued command and the
+ * elevator is woken to catch up with it.
+ */
+void emergency_stop(int id)
+{
+    if (id < 1 || id > num_elevators)
+        return;
+
+    output_emergency_stop(id);
+
+    __atomic_store_n(&cabins[id]->emergency, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&cabins[id]->emergency_stops, 1, __ATOMIC_RELEASE);
+
+    log_msg(LOG_INFO, LOG_EMERGENCY, id);
+
+    /* Taking the mutex so the wakeup cannot slip in before it waits */
+    pthread_mutex_lock(&cabins[id]->event_buffer_mutex);
+    pthread_cond_signal(&cabins[id]->signal);
+    pthread_mutex_unlock(&cabins[id]->event_buffer_mutex);
+}
+
+/*
+ * Move the hall calls of an elevator out of service to other elevators, those
+ * which still end up at the elevator itself are put back in its stop queue.
+ * Only called by the elevator thread id, which owns the stop queue.
+ */
+void hand_over_hall_calls(int id)
+{
+    int i, num_calls;
+    struct event event;
+    elevator_information *info = &cabins[id]->info;
+    FloorButtonPressDesc *calls;
+
+    if (!size_stop_queue(info->queue))
+        return;
+
+    calls = malloc(size_stop_queue(info->queue)*sizeof(FloorButtonPressDesc));
+    num_calls = remove_hall_calls_stop_queue(info->queue, calls);
+
+    event.type = FloorButton;
+
+    for (i = 0; i < num_calls; i++) {
+        event.desc.fbp = calls[i];
+
+        /* The hall calls were made for passengers assigned to the elevator */
+        if (destination) {
+            hand_over_passengers(id, &calls[i]);
+            continue;
+        }
+
+        if (get_suitable_elevator(&event.desc.fbp) == id) {
+            push_stop_queue(calls[i].floor, (int) calls[i].type, info->position, info);
+            steal_post(id, &calls[i]);
+            continue;
+        }
+
+        log_msg(LOG_INFO, LOG_REDISPATCH, id, calls[i].floor, (int) calls[i].type);
+        dispatch_floor_button(&event);
+    }
+
+    if (num_calls)
+        printq(id, info->queue);
+
+    free(calls);
+}
+
+/*
+ * Destination dispatch
  *
- * If event is of type position, the queue is not considered FIFO, old
- * positional values are worthless and should be discardevent.desc. So if any old
- * positional values are in the buffer, overwrite it. (Not implemented yet)
+ * Every passenger reports a floor and destination before boarding. The
+ * passenger is assigned a cabin right away and told which, the cabin stops
+ * at the floor and, once the passenger has boarded, at the destination.
+ * Passengers sharing floors or heading for nearby floors are put in the same
+ * cabin, which saves stops for everyone aboard.
+ */
+
+/*
+ * Assign a passenger to an elevator, tell the hardware and wake it. Returns
+ * -1, leaving the passenger unassigned, if the elevator sheds it.
+ */
+int assign_destination(int e, struct event *event)
+{
+    DestinationPressDesc *call = &event->desc.dp;
+
+    /* Counted right away, so that the next passenger sees it */
+    __atomic_add_fetch(&cabins[e]->planned[call->floor], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cabins[e]->planned[call->destination], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cabins[e]->load, 1, __ATOMIC_RELAXED);
+
+    if (enqueue_event(e, event)) {
+        __atomic_sub_fetch(&cabins[e]->planned[call->floor], 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&cabins[e]->planned[call->destination], 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&cabins[e]->load, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    log_msg(LOG_DEBUG, LOG_DESTINATION, call->floor, call->destination, e);
+
+    output_send('a', e, HW_DESTINATION(call->floor, call->destination));
+
+    pthread_cond_signal(&cabins[e]->signal);
+
+    return 0;
+}
+
+/*
+ * Assign a passenger to the most suitable elevator, or hold it back until
+ * one has room. Only called by the dispatcher.
+ */
+void dispatch_destination(struct event *event)
+{
+    int e = get_destination_elevator(&event->desc.dp);
+
+    if (e && !assign_destination(e, event))
+        return;
+
+    backlog = realloc(backlog, (num_backlog+1)*sizeof(DestinationPressDesc));
+    backlog[num_backlog++] = event->desc.dp;
+}
+
+/* Hold back a hall call no elevator has room for, once per floor and way */
+void hold_hall_call(FloorButtonPressDesc *call)
+{
+    int i;
+
+    pthread_mutex_lock(&held_calls_mutex);
+
+    for (i = 0; i < num_held_calls; i++)
+        if (held_calls[i].floor == call->floor && held_calls[i].type == call->type)
+            break;
+
+    if (i == num_held_calls) {
+        held_calls = realloc(held_calls, (num_held_calls+1)*sizeof(FloorButtonPressDesc));
+        held_calls[i] = *call;
+        __atomic_store_n(&num_held_calls, num_held_calls+1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&held_calls_mutex);
+}
+
+/*
+ * Assign held back hall calls and passengers, the latter in order of arrival,
+ * as long as there is room. Hall calls still without room are held again.
+ */
+void dispatch_backlog()
+{
+    int i, e, count;
+    struct event event;
+    FloorButtonPressDesc *calls;
+
+    if (__atomic_load_n(&num_held_calls, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&held_calls_mutex);
+        calls = held_calls;
+        count = num_held_calls;
+        held_calls = NULL;
+        __atomic_store_n(&num_held_calls, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&held_calls_mutex);
+
+        event.type = FloorButton;
+        for (i = 0; i < count; i++) {
+            event.desc.fbp = calls[i];
+            dispatch_floor_button(&event);
+        }
+
+        free(calls);
+    }
+
+    event.type = Destination;
+
+    for (i = 0; i < num_backlog; i++) {
+        event.desc.dp = backlog[i];
+
+        if (!(e = get_destination_elevator(&event.desc.dp)) ||
+                assign_destination(e, &event))
+            break;
+    }
+
+    memmove(backlog, backlog+i, (num_backlog-i)*sizeof(DestinationPressDesc));
+    num_backlog -= i;
+}
+
+/*
+ * Score of a passenger in a cabin, the score of the pickup as a hall call plus
+ * the cost of the stops it adds and of those it makes on the way.
  *
- * Possibly positions should always be positioned first in the queue as timing
- * requirements can be though. (Simpler, led to it being implemented)
+ * A floor already planned costs nothing, a new destination costs a stop and
+ * the distance to the closest stop planned beyond the floor in the same
+ * direction, so passengers heading for nearby floors end up together. Every
+ * stop planned between the floor and the destination delays the trip, which
+ * keeps a cabin from taking everyone.
+ */
+int destination_score(DestinationPressDesc *call, struct cabin *cabin)
+{
+    int f, detour, weight_distance, weight_stops;
+    int direction = call->destination > call->floor ? 1 : -1;
+    FloorButtonPressDesc pickup = { call->floor, (FloorButtonType) direction };
+    int score = distance_to_floor(&pickup, &cabin->info);
+
+    score_weights(&weight_distance, &weight_stops);
+
+    if (!__atomic_load_n(&cabin->planned[call->floor], __ATOMIC_RELAXED))
+        score += weight_stops;
+
+    for (f = call->floor+direction; f != call->destination; f += direction)
+        if (__atomic_load_n(&cabin->planned[f], __ATOMIC_RELAXED))
+            score += weight_stops;
+
+    if (__atomic_load_n(&cabin->planned[call->destination], __ATOMIC_RELAXED))
+        return score;
+
+    detour = abs(call->destination-call->floor);
+    for (f = call->floor+direction; f >= 0 && f < num_floors; f += direction)
+        if (__atomic_load_n(&cabin->planned[f], __ATOMIC_RELAXED) &&
+                abs(call->destination-f) < detour)
+            detour = abs(call->destination-f);
+
+    return score + weight_stops + detour*weight_distance;
+}
+
+/*
+ * Index of the most suitable elevator for a passenger, as get_suitable_elevator,
+ * or 0 if all of them are full. Passengers are assigned no more than a cabin
+ * takes, as they could otherwise be left behind while thought to be aboard.
+ */
+int get_destination_elevator(DestinationPressDesc *call)
+{
+    int i;
+    int elevator = 0;
+    int best_score = 0;
+    int any;
+
+    for (any = 0; !elevator && any < 2; any++) {
+        for (i = 1; i <= num_elevators; i++) {
+            int current_score;
+
+            if (__atomic_load_n(&cabins[i]->load, __ATOMIC_RELAXED) >= DESTINATION_CAPACITY)
+                continue;
+            if (!any && !cabin_available(cabins[i]))
+                continue;
+
+            current_score = destination_score(call, cabins[i]);
+
+            if (!elevator || current_score < best_score) {
+                best_score = current_score;
+                elevator = i;
+            }
+        }
+    }
+
+    return elevator;
+}
+
+/* Add an assigned passenger, stopping at the floor unless already planned */
+void add_passenger(int id, DestinationPressDesc *call)
+{
+    struct cabin *cabin = cabins[id];
+    int direction = call->destination > call->floor ? GoingUp : GoingDown;
+
+    if (!contains_stop_queue(cabin->info.queue, call->floor))
+        push_stop_queue(call->floor, direction, cabin->info.position, &cabin->info);
+
+    if (cabin->num_waiting == cabin->size_waiting) {
+        cabin->size_waiting = cabin->size_waiting ? 2*cabin->size_waiting : 8;
+        cabin->waiting = realloc(cabin->waiting,
+                                 cabin->size_waiting*sizeof(DestinationPressDesc));
+    }
+
+    cabin->waiting[cabin->num_waiting++] = *call;
+}
+
+/*
+ * The elevator opens its doors at floor, passengers leave and the ones waiting
+ * there board, adding their destinations as cabin calls. Returns the number
+ * of passengers boarded.
+ */
+int board_passengers(int id, int floor)
+{
+    int i, kept = 0, boarded;
+    struct cabin *cabin = cabins[id];
+    DestinationPressDesc *call;
+
+    if (floor < 0 || floor >= num_floors)
+        return 0;
+
+    __atomic_sub_fetch(&cabin->planned[floor], cabin->riding[floor], __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&cabin->load, cabin->riding[floor], __ATOMIC_RELAXED);
+    cabin->riding[floor] = 0;
+
+    for (i = 0; i < cabin->num_waiting; i++) {
+        call = &cabin->waiting[i];
+
+        if (call->floor != floor) {
+            cabin->waiting[kept++] = *call;
+            continue;
+        }
+
+        __atomic_sub_fetch(&cabin->planned[floor], 1, __ATOMIC_RELAXED);
+        cabin->riding[call->destination]++;
+
+        if (!contains_stop_queue(cabin->info.queue, call->destination))
+            push_stop_queue(call->destination, 0, cabin->info.position, &cabin->info);
+    }
+
+    boarded = cabin->num_waiting - kept;
+    cabin->num_waiting = kept;
+
+    return boarded;
+}
+
+/*
+ * Hand over the passengers waiting for an elevator out of service at the floor
+ * of a hall call, as hand_over_hall_calls does for the call itself
+ */
+void hand_over_passengers(int id, FloorButtonPressDesc *hall_call)
+{
+    int i, e, kept = 0, pushed = 0;
+    struct cabin *cabin = cabins[id];
+    struct event event;
+
+    event.type = Destination;
+
+    for (i = 0; i < cabin->num_waiting; i++) {
+        event.desc.dp = cabin->waiting[i];
+
+        /* Kept if no other elevator has room */
+        if (event.desc.dp.floor != hall_call->floor ||
+                !(e = get_destination_elevator(&event.desc.dp)) || e == id ||
+                assign_destination(e, &event)) {
+            cabin->waiting[kept++] = event.desc.dp;
+
+            if (event.desc.dp.floor == hall_call->floor && !pushed++)
+                push_stop_queue(hall_call->floor, (int) hall_call->type,
+                                cabin->info.position, &cabin->info);
+            continue;
+        }
+
+        __atomic_sub_fetch(&cabin->planned[event.desc.dp.floor], 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&cabin->planned[event.desc.dp.destination], 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&cabin->load, 1, __ATOMIC_RELAXED);
+
+        log_msg(LOG_INFO, LOG_REDISPATCH, id, hall_call->floor, (int) hall_call->type);
+    }
+
+    cabin->num_waiting = kept;
+}
+
+/*
+ * True if a button identical to event is already queued for the cabin, or a
+ * service change, which is given the state of event
+ */
+static int queued_button(struct cabin *cabin, struct event *event)
+{
+    int i;
+    struct event *queued;
+
+    for (i = 0; i < cabin->num_events; i++) {
+        queued = &cabin->events[(cabin->head+i) % cabin->size_events];
+
+        if (queued->type != event->type)
+            continue;
+
+        /* Only wakes the elevator, the latest state is what counts */
+        if (event->type == Service) {
+            queued->desc.sd.in_service = event->desc.sd.in_service;
+            return 1;
+        }
+
+        if (event->type == CabinButton &&
+                queued->desc.cbp.floor == event->desc.cbp.floor)
+            return 1;
+
+        if (event->type == FloorButton &&
+                queued->desc.fbp.floor == event->desc.fbp.floor &&
+                queued->desc.fbp.type == event->desc.fbp.type)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Whether the buffer of cabin has room for event, see include/cabin.h */
+static int event_fits(struct cabin *cabin, struct event *event)
+{
+    switch (event->type) {
+    case CabinButton:
+        return cabin->num_events < cabin->size_events-CABIN_QUEUE_CONTROL;
+    case Service:
+    case Shutdown:
+    case Resume:
+        return cabin->num_events < cabin->size_events;
+    default:
+        return cabin->num_events < CABIN_QUEUE_SIZE-CABIN_QUEUE_RESERVE;
+    }
+}
+
+/*
+ * Add event to elevators event queue, a bounded FIFO, see include/cabin.h.
+ *
+ * Old positional values are worthless, the latest position replaces any not
+ * yet processed and is handled before the queued events as timing
+ * requirements can be tough. The door state likewise, after them.
  *
- * TODO: Make double linked list as to get constant time for depositing events
+ * Returns 0 once queued, or merged with what is, and -1 if there is no room,
+ * which leaves hall calls and passengers to the caller to hold back.
  */
-void enqueue_event(int elevator, struct event *event)
+int enqueue_event(int elevator, struct event *event)
 {
+    int shed = 0;
+    struct cabin *cabin = cabins[elevator];
+
     /* Lock the buffer */
-    pthread_mutex_lock(&elevator_event_buffer_mutex[elevator]);
+    pthread_mutex_lock(&cabin->event_buffer_mutex);
 
     if (event->type == Position) {
-        /* Empty buffer */
-        if (elevator_event_buffer[elevator] == NULL) {
-            elevator_event_buffer[elevator] = malloc(sizeof(struct event_buffer));
-            elevator_event_buffer[elevator]->next = NULL;
-            elevator_event_buffer[elevator]->event = *event;
-        } else {
-            /* First element is old positional event */
-            if (elevator_event_buffer[elevator]->event.type == Position) {
-                elevator_event_buffer[elevator]->event.desc = event->desc;
-            } else {
-                struct event_buffer *temp = malloc(sizeof(struct event_buffer));
-                temp->event = *event;
-                temp->next = elevator_event_buffer[elevator];
-                elevator_event_buffer[elevator] = temp;
-            }
-        }
-    } else {
-        /* Add event last in queue */
-        if (elevator_event_buffer[elevator] == NULL) {
-            elevator_event_buffer[elevator] = malloc(sizeof(struct event_buffer));
-            elevator_event_buffer[elevator]->next = NULL;
-            elevator_event_buffer[elevator]->event = *event;
-        } else {
-            struct event_buffer *current = elevator_event_buffer[elevator];
+        if (cabin->position_pending)
+            telemetry_count(elevator, TELEMETRY_CONFLATED);
 
-            while (current->next != NULL)
-                current = current->next;
+        cabin->position = *event;
+        cabin->position_pending = 1;
+    }
+    else if (event->type == Door) {
+        if (cabin->door_state_pending)
+            telemetry_count(elevator, TELEMETRY_CONFLATED);
+
+        cabin->door_state = *event;
+        cabin->door_state_pending = 1;
+    }
+    else if (queued_button(cabin, event)) {
+        telemetry_count(elevator, TELEMETRY_MERGED);
+    }
+    else if (!event_fits(cabin, event)) {
+        telemetry_count(elevator, TELEMETRY_SHED);
+        shed = 1;
+    }
+    else {
+        /* Add event last in queue */
+        cabin->events[(cabin->head+cabin->num_events) % cabin->size_events] = *event;
 
-            current->next = malloc(sizeof(struct event_buffer));
-            current->next->next = NULL;
-            current->next->event = *event;
+        if (++cabin->num_events == CABIN_QUEUE_SATURATED) {
+            __atomic_store_n(&cabin->saturated, 1, __ATOMIC_RELAXED);
+            telemetry_count(elevator, TELEMETRY_SATURATED);
         }
     }
 
-    pthread_mutex_unlock(&elevator_event_buffer_mutex[elevator]);
+    telemetry_events(elevator, cabin->num_events + cabin->position_pending +
+                     cabin->door_state_pending, !shed);
+
+    pthread_mutex_unlock(&cabin->event_buffer_mutex);
+
+    if (shed)
+        log_msg(LOG_ERROR, LOG_SHED, elevator, event->type);
+
+    return shed ? -1 : 0;
+}
+
+/*
+ * Take the next event of a cabin, holding its mutex, 0 if there are none.
+ * Lowers the saturation once all queued events are taken.
+ */
+int dequeue_event(struct cabin *cabin, struct event *event)
+{
+    if (cabin->position_pending) {
+        *event = cabin->position;
+        cabin->position_pending = 0;
+    }
+    else if (cabin->num_events) {
+        *event = cabin->events[cabin->head];
+        cabin->head = (cabin->head+1) % cabin->size_events;
+
+        if (!--cabin->num_events)
+            __atomic_store_n(&cabin->saturated, 0, __ATOMIC_RELAXED);
+    }
+    else if (cabin->door_state_pending) {
+        *event = cabin->door_state;
+        cabin->door_state_pending = 0;
+    }
+    else
+        return 0;
+
+    return 1;
 }
 
 
 /*
  * Thread safe wrapper of elevator control functions.
  * The hardware API specifies that none these functions can be executed in
- * parallel. Synchronization is achieved using api_send_mutex.
- *
- * TODO: Make fair?
+ * parallel. Commands are queued to the output scheduler, which sends stops
+ * before anything else and indicator updates last.
  */
 void handle_door(int cabin, DoorAction action)
 {
-    pthread_mutex_lock(&api_send_mutex);
-    handleDoor(cabin, action);
-    pthread_mutex_unlock(&api_send_mutex);
+    /* Before sending, the doors are told apart by it once they move */
+    __atomic_store_n(&cabins[cabin]->door.commanded, action, __ATOMIC_RELEASE);
+
+    output_send('d', cabin, action);
+
+    telemetry_count(cabin, TELEMETRY_DOOR);
 }
 
 void handle_motor(int cabin, MotorAction action)
 {
-    pthread_mutex_lock(&api_send_mutex);
-    handleMotor(cabin, action);
-    pthread_mutex_unlock(&api_send_mutex);
+    output_send('m', cabin, action);
+
+    telemetry_count(cabin, TELEMETRY_MOTOR);
 }
 
 void handle_scale(int cabin, int floor)
 {
-    pthread_mutex_lock(&api_send_mutex);
-    handleScale(cabin, floor);
-    pthread_mutex_unlock(&api_send_mutex);
+    output_send('s', cabin, floor);
+}
+
+/*
+ * Route of a cabin at current_floor, visiting the size first stops of plan in
+ * order, until it passes the floor of a button in the direction asked for:
+ * the floor its first leg heads for, the floors travelled from there to the
+ * last stop made, the stops made and the floors from that stop to the button.
+ * A button served on the first leg makes no stops, the first leg heads for
+ * it. A button passed by no stop is served after the last one.
+ *
+ * The destination fits before the first stop reached going up above it, or
+ * going down below it, depending on the direction. The highest and lowest
+ * stops reached so far only grow along the plan, so that stop is found by
+ * binary search.
+ */
+static void plan_cost(struct plan *plan, int size, int current_floor,
+                      FloorButtonPressDesc *floor_button, int *first, int *distance,
+                      int *num_stops, int *last)
+{
+    int head, low, high, middle;
+    int destination = floor_button->floor;
+    int up = floor_button->type == GoingUp;
+    int down = floor_button->type == GoingDown;
+    int *floors, *prefix, *extreme;
+
+    *first = destination;
+    *distance = *num_stops = *last = 0;
+
+    /* Straight there if no planned stops */
+    if (!size)
+        return;
+
+    /* Indexed from the first stop */
+    head = plan->head;
+    if (head < 0 || head+size > plan->capacity)     /* torn, read again */
+        head = 0;
+    floors = plan->floors+head;
+    prefix = plan->prefix+head;
+
+    /* The first leg starts wherever the elevator is */
+    if (current_floor < floors[0] ? floors[0] > destination && up :
+                                    floors[0] < destination && down)
+        return;
+
+    /* First stop past the destination, size if none */
+    extreme = up ? plan->highest+head : plan->lowest+head;
+    low = 1;
+    high = size;
+    while ((up || down) && low < high) {
+        middle = (low+high)/2;
+
+        if (up ? extreme[middle] > destination : extreme[middle] < destination)
+            high = middle;
+        else
+            low = middle+1;
+    }
+
+    if (!(up || down))
+        low = size;
+
+    *first = floors[0];
+    *distance = prefix[low-1]-prefix[0];
+    *num_stops = low;
+    *last = abs(floors[low-1] - destination);
 }
 
 /*
- * Calculate travel distance to given floor subject to a particular
- * elevators state.
+ * Score of a cabin for a hall call, the lower the better.
  *
- * Algorithm:
+ * Time of arrival (SCORE_ETA), in ms: the first leg from the actual position
+ * and motion of the cabin, the legs between the stops made before the call
+ * and the last leg to it from the travel times, and the door cycle at every
+ * stop, all of them calibrated, see include/eta.h.
+ *
+ * Distance (SCORE_DISTANCE):
  *  score = travel distance + stops before floor *3
  *
  * The number of stops is weighted more than travel distance as there is
- * a delay at each stop as to allow people to enter and exit the cabin
+ * a delay at each stop as to allow people to enter and exit the cabin.
+ * Calls served after the last stop are scored by the distance to that stop.
+ *
+ * The stops are not walked, their prefix costs are kept by the stop queue
+ * and searched instead, see plan_cost().
  *
  * TODO: Check for impacts of rounding when destination is the same as old_pos
  *       as it gives false results
@@ -717,46 +2005,77 @@ int distance_to_floor(FloorButtonPressDesc *floor_button, elevator_information*
     int score = 0;
     int num_stops = 0;
     int distance = 0;
-    FloorButtonType direction = floor_button->type;
-    int destination = floor_button->floor;
-    int current_floor = round(info->position);
-    int old_pos = current_floor;
-    node_stop_queue *stop = info->queue->first;
+    int first = 0, last = 0;
+    int position = info->position;
+    int current_floor = position_floor(position);
+    int direction = __atomic_load_n(&info->direction, __ATOMIC_RELAXED);
+    stop_queue *queue = info->queue;
+    struct plan *plan;
+    uint32_t seq;
+    int size;
 
-    /* Base score if no planned stops */
-    if (!stop)
-        distance = abs(destination - current_floor);
+    /* Read while the elevator may be changing its plan, retried if torn */
+    do {
+        seq = seqlock_read_begin(&queue->seq);
+        plan = __atomic_load_n(&queue->plan, __ATOMIC_ACQUIRE);
+        size = __atomic_load_n(&queue->size, __ATOMIC_RELAXED);
 
-    /* Iterate all stops until posiible position for destination visit */
-    while (stop) {
-        if (old_pos - stop->floor < 0) {            /* Elevator going upwards */
-            /* destination fits here in the stop queue, stop iterating */
-            if (stop->floor > destination && direction == GoingUp) {
-                distance += abs(old_pos - destination);
-                break;
-            } else {
-                num_stops++;
-                distance += abs(old_pos - stop->floor);
-            }
-        } else {                                    /* Elevator going downwards */
-            /* destination fits here in the stop queue, stop iterating */
-            if (stop->floor < destination && direction == GoingDown) {
-                distance += abs(old_pos - destination);
-                break;
-            } else {
-                num_stops++;
-                distance += abs(old_pos - stop->floor);
-            }
-        }
+        if (!plan || size < 0 || size > plan->capacity)
+            size = 0;
 
-        old_pos = stop->floor;
-        stop = stop->next;
+        plan_cost(plan, size, current_floor, floor_button, &first, &distance,
+                  &num_stops, &last);
+    } while (seqlock_read_retry(&queue->seq, seq));
+
+    if (__atomic_load_n(&score_model, __ATOMIC_RELAXED) == SCORE_DISTANCE) {
+        distance += abs(current_floor - first);
+        if (num_stops < size)
+            distance += last;
+
+        score = distance*__atomic_load_n(&score_weight_distance, __ATOMIC_RELAXED) +
+                num_stops*__atomic_load_n(&score_weight_stops, __ATOMIC_RELAXED);
+        return score;
     }
 
-    score = distance*SCORE_WEIGHT_DISTANCE + num_stops*SCORE_WEIGHT_STOPS;
+    /* Saving on the acceleration if already heading for the first floor */
+    first = FLOOR_POSITION(first)-position;
+    score = eta_travel(first, direction && (first > 0) == (direction > 0));
+
+    if (num_stops)
+        score += distance*eta_floor_ms() + (num_stops-1)*eta_accel_ms() +
+                 num_stops*eta_door_ms() + eta_travel(FLOOR_POSITION(last), 0);
+
     return score;
 }
 
+/* Cost of a floor travelled and of a stop made, as scored */
+void score_weights(int *per_floor, int *per_stop)
+{
+    if (__atomic_load_n(&score_model, __ATOMIC_RELAXED) == SCORE_DISTANCE) {
+        *per_floor = __atomic_load_n(&score_weight_distance, __ATOMIC_RELAXED);
+        *per_stop = __atomic_load_n(&score_weight_stops, __ATOMIC_RELAXED);
+        return;
+    }
+
+    *per_floor = eta_floor_ms();
+    *per_stop = eta_door_ms() + eta_accel_ms();
+}
+
+/*
+ * Weights no score is below: per floor to the call, and per stop passed plus
+ * per floor to that stop, see include/spatial.h
+ */
+void score_bound(int *per_floor, int *per_stop)
+{
+    if (__atomic_load_n(&score_model, __ATOMIC_RELAXED) == SCORE_DISTANCE) {
+        *per_floor = __atomic_load_n(&score_weight_distance, __ATOMIC_RELAXED);
+        *per_stop = __atomic_load_n(&score_weight_stops, __ATOMIC_RELAXED);
+        return;
+    }
+
+    eta_bound(per_floor, per_stop);
+}
+
 /*
  * Implementation of stop_queue
  * 
@@ -765,6 +2084,10 @@ int distance_to_floor(FloorButtonPressDesc *floor_button, elevator_information*
  * a few elements (usually fewer) so the performance gain from implementing
  * this as doubly linked list is virtually none.
  *
+ * Along with the list every queue keeps its stops as a plan of prefix costs,
+ * changed in the same places, so that hall calls are scored without walking
+ * the list. The dispatcher reads the plan under the queue's seqlock.
+ *
  * TODO: Move to a separate file
  */
 /* Returns a new initialized stop_queue */
@@ -777,6 +2100,8 @@ stop_queue* new_stop_queue()
 
     queue->first = NULL;
     queue->size = 0;
+    queue->seq = 0;
+    queue->plan = NULL;
 
     return queue;
 }
@@ -784,27 +2109,181 @@ stop_queue* new_stop_queue()
 /* Destroys an empty stop_queue */
 int destroy_stop_queue(stop_queue* queue)
 {
+    struct plan *plan, *retired;
+
     if (size_stop_queue(queue))
         return 1;
 
+    for (plan = queue->plan; plan; plan = retired) {
+        retired = plan->retired;
+        free(plan);
+    }
+
     free(queue);
 
     return 0;
 }
 
+/*
+ * Make room for size stops in the plan. An outgrown plan may still be read by
+ * the dispatcher, it is kept until the queue is destroyed.
+ */
+int reserve_plan(stop_queue *queue, int size)
+{
+    int capacity = queue->plan ? queue->plan->capacity : 4;
+    struct plan *plan = queue->plan, *old = queue->plan;
+
+    if (plan && plan->head+size <= capacity)
+        return 0;
+
+    /* A larger plan unless popped stops leave room at the front */
+    if (!plan || size > capacity) {
+        while (capacity < size)
+            capacity *= 2;
+
+        if ((plan = malloc(sizeof(struct plan) + 4*capacity*sizeof(int))) == NULL)
+            return 1;
+
+        plan->retired = old;
+        plan->capacity = capacity;
+        plan->head = 0;
+        plan->floors = (int*) (plan+1);
+        plan->prefix = plan->floors + capacity;
+        plan->highest = plan->prefix + capacity;
+        plan->lowest = plan->highest + capacity;
+    }
+
+    if (old) {
+        memmove(plan->floors, old->floors+old->head, queue->size*sizeof(int));
+        memmove(plan->prefix, old->prefix+old->head, queue->size*sizeof(int));
+        memmove(plan->highest, old->highest+old->head, queue->size*sizeof(int));
+        memmove(plan->lowest, old->lowest+old->head, queue->size*sizeof(int));
+        plan->head = 0;
+    }
+
+    __atomic_store_n(&queue->plan, plan, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+ * Update highest and lowest from stop k on. Past stop at they are known to
+ * have been right before, so once one is unchanged so are the rest.
+ */
+static void extremes_plan(struct plan *plan, int k, int at, int last)
+{
+    int *floors = plan->floors;
+    int high, low;
+
+    if (k == plan->head) {
+        plan->highest[k] = INT_MIN;
+        plan->lowest[k] = INT_MAX;
+        k++;
+    }
+
+    for (; k <= last; k++) {
+        high = plan->highest[k-1];
+        low = plan->lowest[k-1];
+
+        if (floors[k-1] < floors[k])
+            high = floors[k] > high ? floors[k] : high;
+        else
+            low = floors[k] < low ? floors[k] : low;
+
+        if (k > at && high == plan->highest[k] && low == plan->lowest[k])
+            break;
+
+        plan->highest[k] = high;
+        plan->lowest[k] = low;
+    }
+}
+
+/* Insert floor as stop index of the plan, called before the size is raised */
+void insert_plan(stop_queue *queue, int index, int floor)
+{
+    struct plan *plan = queue->plan;
+    int *floors = plan->floors, *prefix = plan->prefix;
+    int first = plan->head, last = plan->head+queue->size;     /* after insertion */
+    int at = plan->head+index;
+    int k, delta;
+
+    memmove(&floors[at+1], &floors[at], (last-at)*sizeof(int));
+    memmove(&prefix[at+1], &prefix[at], (last-at)*sizeof(int));
+    memmove(&plan->highest[at+1], &plan->highest[at], (last-at)*sizeof(int));
+    memmove(&plan->lowest[at+1], &plan->lowest[at], (last-at)*sizeof(int));
+    floors[at] = floor;
+
+    if (at > first)
+        prefix[at] = prefix[at-1] + abs(floors[at] - floors[at-1]);
+    else if (at < last)
+        prefix[at] = prefix[at+1];
+    else
+        prefix[at] = 0;
+
+    /* The stops after it are a detour further */
+    if (at < last) {
+        delta = prefix[at] + abs(floors[at+1] - floors[at]) - prefix[at+1];
+        for (k = at+1; k <= last; k++)
+            prefix[k] += delta;
+    }
+
+    extremes_plan(plan, at, at+1, last);
+}
+
+/* Remove the first stop of the plan, called before the size is lowered */
+void pop_plan(stop_queue *queue)
+{
+    struct plan *plan = queue->plan;
+
+    if (queue->size == 1) {
+        plan->head = 0;
+        return;
+    }
+
+    plan->head++;
+    extremes_plan(plan, plan->head, plan->head, plan->head+queue->size-2);
+}
+
+/* Rebuild the plan from the stops of the queue */
+void rebuild_plan(stop_queue *queue)
+{
+    int k;
+    struct plan *plan = queue->plan;
+    node_stop_queue *stop;
+
+    plan->head = 0;
+
+    for (k = 0, stop = queue->first; stop; k++, stop = stop->next) {
+        plan->floors[k] = stop->floor;
+        plan->prefix[k] = k ? plan->prefix[k-1] + abs(plan->floors[k] - plan->floors[k-1]) : 0;
+    }
+
+    extremes_plan(plan, 0, queue->size, queue->size-1);
+}
+
 /* Push a floor to stop_queue */
-int push_stop_queue(int floor, int direction, double position, elevator_information *info)
+int push_stop_queue(int floor, int direction, int position, elevator_information *info)
 {
     int placed_floor = 0;
-    double old_pos = info->position;
+    int index = 0;
+    int old_pos = info->position;
     stop_queue *queue = info->queue;
     node_stop_queue *new_node, *curr_node;
 
     if ((new_node = (node_stop_queue*) malloc(sizeof(node_stop_queue))) == NULL)
         return 1;
 
+    seqlock_write_begin(&queue->seq);
+
+    if (reserve_plan(queue, queue->size+1)) {
+        seqlock_write_end(&queue->seq);
+        free(new_node);
+        return 1;
+    }
+
     /* Set basic node properties */
     new_node->floor = floor;
+    new_node->direction = direction;
     new_node->next = NULL;
 
     /* Place node first if queue is empty */
@@ -818,18 +2297,18 @@ int push_stop_queue(int floor, int direction, double position, elevator_informat
      */
     else {
         curr_node = queue->first;
-        int elev_dir = (old_pos < curr_node->floor) ? 1 : -1;
+        int elev_dir = (old_pos < FLOOR_POSITION(curr_node->floor)) ? 1 : -1;
 
         /* Check if suitable first in queue */
         if (elev_dir + direction > 0) {         /* Elevator going up */
             /* If stop is inbetween */
-            if (old_pos < floor && floor < curr_node->floor) {
+            if (old_pos < FLOOR_POSITION(floor) && floor < curr_node->floor) {
                 new_node->next = curr_node;
                 queue->first = new_node;
                 placed_floor = 1;
             }
         } else {                                /* Elevator going down */
-            if (curr_node->floor < floor && floor < old_pos) {
+            if (curr_node->floor < floor && FLOOR_POSITION(floor) < old_pos) {
                 new_node->next = curr_node;
                 queue->first = new_node;
                 placed_floor = 1;
@@ -838,7 +2317,7 @@ int push_stop_queue(int floor, int direction, double position, elevator_informat
 
         /* Check rest */
         while (curr_node->next && !placed_floor) {
-            if (curr_node->floor > old_pos) {   /* Elevator going upwards */
+            if (FLOOR_POSITION(curr_node->floor) > old_pos) {   /* Elevator going upwards */
                 if (curr_node->floor < floor && floor < curr_node->next->floor &&
                         direction >= 0) {
                     /* Place stop */
@@ -846,6 +2325,7 @@ int push_stop_queue(int floor, int direction, double position, elevator_informat
                     new_node->next = curr_node->next;
                     curr_node->next = new_node;
                     placed_floor = 1;
+                    index++;
                     break;
                 }
             } else {                            /* Elevator going downwards */
@@ -856,22 +2336,29 @@ int push_stop_queue(int floor, int direction, double position, elevator_informat
                     new_node->next = curr_node->next;
                     curr_node->next = new_node;
                     placed_floor = 1;
+                    index++;
                     break;
                 }
             }
 
             /* Iterate queue */
-            old_pos = curr_node->floor;
+            old_pos = FLOOR_POSITION(curr_node->floor);
             curr_node = curr_node->next;
+            index++;
         }
 
         /* If floor didn't fit yet, put last */
-        if (!placed_floor)
+        if (!placed_floor) {
             curr_node->next = new_node;
+            index = queue->size;
+        }
     }
 
+    insert_plan(queue, index, floor);
     ++queue->size;
 
+    seqlock_write_end(&queue->seq);
+
     return 0;
 }
 
@@ -886,15 +2373,99 @@ int pop_stop_queue(stop_queue* queue)
 
     floor = queue->first->floor;
 
+    seqlock_write_begin(&queue->seq);
+
     old_first = queue->first;
     queue->first = old_first->next;
     free(old_first);
 
+    pop_plan(queue);
     --queue->size;
 
+    seqlock_write_end(&queue->seq);
+
     return floor;
 }
 
+/*
+ * Removes all hall calls of a stop_queue, keeping the order of the rest.
+ * calls must have room for size_stop_queue(queue) entries, returns the number
+ * of hall calls put there.
+ */
+int remove_hall_calls_stop_queue(stop_queue* queue, FloorButtonPressDesc *calls)
+{
+    int num_calls = 0;
+    node_stop_queue **curr = &queue->first;
+    node_stop_queue *hall_call;
+
+    seqlock_write_begin(&queue->seq);
+
+    while (*curr) {
+        if (!(*curr)->direction) {
+            curr = &(*curr)->next;
+            continue;
+        }
+
+        hall_call = *curr;
+        *curr = hall_call->next;
+
+        calls[num_calls].floor = hall_call->floor;
+        calls[num_calls].type = (FloorButtonType) hall_call->direction;
+        num_calls++;
+
+        free(hall_call);
+        --queue->size;
+    }
+
+    if (num_calls)
+        rebuild_plan(queue);
+
+    seqlock_write_end(&queue->seq);
+
+    return num_calls;
+}
+
+/*
+ * Removes the first stop at floor made for direction, keeping the order of the
+ * rest. Returns 1 if there was one.
+ */
+int remove_stop_queue(stop_queue* queue, int floor, int direction)
+{
+    node_stop_queue **curr = &queue->first;
+    node_stop_queue *stop;
+
+    while (*curr && ((*curr)->floor != floor || (*curr)->direction != direction))
+        curr = &(*curr)->next;
+
+    if (!*curr)
+        return 0;
+
+    seqlock_write_begin(&queue->seq);
+
+    stop = *curr;
+    *curr = stop->next;
+    free(stop);
+    --queue->size;
+
+    rebuild_plan(queue);
+
+    seqlock_write_end(&queue->seq);
+
+    return 1;
+}
+
+/* Whether a stop_queue stops at floor */
+int contains_stop_queue(stop_queue* queue, int floor)
+{
+    node_stop_queue *stop;
+
+    for (stop = queue->first; stop; stop = stop->next)
+        if (stop->floor == floor)
+            return 1;
+
+    return 0;
+}
+
 /* Returns the floor of a stop_queue */
 int peek_stop_queue(stop_queue* queue)
 {
@@ -0,0 +1,125 @@
+/*
+ * Door dwell, see include/dwell.h
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "hardwareAPI.h"
+#include "cabin.h"
+#include "controller.h"
+#include "dwell.h"
+#include "log.h"
+
+/* Fixed point of the learned rates */
+#define RATE_ONE 256
+
+/*
+ * Passengers boarding per stop, RATE_ONE per passenger, by floor and slot.
+ * Updated by every elevator thread stopping at the floor, an update racing
+ * another may be lost which only slows the learning down.
+ */
+static int *rates = NULL;
+static int rate_floors;
+
+static int dwell_min = DWELL_MIN;
+static int dwell_max = DWELL_MAX;
+static int dwell_per_passenger = DWELL_PER_PASSENGER;
+
+int dwell_open(int num_floors)
+{
+    rate_floors = num_floors;
+    rates = calloc(num_floors*DWELL_SLOTS, sizeof(int));
+
+    return rates ? 0 : -1;
+}
+
+void dwell_close()
+{
+    free(rates);
+    rates = NULL;
+}
+
+/* Rate of floor at this time of day, NULL if not learned */
+static int *rate(int floor)
+{
+    time_t now = time(NULL);
+    struct tm local;
+
+    if (!rates || floor < 0 || floor >= rate_floors || !localtime_r(&now, &local))
+        return NULL;
+
+    return &rates[floor*DWELL_SLOTS + local.tm_hour*DWELL_SLOTS/24];
+}
+
+int dwell_time(int id, int floor, int demand)
+{
+    int i, busy = 0, passengers, dwell, max;
+    int *learned = rate(floor);
+    int expected = learned ? __atomic_load_n(learned, __ATOMIC_RELAXED) : 0;
+    int min = __atomic_load_n(&dwell_min, __ATOMIC_RELAXED);
+    int per_passenger = __atomic_load_n(&dwell_per_passenger, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&dwell_max, __ATOMIC_RELAXED);
+
+    for (i = 1; i <= num_elevators; i++)
+        if (__atomic_load_n(&cabins[i]->info.queue->size, __ATOMIC_RELAXED))
+            busy++;
+
+    if (busy*100 >= num_elevators*DWELL_BUSY_SHARE)
+        max = (min+max)/2;
+
+    /* Expected passengers rounded to the nearest */
+    passengers = (expected + RATE_ONE/2)/RATE_ONE;
+    if (demand > passengers)
+        passengers = demand;
+
+    dwell = min + passengers*per_passenger;
+    if (dwell > max)
+        dwell = max;
+    if (dwell < min)
+        dwell = min;
+
+    log_msg(LOG_DEBUG, LOG_DWELL, id, dwell, floor, demand, (double) expected/RATE_ONE,
+            busy);
+
+    return dwell;
+}
+
+void dwell_learn(int floor, int boarded)
+{
+    int *learned = rate(floor);
+    int current;
+
+    if (!learned)
+        return;
+
+    current = __atomic_load_n(learned, __ATOMIC_RELAXED);
+    current += (boarded*RATE_ONE - current)/DWELL_LEARN_RATE;
+
+    __atomic_store_n(learned, current, __ATOMIC_RELAXED);
+}
+
+void dwell_get(struct dwell_config *config)
+{
+    config->min = __atomic_load_n(&dwell_min, __ATOMIC_RELAXED);
+    config->max = __atomic_load_n(&dwell_max, __ATOMIC_RELAXED);
+    config->per_passenger = __atomic_load_n(&dwell_per_passenger, __ATOMIC_RELAXED);
+}
+
+int dwell_set(struct dwell_config *config)
+{
+    if (config->min < 0 || config->max < config->min || config->per_passenger < 0)
+        return -1;
+
+    __atomic_store_n(&dwell_min, config->min, __ATOMIC_RELAXED);
+    __atomic_store_n(&dwell_max, config->max, __ATOMIC_RELAXED);
+    __atomic_store_n(&dwell_per_passenger, config->per_passenger, __ATOMIC_RELAXED);
+
+    log_msg(LOG_INFO, LOG_DWELL_CONFIG, config->min, config->max, config->per_passenger);
+
+    return 0;
+}
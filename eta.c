@@ -0,0 +1,233 @@
+/*
+ * Calibrated time of arrival, see include/eta.h
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "hardwareAPI.h"
+#include "eta.h"
+#include "rt.h"
+#include "log.h"
+
+/* Runs from rest to rest, ms by floors, num_floors+1 entries */
+static int *travel = NULL;
+static int travel_floors;
+
+/* Read by every scoring thread */
+static int floor_ms = 1000/ETA_SPEED;
+static int accel_ms = 0;
+static int door_open_ms = ETA_DOOR;
+static int door_close_ms = ETA_DOOR;
+static int dwell_ms = 0;
+
+/*
+ * Weighted sums of the runs for the fit, of 1, d, t, d*d and d*t with d in
+ * floors and t in seconds. Runs are timed by every elevator thread.
+ */
+static pthread_mutex_t runs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static double sums[5];
+static double speed = ETA_SPEED;
+static uint64_t runs = 0;
+static int fitted = 0;
+
+/* Fill the table for speed v and acceleration v/k, holding runs_mutex */
+static void build_travel(double v, double k)
+{
+    int d;
+    double t;
+
+    __atomic_store_n(&floor_ms, (int) lround(1000/v), __ATOMIC_RELAXED);
+    __atomic_store_n(&accel_ms, (int) lround(1000*k), __ATOMIC_RELAXED);
+
+    if (!travel)
+        return;
+
+    for (d = 0; d <= travel_floors; d++) {
+        if (d >= v*k)
+            t = d/v + k;
+        else
+            t = 2*sqrt(d*k/v);
+
+        __atomic_store_n(&travel[d], (int) lround(1000*t), __ATOMIC_RELAXED);
+    }
+}
+
+int eta_open(int num_floors)
+{
+    travel_floors = num_floors;
+    travel = malloc((num_floors+1)*sizeof(int));
+
+    if (!travel)
+        return -1;
+
+    rt_mutex_init(&runs_mutex);
+
+    pthread_mutex_lock(&runs_mutex);
+    build_travel(speed, 0);
+    pthread_mutex_unlock(&runs_mutex);
+
+    return 0;
+}
+
+void eta_close()
+{
+    free(travel);
+    travel = NULL;
+}
+
+void eta_speed(double reported)
+{
+    pthread_mutex_lock(&runs_mutex);
+
+    if (!runs && reported > 0) {
+        speed = reported;
+        build_travel(speed, 0);
+    }
+
+    pthread_mutex_unlock(&runs_mutex);
+}
+
+void eta_run(int distance, int ms)
+{
+    int i;
+    double floors = (double) distance/HW_POSITION_SCALE;
+    double t = ms/1000.0;
+    double v, k, slope, det;
+    const double decay = 1 - 1.0/ETA_LEARN_RATE;
+
+    if (distance < HW_POSITION_SCALE/2 || ms <= 0)
+        return;
+
+    pthread_mutex_lock(&runs_mutex);
+
+    for (i = 0; i < 5; i++)
+        sums[i] *= decay;
+
+    sums[0] += 1;
+    sums[1] += floors;
+    sums[2] += t;
+    sums[3] += floors*floors;
+    sums[4] += floors*t;
+    runs++;
+
+    /* Averaged until the runs are many and long and short enough to fit */
+    v = sums[1]/sums[2];
+    k = 0;
+    fitted = 0;
+
+    det = sums[0]*sums[3] - sums[1]*sums[1];
+    if (runs >= ETA_MIN_RUNS && det > 0.01*sums[0]*sums[0]) {
+        slope = (sums[0]*sums[4] - sums[1]*sums[2])/det;
+
+        if (slope > 0) {
+            v = 1/slope;
+            k = (sums[2] - slope*sums[1])/sums[0];
+            if (k < 0)
+                k = 0;
+            fitted = 1;
+        }
+    }
+
+    speed = v;
+    build_travel(v, k);
+
+    pthread_mutex_unlock(&runs_mutex);
+
+    log_msg(LOG_DEBUG, LOG_ETA_RUN, floors, ms, v, 1000*k);
+}
+
+/* Move an average in ms a step towards ms */
+static void learn(int *average, int ms)
+{
+    int current = __atomic_load_n(average, __ATOMIC_RELAXED);
+
+    __atomic_store_n(average, current + (ms-current)/ETA_LEARN_RATE, __ATOMIC_RELAXED);
+}
+
+void eta_door(int opening, int ms)
+{
+    learn(opening ? &door_open_ms : &door_close_ms, ms);
+}
+
+void eta_dwell(int ms)
+{
+    learn(&dwell_ms, ms);
+}
+
+int eta_travel(int distance, int moving)
+{
+    int d, part, t, at_speed;
+    int per_floor = __atomic_load_n(&floor_ms, __ATOMIC_RELAXED);
+
+    distance = abs(distance);
+    d = distance/HW_POSITION_SCALE;
+    part = distance%HW_POSITION_SCALE;
+
+    at_speed = d*per_floor + part*per_floor/HW_POSITION_SCALE;
+
+    if (!travel)
+        t = at_speed;
+    else if (d >= travel_floors)
+        t = __atomic_load_n(&travel[travel_floors], __ATOMIC_RELAXED) +
+            (d-travel_floors)*per_floor + part*per_floor/HW_POSITION_SCALE;
+    else
+        t = __atomic_load_n(&travel[d], __ATOMIC_RELAXED) + part*
+            (__atomic_load_n(&travel[d+1], __ATOMIC_RELAXED) -
+             __atomic_load_n(&travel[d], __ATOMIC_RELAXED))/HW_POSITION_SCALE;
+
+    /* Already up to speed, half the acceleration is behind */
+    if (moving)
+        t -= __atomic_load_n(&accel_ms, __ATOMIC_RELAXED)/2;
+
+    if (t < at_speed)
+        t = at_speed;
+
+    return t;
+}
+
+int eta_floor_ms()
+{
+    return __atomic_load_n(&floor_ms, __ATOMIC_RELAXED);
+}
+
+int eta_accel_ms()
+{
+    return __atomic_load_n(&accel_ms, __ATOMIC_RELAXED);
+}
+
+int eta_door_ms()
+{
+    return __atomic_load_n(&door_open_ms, __ATOMIC_RELAXED) +
+           __atomic_load_n(&dwell_ms, __ATOMIC_RELAXED) +
+           __atomic_load_n(&door_close_ms, __ATOMIC_RELAXED);
+}
+
+void eta_bound(int *per_floor, int *per_stop)
+{
+    *per_floor = eta_floor_ms();
+    *per_stop = eta_door_ms();
+}
+
+void eta_model(struct eta_model *model)
+{
+    pthread_mutex_lock(&runs_mutex);
+    model->speed = speed;
+    model->runs = runs;
+    model->fitted = fitted;
+    pthread_mutex_unlock(&runs_mutex);
+
+    model->floor_ms = eta_floor_ms();
+    model->accel_ms = eta_accel_ms();
+    model->door_open_ms = __atomic_load_n(&door_open_ms, __ATOMIC_RELAXED);
+    model->door_close_ms = __atomic_load_n(&door_close_ms, __ATOMIC_RELAXED);
+    model->dwell_ms = __atomic_load_n(&dwell_ms, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,379 @@
+/*
+ * Group control, zones of cabins bidding for hall calls on a shared board
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "hardwareAPI.h"
+#include "cabin.h"
+#include "controller.h"
+#include "group.h"
+#include "rt.h"
+#include "log.h"
+
+struct group {
+    int id;
+    int first, last;
+    int low, high;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t signal;
+    unsigned posted;                    /* wakeups, under mutex */
+
+    /* Round last bid for per board slot, owned by the group thread */
+    uint32_t *rounds;
+
+    uint64_t bids;
+    uint64_t assigned;
+    uint64_t contested;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct board *board = NULL;
+static size_t board_size;
+
+static struct group *groups = NULL;
+static int num_running = 0;
+static int groups_open = 0;
+
+/* Threads in group_post, the board is not released until they are done */
+static int num_posting = 0;
+
+/* Board slot of a floor and direction */
+static struct board_call *slot(int floor, FloorButtonType type)
+{
+    return &board->calls[floor*2 + (type == GoingDown)];
+}
+
+/* Whether group g bids for calls at floor */
+static int in_zone(struct group *group, int floor)
+{
+    return floor == 0 || (floor >= group->low && floor <= group->high);
+}
+
+static void wake(struct group *group)
+{
+    pthread_mutex_lock(&group->mutex);
+    group->posted++;
+    pthread_cond_signal(&group->signal);
+    pthread_mutex_unlock(&group->mutex);
+}
+
+int group_post(FloorButtonPressDesc *call)
+{
+    int g, count, posted = 1, expected = BOARD_FREE;
+    struct board_call *c;
+
+    /*
+     * Posted by the dispatcher and by elevators handing calls over, which
+     * may race group_close. Either it waits for the post and sweeps the call
+     * off the board, or the post sees the groups closed.
+     */
+    __atomic_add_fetch(&num_posting, 1, __ATOMIC_SEQ_CST);
+
+    if (!(count = __atomic_load_n(&num_running, __ATOMIC_SEQ_CST))) {
+        __atomic_sub_fetch(&num_posting, 1, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    if (call->floor < 0 || call->floor >= board->num_floors)
+        goto done;
+
+    c = slot(call->floor, call->type);
+
+    if (!__atomic_compare_exchange_n(&c->state, &expected, BOARD_POSTING, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        goto done;
+
+    c->bid = UINT64_MAX;
+    c->bids = 0;
+    c->candidates = 0;
+    for (g = 0; g < count; g++)
+        c->candidates += in_zone(&groups[g], call->floor);
+    c->round++;
+
+    __atomic_store_n(&c->state, BOARD_OPEN, __ATOMIC_RELEASE);
+
+    for (g = 0; g < count; g++)
+        if (in_zone(&groups[g], call->floor))
+            wake(&groups[g]);
+
+    posted = 0;
+done:
+    __atomic_sub_fetch(&num_posting, 1, __ATOMIC_RELEASE);
+    return posted;
+}
+
+/* Bid for a call if not done this round, the last bidder settles it */
+static void bid(struct group *group, struct board_call *c, FloorButtonPressDesc *call)
+{
+    int e, score, winner;
+    uint64_t mine, lowest;
+
+    if (group->rounds[c - board->calls] == c->round)
+        return;
+    group->rounds[c - board->calls] = c->round;
+
+    e = get_group_elevator(call, group->first, group->last, &score);
+    if (!__atomic_load_n(&cabins[e]->in_service, __ATOMIC_RELAXED))
+        score += GROUP_OUT_OF_SERVICE;
+
+    __atomic_add_fetch(&group->bids, 1, __ATOMIC_RELAXED);
+
+    mine = (uint64_t) score << 8 | group->id;
+    lowest = __atomic_load_n(&c->bid, __ATOMIC_RELAXED);
+    while (mine < lowest &&
+           !__atomic_compare_exchange_n(&c->bid, &lowest, mine, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    if (__atomic_add_fetch(&c->bids, 1, __ATOMIC_ACQ_REL) != c->candidates)
+        return;
+
+    winner = __atomic_load_n(&c->bid, __ATOMIC_RELAXED) & 0xff;
+    c->owner = winner;
+    __atomic_store_n(&c->state, BOARD_WON, __ATOMIC_RELEASE);
+
+    if (winner != group->id)
+        wake(&groups[winner]);
+}
+
+/* Give a won call to the best cabin of the group and free the slot */
+static void assign(struct group *group, struct board_call *c, FloorButtonPressDesc *call)
+{
+    int e, score;
+    struct event event;
+
+    e = get_group_elevator(call, group->first, group->last, &score);
+
+    __atomic_add_fetch(&group->assigned, 1, __ATOMIC_RELAXED);
+    if (c->candidates > 1)
+        __atomic_add_fetch(&group->contested, 1, __ATOMIC_RELAXED);
+
+    log_msg(LOG_DEBUG, LOG_GROUP_ASSIGN, group->id, call->floor, (int) call->type,
+            c->candidates, e);
+
+    __atomic_store_n(&c->state, BOARD_FREE, __ATOMIC_RELEASE);
+
+    event.type = FloorButton;
+    event.desc.fbp = *call;
+
+    /* Posted again by the dispatcher once a cabin has room */
+    if (enqueue_event(e, &event)) {
+        hold_hall_call(call);
+        return;
+    }
+
+    pthread_cond_signal(&cabins[e]->signal);
+}
+
+/* Bid for and assign the calls of the zone */
+static void settle(struct group *group, int floor)
+{
+    static const FloorButtonType types[2] = { GoingUp, GoingDown };
+    int i, state;
+    FloorButtonPressDesc call;
+    struct board_call *c;
+
+    for (i = 0; i < 2; i++) {
+        c = slot(floor, types[i]);
+        call.floor = floor;
+        call.type = types[i];
+
+        state = __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+
+        if (state == BOARD_OPEN) {
+            bid(group, c, &call);
+            state = __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+        }
+
+        if (state == BOARD_WON && c->owner == group->id)
+            assign(group, c, &call);
+    }
+}
+
+static void *group_thread(void *arg)
+{
+    struct group *group = arg;
+    unsigned seen = 0;
+    int floor;
+
+    if (pin_thread(cabin_cpu(&affinity, group->first)))
+        fprintf(stderr, "Cannot pin group %d to cpu %d\n", group->id,
+                cabin_cpu(&affinity, group->first));
+
+    rt_thread(RT_DISPATCHER);
+
+    log_msg(LOG_INFO, LOG_GROUP_UP, group->id, group->first, group->last, group->low,
+            group->high);
+
+    while (1) {
+        pthread_mutex_lock(&group->mutex);
+        while (group->posted == seen && __atomic_load_n(&groups_open, __ATOMIC_RELAXED))
+            pthread_cond_wait(&group->signal, &group->mutex);
+        seen = group->posted;
+        pthread_mutex_unlock(&group->mutex);
+
+        if (!__atomic_load_n(&groups_open, __ATOMIC_RELAXED))
+            break;
+
+        if (group->low > 0)
+            settle(group, 0);
+        for (floor = group->low; floor <= group->high; floor++)
+            settle(group, floor);
+    }
+
+    log_msg(LOG_INFO, LOG_GROUP_DOWN, group->id);
+
+    return NULL;
+}
+
+int group_open(int count)
+{
+    int g;
+    struct group *group;
+
+    if (count < 1 || count > GROUP_MAX || count > num_elevators || count > num_floors-1)
+        return -1;
+
+    board_size = sizeof(struct board) + num_floors*2*sizeof(struct board_call);
+    board = mmap(NULL, board_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (board == MAP_FAILED) {
+        board = NULL;
+        return -1;
+    }
+
+    board->num_floors = num_floors;
+    board->num_groups = count;
+
+    if (posix_memalign((void**) &groups, CACHE_LINE_SIZE, count*sizeof(struct group))) {
+        munmap(board, board_size);
+        board = NULL;
+        return -1;
+    }
+
+    num_running = count;
+    groups_open = 1;
+
+    /* Zones share their top floor with the next, [0, 5] and [5, 11] for two */
+    for (g = 0; g < count; g++) {
+        group = &groups[g];
+
+        group->id = g;
+        group->first = g*num_elevators/count + 1;
+        group->last = (g+1)*num_elevators/count;
+        group->low = g*(num_floors-1)/count;
+        group->high = (g+1)*(num_floors-1)/count;
+
+        rt_mutex_init(&group->mutex);
+        pthread_cond_init(&group->signal, NULL);
+        group->posted = 0;
+        group->rounds = calloc(num_floors*2, sizeof(uint32_t));
+
+        group->bids = 0;
+        group->assigned = 0;
+        group->contested = 0;
+    }
+
+    for (g = 0; g < count; g++)
+        if (pthread_create(&groups[g].thread, NULL, group_thread, &groups[g])) {
+            num_running = g;
+            group_close();
+            return -1;
+        }
+
+    return 0;
+}
+
+void group_close()
+{
+    int g, i, count = num_running;
+    struct board_call *c;
+    struct event event;
+
+    if (!board)
+        return;
+
+    /* Hall calls go straight to a cabin from now on, once posts under way
+       are on the board */
+    __atomic_store_n(&num_running, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&groups_open, 0, __ATOMIC_RELAXED);
+
+    while (__atomic_load_n(&num_posting, __ATOMIC_SEQ_CST))
+        sched_yield();
+
+    for (g = 0; g < count; g++) {
+        wake(&groups[g]);
+        pthread_join(groups[g].thread, NULL);
+        free(groups[g].rounds);
+    }
+
+    /* Calls the groups left open or won but unassigned */
+    event.type = FloorButton;
+
+    for (i = 0; i < 2*board->num_floors; i++) {
+        c = &board->calls[i];
+
+        while (__atomic_load_n(&c->state, __ATOMIC_ACQUIRE) == BOARD_POSTING)
+            sched_yield();
+
+        if (__atomic_load_n(&c->state, __ATOMIC_ACQUIRE) == BOARD_FREE)
+            continue;
+
+        __atomic_store_n(&c->state, BOARD_FREE, __ATOMIC_RELEASE);
+
+        event.desc.fbp.floor = i/2;
+        event.desc.fbp.type = i % 2 ? GoingDown : GoingUp;
+
+        log_msg(LOG_INFO, LOG_GROUP_UNSETTLED, event.desc.fbp.floor,
+                (int) event.desc.fbp.type);
+        dispatch_floor_button(&event);
+    }
+
+    free(groups);
+    groups = NULL;
+
+    munmap(board, board_size);
+    board = NULL;
+}
+
+int group_count()
+{
+    return __atomic_load_n(&num_running, __ATOMIC_ACQUIRE);
+}
+
+int group_of(int id)
+{
+    int g;
+
+    for (g = 0; g < num_running; g++)
+        if (id >= groups[g].first && id <= groups[g].last)
+            return g;
+
+    return 0;
+}
+
+void group_stats(int g, struct group_stats *stats)
+{
+    struct group *group = &groups[g];
+
+    stats->first = group->first;
+    stats->last = group->last;
+    stats->low = group->low;
+    stats->high = group->high;
+    stats->bids = __atomic_load_n(&group->bids, __ATOMIC_RELAXED);
+    stats->assigned = __atomic_load_n(&group->assigned, __ATOMIC_RELAXED);
+    stats->contested = __atomic_load_n(&group->contested, __ATOMIC_RELAXED);
+}
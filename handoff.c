@@ -0,0 +1,401 @@
+/*
+ * Handoff of the hardware connection to a new controller, see
+ * include/handoff.h
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "hardwareAPI.h"
+#include "cabin.h"
+#include "controller.h"
+#include "handoff.h"
+#include "journal.h"
+#include "log.h"
+#include "output.h"
+
+/* Connection of the new controller, by the one handing over */
+static int handoff_fd = -1;
+
+/* When the dispatcher handing over stopped, ns */
+static int64_t stopped = 0;
+
+static int64_t monotonic_ns()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t) now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+static int write_all(int fd, const char *buf, int len)
+{
+    int count;
+
+    while (len > 0) {
+        if ((count = write(fd, buf, len)) <= 0)
+            return -1;
+        buf += count;
+        len -= count;
+    }
+
+    return 0;
+}
+
+static int read_all(int fd, char *buf, int len)
+{
+    int count;
+
+    while (len > 0) {
+        if ((count = read(fd, buf, len)) <= 0)
+            return -1;
+        buf += count;
+        len -= count;
+    }
+
+    return 0;
+}
+
+/*
+ * Passengers of destination dispatch, as sent after the checkpoints, see
+ * include/handoff.h. Returns the number of values put in *values, -1 if out
+ * of memory. The elevator threads are done.
+ */
+static int save_passengers(int32_t **values)
+{
+    int i, f, count = 2*num_backlog;
+    struct cabin *cabin;
+    int32_t *to;
+
+    for (i = 1; i <= num_elevators; i++)
+        count += 1 + 2*cabins[i]->num_waiting + 2*num_floors + 1;
+
+    if ((to = *values = malloc(count*sizeof(int32_t))) == NULL)
+        return -1;
+
+    for (i = 0; i < num_backlog; i++) {
+        *to++ = backlog[i].floor;
+        *to++ = backlog[i].destination;
+    }
+
+    for (i = 1; i <= num_elevators; i++) {
+        cabin = cabins[i];
+
+        *to++ = cabin->num_waiting;
+        for (f = 0; f < cabin->num_waiting; f++) {
+            *to++ = cabin->waiting[f].floor;
+            *to++ = cabin->waiting[f].destination;
+        }
+
+        for (f = 0; f < num_floors; f++)
+            *to++ = cabin->riding[f];
+        for (f = 0; f < num_floors; f++)
+            *to++ = cabin->planned[f];
+        *to++ = cabin->load;
+    }
+
+    return count;
+}
+
+/* Read count passengers, 0 if each is a trip within the building */
+static int read_calls(int fd, DestinationPressDesc *calls, int count)
+{
+    int i;
+    int32_t call[2];
+
+    for (i = 0; i < count; i++) {
+        if (read_all(fd, (char*) call, sizeof(call)) ||
+                call[0] < 0 || call[0] >= num_floors || call[1] < 0 ||
+                call[1] >= num_floors || call[0] == call[1])
+            return -1;
+
+        calls[i].floor = call[0];
+        calls[i].destination = call[1];
+    }
+
+    return 0;
+}
+
+/*
+ * Take the passengers sent by save_passengers(), before the elevators are
+ * given any event. Returns 0 on success.
+ */
+static int load_passengers(int fd, int count)
+{
+    int i, f;
+    int32_t num_waiting, load;
+    int32_t *floors;
+    struct cabin *cabin;
+
+    if (count < 0 || (count && (backlog = malloc(count*sizeof(DestinationPressDesc))) == NULL) ||
+            read_calls(fd, backlog, count))
+        return -1;
+    num_backlog = count;
+
+    if ((floors = malloc(2*num_floors*sizeof(int32_t))) == NULL)
+        return -1;
+
+    for (i = 1; i <= num_elevators; i++) {
+        cabin = cabins[i];
+
+        if (read_all(fd, (char*) &num_waiting, sizeof(num_waiting)) || num_waiting < 0)
+            break;
+
+        /* Owned by the elevator thread, which takes events under the mutex */
+        pthread_mutex_lock(&cabin->event_buffer_mutex);
+
+        if (num_waiting > cabin->size_waiting) {
+            cabin->waiting = realloc(cabin->waiting, num_waiting*sizeof(DestinationPressDesc));
+            cabin->size_waiting = cabin->waiting ? num_waiting : 0;
+        }
+
+        if (num_waiting > cabin->size_waiting ||
+                read_calls(fd, cabin->waiting, num_waiting) ||
+                read_all(fd, (char*) floors, 2*num_floors*sizeof(int32_t)) ||
+                read_all(fd, (char*) &load, sizeof(load)) || load < 0) {
+            pthread_mutex_unlock(&cabin->event_buffer_mutex);
+            break;
+        }
+
+        cabin->num_waiting = num_waiting;
+        for (f = 0; f < num_floors; f++) {
+            cabin->riding[f] = floors[f];
+            __atomic_store_n(&cabin->planned[f], floors[num_floors+f], __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&cabin->load, load, __ATOMIC_RELAXED);
+
+        pthread_mutex_unlock(&cabin->event_buffer_mutex);
+    }
+
+    free(floors);
+
+    return i <= num_elevators ? -1 : 0;
+}
+
+int handoff_request(int fd, int cabins, int floors, const char **reason)
+{
+    if (!journal_enabled()) {
+        *reason = "no journal to hand over";
+        return -1;
+    }
+
+    if (cabins != num_elevators || floors != num_floors) {
+        *reason = "fleet differs";
+        return -1;
+    }
+
+    if (__atomic_load_n(&handoff_fd, __ATOMIC_ACQUIRE) >= 0) {
+        *reason = "already handing over";
+        return -1;
+    }
+
+    if ((fd = dup(fd)) < 0) {
+        *reason = "cannot keep the connection";
+        return -1;
+    }
+
+    __atomic_store_n(&handoff_fd, fd, __ATOMIC_RELEASE);
+
+    /* Stop at the next event, and have one coming */
+    running = 0;
+    output_send('v', 0, 0);
+
+    return 0;
+}
+
+int handoff_pending()
+{
+    if (__atomic_load_n(&handoff_fd, __ATOMIC_ACQUIRE) < 0)
+        return 0;
+
+    if (!stopped)
+        stopped = monotonic_ns();
+
+    return 1;
+}
+
+int handoff_send()
+{
+    int fd, len, slots_size, num_values = 0;
+    char unread[HW_BUFFER_SIZE];
+    char *slots;
+    int32_t *values = NULL;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct handoff_header header;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+
+    slots_size = num_elevators*journal_slot_size(JOURNAL_STOPS(num_floors));
+    if ((slots = malloc(slots_size)) == NULL)
+        return -1;
+
+    journal_save(slots);
+
+    if (destination && (num_values = save_passengers(&values)) < 0) {
+        free(slots);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = HANDOFF_MAGIC;
+    header.version = HANDOFF_VERSION;
+    header.pid = getpid();
+    header.num_cabins = num_elevators;
+    header.num_floors = num_floors;
+    header.destination = destination;
+    header.slot_size = journal_slot_size(JOURNAL_STOPS(num_floors));
+    header.num_backlog = destination ? num_backlog : 0;
+    header.speed = speed;
+    header.stopped = stopped;
+
+    fd = detachHW(unread, &len, &header.binary, &header.text);
+    header.unread = len;
+
+    /* The socket to the hardware rides along with the header */
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(handoff_fd, &msg, 0) != sizeof(header) ||
+            write_all(handoff_fd, unread, len) ||
+            write_all(handoff_fd, slots, slots_size) ||
+            write_all(handoff_fd, (char*) values, num_values*sizeof(int32_t))) {
+        free(slots);
+        free(values);
+        return -1;
+    }
+
+    log_msg(LOG_INFO, LOG_HANDOFF_SENT, len, (monotonic_ns() - stopped)/1e6);
+
+    free(slots);
+    free(values);
+    close(handoff_fd);
+    close(fd);
+
+    return 0;
+}
+
+int handoff_receive(const char *path)
+{
+    int conn, fd = -1, count;
+    char line[64];
+    char unread[HW_BUFFER_SIZE];
+    char *slots = NULL;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct sockaddr_un addr;
+    struct timeval timeout = { HANDOFF_TIMEOUT/1000, HANDOFF_TIMEOUT%1000*1000 };
+    struct handoff_header header;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+
+    if (!journal_enabled() || strlen(path) >= sizeof(addr.sun_path))
+        return 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((conn = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return 1;
+
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    count = snprintf(line, sizeof(line), "handoff %d %d\n", num_elevators, num_floors);
+
+    if (connect(conn, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+            write_all(conn, line, count))
+        goto fail;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&header, 0, sizeof(header));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if ((count = recvmsg(conn, &msg, 0)) <= 0)
+        goto fail;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    /* Refused, the reply is a line of text */
+    if (fd < 0 || header.magic != HANDOFF_MAGIC) {
+        ((char*) &header)[count < (int) sizeof(header) ? count : (int) sizeof(header)-1] = '\0';
+        fprintf(stderr, "Handoff refused: %s", (char*) &header);
+        goto fail;
+    }
+
+    if (read_all(conn, (char*) &header + count, sizeof(header) - count) ||
+            header.version != HANDOFF_VERSION || header.num_cabins != num_elevators ||
+            header.num_floors != num_floors || header.unread < 0 ||
+            header.unread > HW_BUFFER_SIZE ||
+            header.slot_size != journal_slot_size(JOURNAL_STOPS(num_floors)))
+        goto fail;
+
+    if ((slots = malloc(num_elevators*header.slot_size)) == NULL ||
+            read_all(conn, unread, header.unread) ||
+            read_all(conn, slots, num_elevators*header.slot_size))
+        goto fail;
+
+    if (header.destination && load_passengers(conn, header.num_backlog))
+        goto fail;
+
+    reattachHW(fd, header.binary, header.text, unread, header.unread);
+    binary = header.binary;
+    destination = header.destination;
+    speed = header.speed;
+    stopped = header.stopped;
+
+    journal_load(slots);
+
+    log_msg(LOG_INFO, LOG_HANDOFF_TAKEN, header.pid, header.unread,
+            (monotonic_ns() - stopped)/1e6);
+
+    free(slots);
+    close(conn);
+
+    return 0;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+    free(slots);
+    close(conn);
+
+    return 1;
+}
+
+double handoff_pause()
+{
+    return (monotonic_ns() - stopped)/1e6;
+}
@@ -9,12 +9,15 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
 #include <stdio.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 //
 extern int errno;
 
@@ -37,11 +40,26 @@ static char inbuf[STRSIZE];	// for conversions;
 //   prepending 'select()' in front of "fgets()".
 // . you don't want to call 'read' character-wise. Well, this forces 
 //   you to have some buffereing anyhow ;-)
-#define IOBUFSIZE	4096
+#define IOBUFSIZE	HW_BUFFER_SIZE
 static char buf[IOBUFSIZE];
 static char *wPtr;		// first free character;
 static int freeSpace;		// (for convenience;)
 
+//
+// Binary framing (see 'negotiateBinaryHW()'). Text lines received
+// before the simulator switched stay in front of the buffer, 'textLeft'
+// is the number of such characters still to be parsed;
+static int binary = 0;
+static int textLeft = 0;
+
+//
+// Connection attempts are retried while the simulator is not yet
+// listening, starting at CONNECT_BACKOFF_MIN and doubling up to
+// CONNECT_BACKOFF_MAX (ms), for at most CONNECT_TIMEOUT (ms) in total.
+#define CONNECT_BACKOFF_MIN	10
+#define CONNECT_BACKOFF_MAX	500
+#define CONNECT_TIMEOUT		30000
+
 // Define that for assertions:
 // #define DEBUG_CHECK
 #if defined(DEBUG_CHECK)
@@ -62,13 +80,8 @@ void initHW(char *hostname, int port)
 {
   struct sockaddr_in s;
   struct hostent *q;
-
-  hwd = socket(PF_INET, SOCK_STREAM, 0);
-  if (hwd < 0) {
-    fprintf(stderr, "socket: %s\n", strerror(errno));
-    fflush(stderr);
-    exit(-1);
-  }
+  struct timespec delay;
+  int backoff = CONNECT_BACKOFF_MIN, waited = 0;
 
   //
   memset((char *) &s, 0, sizeof(s));
@@ -84,15 +97,352 @@ void initHW(char *hostname, int port)
   s.sin_port = htons(port);
 
   //
-  if (connect(hwd, (struct sockaddr *) &s, sizeof(s)) < 0) {
-    fprintf(stderr, "connect: %s\n", strerror(errno));
-    fflush(stderr);
-    exit(-1);
+  while (1) {
+    hwd = socket(PF_INET, SOCK_STREAM, 0);
+    if (hwd < 0) {
+      fprintf(stderr, "socket: %s\n", strerror(errno));
+      fflush(stderr);
+      exit(-1);
+    }
+
+    if (connect(hwd, (struct sockaddr *) &s, sizeof(s)) == 0)
+      break;
+
+    // Simulator not (yet) listening: try again with a fresh socket;
+    if ((errno != ECONNREFUSED && errno != ETIMEDOUT && errno != EAGAIN)
+	|| waited >= CONNECT_TIMEOUT) {
+      fprintf(stderr, "connect: %s\n", strerror(errno));
+      fflush(stderr);
+      exit(-1);
+    }
+    close(hwd);
+
+    delay.tv_sec = backoff/1000;
+    delay.tv_nsec = (backoff%1000)*1000000L;
+    nanosleep(&delay, NULL);
+    waited += backoff;
+    backoff = (2*backoff < CONNECT_BACKOFF_MAX) ? 2*backoff : CONNECT_BACKOFF_MAX;
   }
 
   //
   wPtr = buf;
   freeSpace = IOBUFSIZE;
+  binary = textLeft = 0;
+}
+
+//
+void attachHW(int fd, int useBinary)
+{
+  hwd = fd;
+  wPtr = buf;
+  freeSpace = IOBUFSIZE;
+  binary = useBinary;
+  textLeft = 0;
+}
+
+//
+int detachHW(char *unread, int *len, int *useBinary, int *text)
+{
+  int fd = hwd;
+
+  *len = wPtr-buf;
+  memcpy(unread, buf, *len);
+  *useBinary = binary;
+  *text = textLeft;
+
+  hwd = 0;
+  wPtr = buf;
+  freeSpace = IOBUFSIZE;
+  return (fd);
+}
+
+//
+void reattachHW(int fd, int useBinary, int text, const char *unread, int len)
+{
+  attachHW(fd, useBinary);
+  if (len > IOBUFSIZE)
+    len = IOBUFSIZE;
+  memcpy(buf, unread, len);
+  wPtr += len;
+  freeSpace -= len;
+  textLeft = text;
+}
+
+//
+// Reads whatever is available into the buffer, blocking until there
+// is something. With a 'timeout' (ms, -1 for none) returns 0 if
+// nothing arrived in time, otherwise the number of characters read.
+static int fillBuffer(char *who, int timeout)
+{
+  fd_set readFds, exFds;
+  struct timeval tv, *tvp = (struct timeval *) 0;
+  int selOut, count;
+
+  if (timeout >= 0) {
+    tv.tv_sec = timeout/1000;
+    tv.tv_usec = (timeout%1000)*1000;
+    tvp = &tv;
+  }
+
+ r_loop:
+  FD_ZERO(&readFds);
+  FD_ZERO(&exFds);
+  FD_SET(hwd, &readFds);
+
+  //
+  if ((selOut = select(hwd+1, &readFds, (fd_set *) 0, &exFds, tvp)) < 0) {
+    if (errno == EINTR)
+      goto r_loop;
+    fprintf(stderr, "%s: select: %s\n", who, strerror (errno));
+    fprintf(stderr, "%s: hardware simulator has been stopped\n", who);
+    fflush(stderr);
+    exit(-1);
+  }
+  if (selOut == 0)
+    return (0);
+
+  //
+  if ((count = read(hwd, wPtr, freeSpace)) <= 0) {
+    fprintf(stderr, "%s: read returned %d (errno: %s)\n",
+	    who, count, strerror(errno));
+    fprintf(stderr, "%s: hardware simulator has been stopped\n", who);
+    fflush(stderr);
+    exit(-1);
+  }
+  freeSpace -= count;
+  wPtr += count;
+  Assert(freeSpace >= 0);
+  return (count);
+}
+
+//
+// Drops the first 'count' characters of the buffer;
+static void consume(int count)
+{
+  memmove(buf, buf+count, wPtr-buf-count);
+  wPtr -= count;
+  freeSpace += count;
+}
+
+//
+// Sends 'request' and waits at most 'timeout' ms for the same line to
+// come back, removing it from the buffer. Returns the number of
+// characters of text lines in front of it, or -1 if it never came;
+static int negotiate(char *who, char *request, int timeout)
+{
+  struct timespec start, now;
+  char *line = buf, *end;
+  int left = timeout, len;
+
+  if (hwd == (int) 0) {
+    fprintf(stderr, "%s: have to call 'init()' first!\n", who);
+    fflush(stderr);
+    exit(-1);
+  }
+  len = strlen(request);
+  if (write(hwd, request, len) < len) {
+    fprintf(stderr, "%s: write failed: %s\n", who, strerror(errno));
+    fprintf(stderr, "%s: hardware simulator has been stopped\n", who);
+    fflush(stderr);
+    exit(-1);
+  }
+
+  //
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (1) {
+    // Look for the answer among the complete lines received so far;
+    while ((end = memchr(line, '\n', wPtr-line)) != NULL) {
+      if (end-line+1 == len && !memcmp(line, request, len)) {
+	memmove(line, end+1, wPtr-end-1);
+	wPtr -= len;
+	freeSpace += len;
+	return (line-buf);
+      }
+      line = end+1;
+    }
+
+    if (left <= 0 || freeSpace == 0 || !fillBuffer(who, left))
+      return (-1);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left = timeout - ((now.tv_sec-start.tv_sec)*1000 +
+		      (now.tv_nsec-start.tv_nsec)/1000000);
+  }
+}
+
+//
+int negotiateBinaryHW(int timeout)
+{
+  int text = negotiate("negotiateBinaryHW", HW_BINARY_REQUEST, timeout);
+
+  if (text < 0)
+    return (0);
+
+  // Keep the text lines in front of the answer, frames follow it;
+  textLeft = text;
+  binary = 1;
+  return (1);
+}
+
+//
+int negotiateDestinationHW(int timeout)
+{
+  return (negotiate("negotiateDestinationHW", HW_DESTINATION_REQUEST,
+		    timeout) >= 0);
+}
+
+//
+// Positions are handed out in units of 1/HW_POSITION_SCALE floor. A
+// position as printed by the simulator, e.g. "3.9999999999999991" or
+// "6.9388939039072284e-18", is parsed straight into them and rounded
+// to the nearest, without going through floating point. Digits beyond
+// the 15th significant one are ignored. Returns the number of
+// characters parsed, 0 if there is no number or it is too large;
+#define POSITION_DIGITS_MAX	100000000000000LL
+static int parsePosition(const char *str, int *position)
+{
+  const char *ptr = str;
+  long long mantissa = 0, power = 1;
+  int exponent = 0, shift = 0, shiftSign = 1, digits = 0, negative = 0;
+
+  if (*ptr == '-' || *ptr == '+')
+    negative = (*ptr++ == '-');
+
+  for (; *ptr >= '0' && *ptr <= '9'; ptr++, digits++)
+    if (mantissa < POSITION_DIGITS_MAX)
+      mantissa = mantissa*10 + (*ptr-'0');
+    else
+      exponent++;
+
+  if (*ptr == '.')
+    for (ptr++; *ptr >= '0' && *ptr <= '9'; ptr++, digits++)
+      if (mantissa < POSITION_DIGITS_MAX) {
+	mantissa = mantissa*10 + (*ptr-'0');
+	exponent--;
+      }
+
+  if (!digits)
+    return (0);
+
+  // Optional exponent, only taken if followed by digits;
+  if ((*ptr == 'e' || *ptr == 'E') &&
+      ((ptr[1] >= '0' && ptr[1] <= '9') ||
+       ((ptr[1] == '-' || ptr[1] == '+') && ptr[2] >= '0' && ptr[2] <= '9'))) {
+    ptr++;
+    if (*ptr == '-' || *ptr == '+')
+      shiftSign = (*ptr++ == '-') ? -1 : 1;
+    for (; *ptr >= '0' && *ptr <= '9'; ptr++)
+      if (shift < 1000)
+	shift = shift*10 + (*ptr-'0');
+    exponent += shiftSign*shift;
+  }
+
+  // mantissa*10^exponent floors, in units of 1/HW_POSITION_SCALE;
+  mantissa *= HW_POSITION_SCALE;
+  if (exponent >= 0) {
+    for (; exponent > 0 && mantissa <= INT_MAX; exponent--)
+      mantissa *= 10;
+  } else if (exponent < -18) {
+    mantissa = 0;
+  } else {
+    for (; exponent < 0; exponent++)
+      power *= 10;
+    mantissa = (mantissa + power/2) / power;
+  }
+
+  if (mantissa > INT_MAX)
+    return (0);
+
+  *position = negative ? (int) -mantissa : (int) mantissa;
+  return (ptr-str);
+}
+
+//
+// Frames carry positions in units of 1/HW_FRAME_SCALE floor;
+static int frameToPosition(int value)
+{
+  long long scaled = (long long) value * HW_POSITION_SCALE;
+  long long half = HW_FRAME_SCALE/2;
+
+  return ((int) ((scaled + (scaled < 0 ? -half : half)) / HW_FRAME_SCALE));
+}
+
+//
+// Whether a whole event is buffered, a frame or a text line;
+static int haveEvent()
+{
+  if (!binary)
+    return (memchr(buf, '\n', wPtr-buf) != NULL);
+  if (textLeft)
+    return (memchr(buf, '\n', textLeft) != NULL);
+  return (wPtr-buf >= (int) sizeof(HWFrame));
+}
+
+//
+int pollHW(int timeout)
+{
+  struct timespec start, now;
+  int left = timeout;
+
+  if (hwd == (int) 0) {
+    fprintf(stderr, "pollHW: have to call 'init()' first!\n");
+    fflush(stderr);
+    exit(-1);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (!haveEvent()) {
+    if (left <= 0 || freeSpace == 0 || !fillBuffer("pollHW", left))
+      return (0);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left = timeout - ((now.tv_sec-start.tv_sec)*1000 +
+		      (now.tv_nsec-start.tv_nsec)/1000000);
+  }
+  return (1);
+}
+
+//
+// Binary counterpart of the text parsing in 'waitForEvent()';
+static EventType waitForFrame(EventDesc *event)
+{
+  HWFrame frame;
+  static char unknown[STRSIZE];
+
+  while (wPtr-buf < (int) sizeof(frame))
+    fillBuffer("waitForEvent", -1);
+
+  memcpy(&frame, buf, sizeof(frame));
+  consume(sizeof(frame));
+  frame.cabin = ntohs(frame.cabin);
+  frame.value = ntohl(frame.value);
+
+  switch (frame.type) {
+  case 'b':
+    event->fbp.floor = frame.cabin;
+    event->fbp.type = (FloorButtonType) frame.value;
+    return (FloorButton);
+  case 'p':
+    event->cbp.cabin = frame.cabin;
+    event->cbp.floor = frame.value;
+    return (CabinButton);
+  case 'f':
+    event->cp.cabin = frame.cabin;
+    event->cp.position = frameToPosition(frame.value);
+    return (Position);
+  case 'v':
+    event->s.speed = (double) frame.value / HW_FRAME_SCALE;
+    return (Speed);
+  case 'g':
+    event->dp.floor = frame.cabin;
+    event->dp.destination = frame.value;
+    return (Destination);
+  default:
+    snprintf(unknown, STRSIZE, "frame %d %d %d", frame.type, frame.cabin,
+	     frame.value);
+    event->e.str = unknown;
+    return (Error);
+  }
 }
 
 //
@@ -102,9 +452,7 @@ EventType waitForEvent(EventDesc *event)
   int found = 0;		// there is a '\n' character;
   char *ptr = buf;		// .. the first character after it;
   char *copySrc = buf, *copyDst = inbuf;
-  fd_set readFds, writeFds, exFds;
-  int selOut, count;
-  int matches;
+  int matches, offset = 0;
 
   //
   if (hwd == (int) 0) {
@@ -113,6 +461,10 @@ EventType waitForEvent(EventDesc *event)
     exit(-1);
   }
 
+  //
+  if (binary && textLeft == 0)
+    return (waitForFrame(event));
+
   //
   while (1) {
     // Examine the buffer: if it (still or now) has a complete line,
@@ -133,34 +485,8 @@ EventType waitForEvent(EventDesc *event)
       break;
     } else {
       Assert(ptr == wPtr);
-      //
-    r_loop:
-      FD_ZERO(&readFds);
-      FD_ZERO(&exFds);
-      FD_SET(hwd, &readFds);
-
-      //
-      if ((selOut = select(hwd+1, &readFds, (fd_set *) 0, &exFds,
-			   (struct timeval *) 0)) < 0) {
-	if (errno == EINTR)
-	  goto r_loop;
-	fprintf(stderr, "waitForEvent: select: %s\n", strerror (errno));
-	fprintf(stderr, "waitForEvent: hardware simulator has been stopped\n");
-	fflush(stderr);
-	exit(-1);
-      }
-
-      //
-      if ((count = read(hwd, wPtr, freeSpace)) <= 0) {
-	fprintf(stderr, "waitForEvent: read returned %d (errno: %s)\n",
-		count, strerror(errno));
-	fprintf(stderr, "waitForEvent: hardware simulator has been stopped\n");
-	fflush(stderr);
-	exit(-1);
-      }
-      freeSpace -= count;
-      wPtr += count;
-      Assert(freeSpace >= 0);
+      Assert(!textLeft);
+      fillBuffer("waitForEvent", -1);
     }
   }
 
@@ -171,6 +497,8 @@ EventType waitForEvent(EventDesc *event)
     *copyDst++ = *copySrc++;
   *copyDst = (char) 0;
   freeSpace += ptr-buf;
+  if (textLeft)
+    textLeft -= ptr-buf;
   DebugCode(fprintf(stdout, "str=\"%s\"\n", inbuf););
   DebugCode(fflush(stdout););
 
@@ -205,9 +533,8 @@ EventType waitForEvent(EventDesc *event)
     break;
 
   case 'f':
-    matches = sscanf(inbuf, "f %d %lf",
-		     &(event->cp.cabin), &(event->cp.position));
-    if (matches != 2) {
+    matches = sscanf(inbuf, "f %d %n", &(event->cp.cabin), &offset);
+    if (matches != 1 || !parsePosition(inbuf+offset, &(event->cp.position))) {
       event->e.str = inbuf;
       return (Error);
     } else {
@@ -225,12 +552,41 @@ EventType waitForEvent(EventDesc *event)
     }
     break;
 
+  case 'g':
+    matches = sscanf(inbuf, "g %d %d",
+		     &(event->dp.floor), &(event->dp.destination));
+    if (matches != 2) {
+      event->e.str = inbuf;
+      return (Error);
+    } else {
+      return (Destination);
+    }
+    break;
+
   default:
     event->e.str = inbuf;
     return (Error);
   }
 }
 
+//
+// Frame counterpart of the text commands below;
+static void sendFrame(char *who, char type, int cabin, int value)
+{
+  HWFrame frame;
+
+  frame.type = type;
+  frame.reserved = 0;
+  frame.cabin = htons(cabin);
+  frame.value = htonl(value);
+  if (write(hwd, &frame, sizeof(frame)) < (int) sizeof(frame)) {
+    fprintf(stderr, "%s: write failed: %s\n", who, strerror(errno));
+    fprintf(stderr, "%s: hardware simulator has been stopped\n", who);
+    fflush(stderr);
+    exit(-1);
+  }
+}
+
 //
 void handleDoor(int cabin, DoorAction action)
 {
@@ -240,6 +596,10 @@ void handleDoor(int cabin, DoorAction action)
     fflush(stderr);
     exit(-1);
   }
+  if (binary) {
+    sendFrame("handleDoor", 'd', cabin, (int) action);
+    return;
+  }
   cnt = sprintf(outbuf, "d %d %d\n", cabin, (int) action);
   if (write(hwd, outbuf, cnt) < cnt) {
     fprintf(stderr, "handleDoor: write failed: %s\n", strerror(errno));
@@ -257,6 +617,10 @@ void handleMotor(int cabin, MotorAction action)
     fflush(stderr);
     exit(-1);
   }
+  if (binary) {
+    sendFrame("handleMotor", 'm', cabin, (int) action);
+    return;
+  }
   cnt = sprintf(outbuf, "m %d %d\n", cabin, (int) action);
   if (write(hwd, outbuf, cnt) < cnt) {
     fprintf(stderr, "handleMotor: write failed: %s\n", strerror(errno));
@@ -274,6 +638,10 @@ void handleScale(int cabin, int floor)
     fflush(stderr);
     exit(-1);
   }
+  if (binary) {
+    sendFrame("handleScale", 's', cabin, floor);
+    return;
+  }
   cnt = sprintf(outbuf, "s %d %d\n", cabin, floor);
   if (write(hwd, outbuf, cnt) < cnt) {
     fprintf(stderr, "handleScale: write failed: %s\n", strerror(errno));
@@ -283,6 +651,28 @@ void handleScale(int cabin, int floor)
   }
 }
 
+void assignDestination(int cabin, int floor, int destination)
+{
+  int cnt;
+  if (hwd == (int) 0) {
+    fprintf(stderr, "assignDestination: have to call 'init()' first!\n");
+    fflush(stderr);
+    exit(-1);
+  }
+  if (binary) {
+    sendFrame("assignDestination", 'a', cabin,
+	      HW_DESTINATION(floor, destination));
+    return;
+  }
+  cnt = sprintf(outbuf, "a %d %d %d\n", cabin, floor, destination);
+  if (write(hwd, outbuf, cnt) < cnt) {
+    fprintf(stderr, "assignDestination: write failed: %s\n", strerror(errno));
+    fprintf(stderr, "assignDestination: hardware simulator has been stopped\n");
+    fflush(stderr);
+    exit(-1);
+  }
+}
+
 void whereIs(int cabin)
 {
   int cnt;
@@ -291,6 +681,10 @@ void whereIs(int cabin)
     fflush(stderr);
     exit(-1);
   }
+  if (binary) {
+    sendFrame("whereIs", 'w', cabin, 0);
+    return;
+  }
   cnt = sprintf(outbuf, "w %d\n", cabin);
   if (write(hwd, outbuf, cnt) < cnt) {
     fprintf(stderr, "whereIs: write failed: %s\n", strerror(errno));
@@ -308,6 +702,10 @@ void getSpeed()
     fflush(stderr);
     exit(-1);
   }
+  if (binary) {
+    sendFrame("getSpeed", 'v', 0, 0);
+    return;
+  }
   cnt = sprintf(outbuf, "v\n");
   if (write(hwd, outbuf, cnt) < cnt) {
     fprintf(stderr, "getSpeed: write failed: %s\n", strerror(errno));
@@ -325,6 +723,10 @@ void terminate()
     fflush(stderr);
     exit(-1);
   }
+  if (binary) {
+    sendFrame("terminate", 'q', 0, 0);
+    return;
+  }
   cnt = sprintf(outbuf, "q\n");
   if (write(hwd, outbuf, cnt) < cnt) {
     fprintf(stderr, "terminate: write failed: %s\n", strerror(errno));
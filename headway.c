@@ -0,0 +1,287 @@
+/*
+ * Headway control, see include/headway.h
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "hardwareAPI.h"
+#include "cabin.h"
+#include "controller.h"
+#include "eta.h"
+#include "group.h"
+#include "headway.h"
+#include "log.h"
+
+struct headway_counts {
+    uint64_t penalized;
+    uint64_t holds;
+    uint64_t held_ms;
+    uint64_t parks;
+};
+
+/* Per cabin, indexed by id and written by its elevator thread alone */
+static int *loop = NULL;                /* on the loop, -1 if idle */
+static int *shaft = NULL;               /* in the shaft */
+static struct headway_counts *counts = NULL;
+
+static int loop_length;
+static int headway_floors;
+static int headway_cabins;
+
+int headway_open(int num_floors, int num_cabins)
+{
+    int i;
+    int *positions;
+
+    /* Passengers were told which cabin to board */
+    if (destination || num_floors < 2)
+        return 0;
+
+    shaft = malloc((num_cabins+1)*sizeof(int));
+    counts = calloc(num_cabins+1, sizeof(struct headway_counts));
+    positions = malloc((num_cabins+1)*sizeof(int));
+
+    if (!shaft || !counts || !positions) {
+        free(shaft);
+        free(counts);
+        free(positions);
+        shaft = NULL;
+        counts = NULL;
+        return -1;
+    }
+
+    for (i = 0; i <= num_cabins; i++) {
+        positions[i] = -1;
+        shaft[i] = -1;
+    }
+
+    loop_length = 2*(num_floors-1)*HW_POSITION_SCALE;
+    headway_floors = num_floors;
+    headway_cabins = num_cabins;
+
+    __atomic_store_n(&loop, positions, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void headway_close()
+{
+    free(loop);
+    free(shaft);
+    free(counts);
+    loop = shaft = NULL;
+    counts = NULL;
+}
+
+int headway_enabled()
+{
+    return __atomic_load_n(&loop, __ATOMIC_ACQUIRE) != NULL;
+}
+
+void headway_update(int id, int position, int heading)
+{
+    int at = -1;
+
+    if (!headway_enabled())
+        return;
+
+    if (heading > 0)
+        at = position;
+    else if (heading < 0)
+        at = (loop_length - position) % loop_length;
+
+    __atomic_store_n(&shaft[id], position, __ATOMIC_RELAXED);
+    __atomic_store_n(&loop[id], at, __ATOMIC_RELAXED);
+}
+
+/*
+ * Floors along the loop from the closest cabin behind id and to the closest
+ * one ahead, -1 if none, of the cabins of its group on the loop. Returns their
+ * number, id included.
+ */
+static int gaps(int id, int *behind, int *ahead)
+{
+    int i, at, d, count = 1;
+    int group = group_of(id);
+    int x = __atomic_load_n(&loop[id], __ATOMIC_RELAXED);
+
+    *behind = *ahead = -1;
+
+    if (x < 0)
+        return 0;
+
+    for (i = 1; i <= headway_cabins; i++) {
+        if (i == id || group_of(i) != group)
+            continue;
+
+        if ((at = __atomic_load_n(&loop[i], __ATOMIC_RELAXED)) < 0)
+            continue;
+
+        count++;
+
+        d = (x - at + loop_length) % loop_length;
+        if (*behind < 0 || d < *behind)
+            *behind = d;
+
+        d = (at - x + loop_length) % loop_length;
+        if (*ahead < 0 || d < *ahead)
+            *ahead = d;
+    }
+
+    return count;
+}
+
+int headway_penalty(int id)
+{
+    int n, behind, ahead, deficit, per_floor, per_stop;
+
+    if (!headway_enabled())
+        return 0;
+
+    if ((n = gaps(id, &behind, &ahead)) < 2)
+        return 0;
+
+    if ((deficit = loop_length/n - behind) <= 0)
+        return 0;
+
+    score_weights(&per_floor, &per_stop);
+    __atomic_add_fetch(&counts[id].penalized, 1, __ATOMIC_RELAXED);
+
+    return (int64_t) deficit*per_floor*HEADWAY_WEIGHT/100/HW_POSITION_SCALE;
+}
+
+int headway_hold(int id)
+{
+    int n, behind, ahead, missing, ms;
+
+    if (!headway_enabled())
+        return 0;
+
+    if ((n = gaps(id, &behind, &ahead)) < 2)
+        return 0;
+
+    if ((missing = loop_length/n/2 - ahead) <= 0)
+        return 0;
+
+    ms = (int64_t) missing*eta_floor_ms()/HW_POSITION_SCALE;
+    if (ms > HEADWAY_HOLD_MAX)
+        ms = HEADWAY_HOLD_MAX;
+
+    __atomic_add_fetch(&counts[id].holds, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counts[id].held_ms, ms, __ATOMIC_RELAXED);
+
+    log_msg(LOG_INFO, LOG_HEADWAY_HOLD, id, ms, (double) ahead/HW_POSITION_SCALE,
+            (double) loop_length/n/HW_POSITION_SCALE);
+
+    return ms;
+}
+
+/* Distance to the cabin nearest position of the group, but id, -1 if none */
+static int nearest(int id, int group, int position)
+{
+    int i, at, d, best = -1;
+
+    for (i = 1; i <= headway_cabins; i++) {
+        if (i == id || group_of(i) != group)
+            continue;
+
+        if ((at = __atomic_load_n(&shaft[i], __ATOMIC_RELAXED)) < 0)
+            continue;
+
+        d = abs(at - position);
+        if (best < 0 || d < best)
+            best = d;
+    }
+
+    return best;
+}
+
+int headway_park(int id)
+{
+    int i, f, at, d, low = 0, high, close = 0, best, best_distance;
+    int group = group_of(id), position;
+    struct group_stats zone;
+
+    if (!headway_enabled() || !cabin_available(cabins[id]))
+        return -1;
+
+    if ((position = __atomic_load_n(&shaft[id], __ATOMIC_RELAXED)) < 0)
+        return -1;
+
+    /* Moved by the higher of two idle cabins close to each other */
+    for (i = 1; i <= headway_cabins; i++) {
+        if (i == id || group_of(i) != group ||
+                __atomic_load_n(&loop[i], __ATOMIC_RELAXED) >= 0)
+            continue;
+
+        at = __atomic_load_n(&shaft[i], __ATOMIC_RELAXED);
+        if (at < 0 || abs(at - position) > HEADWAY_PARK_NEAR*HW_POSITION_SCALE)
+            continue;
+
+        if (i > id)
+            return -1;
+        close = 1;
+    }
+
+    if (!close)
+        return -1;
+
+    high = headway_floors-1;
+    if (group_count()) {
+        group_stats(group, &zone);
+        low = zone.low;
+        high = zone.high;
+    }
+
+    /* The floor farthest from the other cabins, the nearest such one */
+    best = -1;
+    best_distance = -1;
+
+    for (f = low; f <= high; f++) {
+        d = nearest(id, group, FLOOR_POSITION(f));
+
+        if (d > best_distance || (d == best_distance &&
+                abs(FLOOR_POSITION(f) - position) < abs(FLOOR_POSITION(best) - position))) {
+            best = f;
+            best_distance = d;
+        }
+    }
+
+    /* Unless no farther than a floor from where it is */
+    if (best < 0 || best_distance <= nearest(id, group, position) + HW_POSITION_SCALE)
+        return -1;
+
+    __atomic_add_fetch(&counts[id].parks, 1, __ATOMIC_RELAXED);
+
+    log_msg(LOG_INFO, LOG_HEADWAY_PARK, id, best, (double) best_distance/HW_POSITION_SCALE);
+
+    return best;
+}
+
+void headway_stats(int id, struct headway_stats *stats)
+{
+    int ahead;
+
+    stats->position = -1;
+    stats->gap = -1;
+    stats->penalized = stats->holds = stats->held_ms = stats->parks = 0;
+
+    if (!headway_enabled())
+        return;
+
+    stats->position = __atomic_load_n(&loop[id], __ATOMIC_RELAXED);
+    gaps(id, &stats->gap, &ahead);
+
+    stats->penalized = __atomic_load_n(&counts[id].penalized, __ATOMIC_RELAXED);
+    stats->holds = __atomic_load_n(&counts[id].holds, __ATOMIC_RELAXED);
+    stats->held_ms = __atomic_load_n(&counts[id].held_ms, __ATOMIC_RELAXED);
+    stats->parks = __atomic_load_n(&counts[id].parks, __ATOMIC_RELAXED);
+}
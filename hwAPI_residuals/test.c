@@ -197,7 +197,7 @@ void *evProc(void *p)
     case Position:
       pthread_mutex_lock(&mutex);
       fprintf(stdout, "cabin position: cabin %d, position %f\n",
-	      ed.cp.cabin, ed.cp.position);
+	      ed.cp.cabin, (double) ed.cp.position / HW_POSITION_SCALE);
       fflush(stdout);
       pthread_mutex_unlock(&mutex);
       break;
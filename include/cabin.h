@@ -0,0 +1,210 @@
+/*
+ * Per-cabin context shared between the dispatcher and the elevator threads
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __CABIN_H
+#define __CABIN_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "hardwareAPI.h"
+
+/* Size of a cache line, contexts are aligned to this to avoid false sharing */
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+/* Structure for passing events between threads */
+struct event {
+    EventType type;
+    EventDesc desc;
+};
+
+/*
+ * Events buffered for an elevator, bounded so that a stalled elevator thread
+ * neither grows memory nor wakes up to a backlog of stale events:
+ *
+ *  Position, Door      conflated, only the latest is kept
+ *  buttons             merged with an identical button already queued
+ *  hall calls          steered to other cabins once the cabin is saturated,
+ *                      held back for the next cabin with room once only
+ *                      CABIN_QUEUE_RESERVE places are left
+ *  passengers          held back likewise, see dispatch_destination()
+ *  cabin calls         always queued, merged they are never more than
+ *                      num_floors, which are kept on top of CABIN_QUEUE_SIZE
+ *  service changes     merged with one already queued, the elevator reads
+ *                      the service state itself
+ *  service, resuming   always queued, there is never more than one of each,
+ *  and shutdown        CABIN_QUEUE_CONTROL places are kept for them on top
+ *                      of those for cabin calls
+ *  everything else     queued while CABIN_QUEUE_SIZE allows
+ */
+#ifndef CABIN_QUEUE_SIZE
+#define CABIN_QUEUE_SIZE 64
+#endif
+
+/* Queued events at which a cabin is saturated, until its elevator drains them */
+#define CABIN_QUEUE_SATURATED (CABIN_QUEUE_SIZE/2)
+
+#define CABIN_QUEUE_RESERVE 4
+
+/* Service, Resume and Shutdown */
+#define CABIN_QUEUE_CONTROL 3
+
+/*
+ * Stop queue structures
+ * TODO: Move to a separate file
+ */
+typedef struct node_stop_queue {
+    int floor;
+    int direction;                      /* of hall calls, 0 for cabin calls */
+    struct node_stop_queue* next;
+} node_stop_queue;
+
+/*
+ * Prefix costs of a stop queue, for scoring hall calls without walking it.
+ * The stops are kept from index head on, floors[k] is a stop and prefix[j] -
+ * prefix[k] the floors travelled from stop k to stop j. highest[k] is the
+ * highest stop reached going up on the legs up to stop k, lowest[k] the
+ * lowest reached going down, both only ever grow further along the plan.
+ */
+struct plan {
+    struct plan *retired;               /* outgrown, kept for readers */
+    int capacity;
+    int head;
+    int *floors;
+    int *prefix;
+    int *highest;
+    int *lowest;
+};
+
+typedef struct {
+    int size;
+    node_stop_queue* first;
+
+    /* Changed by the owning elevator thread only, odd while changing */
+    uint32_t seq;
+    struct plan *plan;
+} stop_queue;
+
+/* Position of the floor, positions are in 1/HW_POSITION_SCALE floor */
+#define FLOOR_POSITION(floor) ((floor)*HW_POSITION_SCALE)
+
+/* Floor nearest a position, halfway rounded away from the ground floor */
+static inline int position_floor(int position)
+{
+    return (position + (position < 0 ? -HW_POSITION_SCALE : HW_POSITION_SCALE)/2) /
+           HW_POSITION_SCALE;
+}
+
+/* Structure for saving a partial state of an elevator */
+typedef struct
+{
+    int position;
+    stop_queue *queue;
+    int direction;                      /* of the motor, published for scoring */
+} elevator_information;
+
+/* Structure for interpret door openings */
+struct door_state_counter {
+    int position;
+    short repetitions;
+    int state;
+    int commanded;                      /* last door action, by the elevator */
+};
+
+/*
+ * Everything the dispatcher and a single elevator thread share.
+ *
+ * Previously kept in parallel arrays indexed by cabin, which packed the
+ * mutex and position of neighbouring cabins into the same cache lines. Each
+ * context now starts on a cache line of its own.
+ */
+struct cabin {
+    pthread_mutex_t event_buffer_mutex;
+    pthread_cond_t signal;
+
+    /* Elevator-independent buffer of events to be processed, see above */
+    struct event *events;
+    int size_events;                    /* CABIN_QUEUE_SIZE + num_floors +
+                                           CABIN_QUEUE_CONTROL */
+    int head;
+    int num_events;
+
+    /* Latest position and door state not yet processed */
+    struct event position;
+    struct event door_state;
+    short position_pending;
+    short door_state_pending;
+
+    /* Raised by enqueue_event() once saturated, lowered once drained */
+    int saturated;
+
+    /* Cleared to stop assigning hall calls to the cabin */
+    int in_service;
+
+    /* Set by the dispatcher on an emergency stop, until the next cabin call */
+    int emergency;
+    int emergency_stops;                /* so far, for the elevator to notice */
+
+    /* Hall calls claimed by other cabins so far, for the elevator to drop */
+    int calls_stolen;
+
+    elevator_information info;
+    struct door_state_counter door;
+
+    /*
+     * Destination dispatch, passengers to board or leave per floor. Raised
+     * by the dispatcher on assignment and lowered by the elevator thread as
+     * the floors are served.
+     */
+    int *planned;
+    int load;                           /* passengers assigned, not delivered */
+
+    /* Owned by the elevator thread, assigned passengers not yet boarded */
+    DestinationPressDesc *waiting;
+    int num_waiting;
+    int size_waiting;
+
+    /* Owned by the elevator thread, boarded passengers per destination */
+    int *riding;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Hall calls go to cabins in service and not saturated, if there are any */
+static inline int cabin_available(struct cabin *cabin)
+{
+    return __atomic_load_n(&cabin->in_service, __ATOMIC_RELAXED) &&
+           !__atomic_load_n(&cabin->saturated, __ATOMIC_RELAXED);
+}
+
+/* CPU placement of the dispatcher and elevator threads, -1 if not pinned */
+struct affinity {
+    int dispatcher_cpu;
+    int num_cabin_cpus;
+    int *cabin_cpus;
+};
+
+/*
+ * Allocate and initialize the context of a cabin.
+ *
+ * The memory is touched by the calling thread, so when called from an already
+ * pinned elevator thread the kernels first-touch policy places it on the NUMA
+ * node of that thread's CPU.
+ */
+struct cabin *new_cabin(int num_floors);
+void destroy_cabin(struct cabin *cabin);
+
+/* CPU to run elevator id on according to affinity, -1 if not pinned */
+int cabin_cpu(struct affinity *affinity, int id);
+
+/* Parse a list like "0,2-5" into a newly allocated array, returns its length */
+int parse_cpu_list(const char *list, int **cpus);
+
+/* Pin the calling thread to cpu, returns 0 on success */
+int pin_thread(int cpu);
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Local control socket
+ *
+ * A unix domain stream socket accepting one command per line, every reply
+ * ends with a line being either "ok" or "error <reason>".
+ *
+ *  weights <distance> <stops>  set the score function weights, of the
+ *                              distance model, integers >= 0
+ *  service <cabin> <on|off>    put a cabin in or out of service, out of
+ *                              service cabins hand over their hall calls
+ *                              and finish their cabin calls
+ *  level <0-2>                 set log level (error, info, debug)
+ *  dump                        print the state of every cabin
+ *  trace                       log a snapshot of every cabin
+ *  output                      print queueing delays of the hardware output
+ *                              and the number of suppressed commands
+ *  resync [cabin]              send the commanded state of a cabin, or all
+ *                              cabins, to the hardware again
+ *  dwell [<min> <max> <per passenger>]
+ *                              print or set the door dwell, in ms, see
+ *                              include/dwell.h
+ *  eta                         print the calibrated time of arrival model,
+ *                              see include/eta.h
+ *  overload                    print the events conflated, merged and not
+ *                              queued by every cabin, the times it was
+ *                              saturated and the hall calls and passengers
+ *                              held back
+ *  steals                      print the hall calls every cabin claimed from
+ *                              other cabins and lost to them
+ *  headway                     print where every cabin is on the loop, the
+ *                              gap behind it and its penalties, holds and
+ *                              parks, see include/headway.h
+ *  traffic                     print the traffic pattern classified, the mode
+ *                              it runs, the time spent in every mode and the
+ *                              sector of every cabin, see include/traffic.h
+ *  journal                     print what was replayed from the checkpoint
+ *                              journal and the checkpoints written, see
+ *                              include/journal.h
+ *  handoff <cabins> <floors>   stop and hand the hardware connection and the
+ *                              plan of every cabin over to the controller
+ *                              asking, answered by struct handoff_header
+ *                              instead of "ok", see include/handoff.h
+ *  rt                          print the real-time scheduling mode and the
+ *                              histogram of late wake-ups, see include/rt.h
+ *  groups                      print the zone of every group and the hall
+ *                              calls it bid for and was assigned
+ *  pipeline                    print the events taken by every stage of the
+ *                              pipelined dispatcher and waiting for it
+ *  help                        list commands
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __CONTROL_H
+#define __CONTROL_H
+
+/* Longest accepted command line */
+#define CONTROL_LINE_SIZE 256
+
+/* Bind the socket and start serving it, returns 0 on success */
+int control_open(const char *path);
+
+/* Remove the socket */
+void control_close();
+
+#endif
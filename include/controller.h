@@ -0,0 +1,131 @@
+/*
+ * Controller internals shared with the rest of the controller
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __CONTROLLER_H
+#define __CONTROLLER_H
+
+#include "hardwareAPI.h"
+#include "cabin.h"
+
+/* Hall call scores, ms until served or floors and stops weighted, --score */
+enum score_model {
+    SCORE_ETA,
+    SCORE_DISTANCE
+};
+
+/* Weights for elevator score function, of the distance model */
+#ifndef SCORE_WEIGHT_DISTANCE
+#define SCORE_WEIGHT_DISTANCE 1
+#endif
+#ifndef SCORE_WEIGHT_STOPS
+#define SCORE_WEIGHT_STOPS 3
+#endif
+
+/* Passengers assigned to a cabin at most, the rest wait for room */
+#ifndef DESTINATION_CAPACITY
+#define DESTINATION_CAPACITY 8
+#endif
+
+/* Floor of the cabin button event sent by the emergency stop button */
+#define EMERGENCY_STOP 32000
+
+/* Worker functions */
+void *dispatcher(void *arg);
+void *elevator(void *arg);
+
+/* Helper functions */
+void sync_hardware();
+void dispatch_event(struct event *event);
+int route_event(struct event *event);
+int enqueue_event(int elevator, struct event *event);
+int dequeue_event(struct cabin *cabin, struct event *event);
+void dispatch_floor_button(struct event *event);
+void emergency_stop(int id);
+void hand_over_hall_calls(int id);
+int distance_to_floor(FloorButtonPressDesc *floor_button, elevator_information* info);
+int hall_call_score(FloorButtonPressDesc *floor_button, int id);
+void score_weights(int *per_floor, int *per_stop);
+void score_bound(int *per_floor, int *per_stop);
+int get_suitable_elevator(FloorButtonPressDesc *floor_button);
+int get_group_elevator(FloorButtonPressDesc *floor_button, int first, int last, int *score);
+
+/* Destination dispatch */
+int assign_destination(int e, struct event *event);
+void dispatch_destination(struct event *event);
+void hold_hall_call(FloorButtonPressDesc *call);
+void dispatch_backlog();
+int destination_score(DestinationPressDesc *call, struct cabin *cabin);
+int get_destination_elevator(DestinationPressDesc *call);
+void add_passenger(int id, DestinationPressDesc *call);
+int board_passengers(int id, int floor);
+void hand_over_passengers(int id, FloorButtonPressDesc *hall_call);
+void printq(int id, stop_queue *q);
+
+/* Thread safe wrapper for elevator control functions */
+void handle_door(int cabin, DoorAction action);
+void handle_motor(int cabin, MotorAction action);
+void handle_scale(int cabin, int floor);
+
+/*
+ * Stop queue API
+ * TODO: Move to a separate file
+ */
+stop_queue* new_stop_queue();
+int destroy_stop_queue(stop_queue*);
+
+int push_stop_queue(int floor, int direction, int position, elevator_information* info);
+int pop_stop_queue(stop_queue* q);
+int peek_stop_queue(stop_queue* q);
+int remove_hall_calls_stop_queue(stop_queue* q, FloorButtonPressDesc *calls);
+int remove_stop_queue(stop_queue* q, int floor, int direction);
+int contains_stop_queue(stop_queue* q, int floor);
+
+int size_stop_queue(stop_queue* q);
+
+/* Prefix costs of the stops, kept along with the queue */
+int reserve_plan(stop_queue *q, int size);
+void insert_plan(stop_queue *q, int index, int floor);
+void pop_plan(stop_queue *q);
+void rebuild_plan(stop_queue *q);
+
+/* Elevator information global variables */
+extern short running;
+extern short num_elevators;
+extern short num_floors;
+
+/* Hall calls carry the destination, set if the hardware supports it */
+extern short destination;
+
+/* Binary framing, set if the hardware supports it */
+extern short binary;
+
+extern struct cabin **cabins;
+
+/* CPU placement of threads */
+extern struct affinity affinity;
+
+/* Groups of cabins dispatching their own zone, 1 for a single dispatcher */
+extern int num_groups;
+
+/* Threads scoring hall calls in the pipeline, 0 for the serial dispatcher */
+extern int num_workers;
+
+/* Destination calls waiting for a cabin with room, only touched by the
+   thread dispatching events */
+extern DestinationPressDesc *backlog;
+extern int num_backlog;
+extern int num_held_calls;
+
+/* Speed of the cabins as reported by the hardware, floors per second */
+extern double speed;
+
+/* Score function weights, changed at runtime through the control socket */
+extern int score_model;
+extern int score_weight_distance;
+extern int score_weight_stops;
+
+#endif
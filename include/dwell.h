@@ -0,0 +1,66 @@
+/*
+ * Door dwell
+ *
+ * How long the doors of a cabin are held open at a stop, decided when they
+ * have opened from the demand at the stop:
+ *
+ *  demand      passengers known to board or leave, in destination dispatch,
+ *              or else the hall and cabin calls served by the stop
+ *  expected    passengers boarding per stop at the floor, learned for each
+ *              hour of the day from the cabin buttons pressed, or the
+ *              passengers boarded, while the doors are open
+ *
+ * The doors are held open for the minimum plus the time per passenger for
+ * the larger of the two, so they close early when no one is waiting and stay
+ * open longer where many board. No more than the maximum, and no more than
+ * halfway between minimum and maximum while most of the fleet is busy, as
+ * passengers waiting elsewhere then wait for the cabin too.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __DWELL_H
+#define __DWELL_H
+
+/* Defaults, changed at runtime through the control socket, ms */
+#ifndef DWELL_MIN
+#define DWELL_MIN 1000
+#endif
+#ifndef DWELL_MAX
+#define DWELL_MAX 6000
+#endif
+#ifndef DWELL_PER_PASSENGER
+#define DWELL_PER_PASSENGER 1000
+#endif
+
+/* Periods of the day learned apart */
+#define DWELL_SLOTS 24
+
+/* Weight of a stop in the learned boarding rate, 1/DWELL_LEARN_RATE */
+#define DWELL_LEARN_RATE 8
+
+/* Share of cabins with stops, in percent, at which the fleet is busy */
+#define DWELL_BUSY_SHARE 75
+
+struct dwell_config {
+    int min;
+    int max;
+    int per_passenger;
+};
+
+/* Allocate the learned rates, 0 on success */
+int dwell_open(int num_floors);
+void dwell_close();
+
+/* Dwell of cabin id at floor in ms, logged with what it was decided from */
+int dwell_time(int id, int floor, int demand);
+
+/* Count the passengers boarded at floor while the doors were open */
+void dwell_learn(int floor, int boarded);
+
+/* Current configuration, and replace it, 0 on success */
+void dwell_get(struct dwell_config *config);
+int dwell_set(struct dwell_config *config);
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Calibrated time of arrival
+ *
+ * Hall calls are scored by the time in ms a cabin needs to serve them,
+ * rather than by floors and stops weighted by hand:
+ *
+ *  legs        a run of d floors from rest to rest takes d/v + v/a when long
+ *              enough to reach the speed v, 2*sqrt(d/a) otherwise, looked up
+ *              in a table by floors. The first leg starts from the actual
+ *              position of the cabin, saving half the acceleration if it is
+ *              already moving that way. The legs between planned stops are
+ *              taken as d/v + v/a, which is exact for all but the shortest.
+ *  stops       the doors opening, the dwell and the doors closing
+ *
+ * Every parameter is calibrated while running. Each elevator times its runs
+ * from the motor start until the position reports bring it to the stop, v
+ * and v/a are fitted to the runs by least squares of their durations on
+ * their lengths, with older runs weighing less. Door times are measured
+ * from the command until the door state is reported, the dwell is the
+ * average decided. Until enough runs are seen, the speed is the average of
+ * the runs or, before any, the speed reported by the hardware.
+ *
+ * No score is below per floor ms times the floors to the call, nor below
+ * the door cycle plus per floor ms times the floors to the first stop if it
+ * is passed, as the spatial index requires, see eta_bound().
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __ETA_H
+#define __ETA_H
+
+#include <stdint.h>
+
+/* Defaults until calibrated */
+#define ETA_SPEED 1.0           /* floors per second */
+#define ETA_DOOR 1000           /* ms to open or close */
+
+/* Weight of a new run or door time, 1/ETA_LEARN_RATE */
+#define ETA_LEARN_RATE 16
+
+/* Runs seen before they are fitted, rather than averaged */
+#define ETA_MIN_RUNS 8
+
+struct eta_model {
+    double speed;               /* floors per second */
+    int floor_ms;               /* per floor at speed */
+    int accel_ms;               /* added by a run from rest to rest, v/a */
+    int door_open_ms;
+    int door_close_ms;
+    int dwell_ms;
+    uint64_t runs;              /* timed */
+    int fitted;                 /* speed and acceleration fitted to the runs */
+};
+
+/* Allocate the travel table, 0 on success */
+int eta_open(int num_floors);
+void eta_close();
+
+/*
+ * Calibration
+ */
+/* Speed reported by the hardware, used until a run is timed */
+void eta_speed(double speed);
+
+/* Run of distance, in 1/HW_POSITION_SCALE floor, from motor start to stop */
+void eta_run(int distance, int ms);
+
+/* Door opened, or closed if not opening, ms after the command */
+void eta_door(int opening, int ms);
+void eta_dwell(int ms);
+
+/*
+ * Estimates
+ */
+/* ms to travel distance, in 1/HW_POSITION_SCALE floor, from rest or 'moving'
+   that way, in integer arithmetic */
+int eta_travel(int distance, int moving);
+
+/* ms per floor at speed, and added by a run from rest to rest */
+int eta_floor_ms();
+int eta_accel_ms();
+
+/* ms at a stop, opening to closed doors */
+int eta_door_ms();
+
+/* Weights no score is below, per floor and per stop passed */
+void eta_bound(int *per_floor, int *per_stop);
+
+void eta_model(struct eta_model *model);
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Group control
+ *
+ * Tall buildings are split into zones, each served by a group of cabins with
+ * a dispatcher thread of its own. Group g owns the cabins and floors of its
+ * share of the building, neighbouring zones meet at a transfer floor and the
+ * lobby, floor 0, belongs to every zone.
+ *
+ * Hall calls are posted on a board in shared memory, one slot per floor and
+ * direction. Every group whose zone contains the floor bids for the call with
+ * the score of its best cabin, the lowest bid wins and the winning group
+ * assigns the call to that cabin. Calls within a single zone have one bidder
+ * and are settled by its group alone. Bids are placed and settled by atomic
+ * operations on the slot, no lock is shared between groups.
+ *
+ * The board holds no pointers and could equally be shared between processes.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __GROUP_H
+#define __GROUP_H
+
+#include <stdint.h>
+
+#include "hardwareAPI.h"
+
+/* Most groups, the group is kept in the lowest bits of a bid */
+#define GROUP_MAX 256
+
+/* Added to bids of groups with no cabin in service, any other group wins */
+#define GROUP_OUT_OF_SERVICE (1 << 24)
+
+/* States of a call on the board */
+enum board_state {
+    BOARD_FREE,                 /* nothing to settle */
+    BOARD_POSTING,              /* being posted, not yet open for bids */
+    BOARD_OPEN,                 /* taking bids */
+    BOARD_WON                   /* all bids in, the owner assigns it */
+};
+
+/* A floor and direction on the board, each on a cache line of its own */
+struct board_call {
+    uint64_t bid;               /* lowest so far, score << 8 | group */
+    uint32_t round;             /* times posted, groups bid once per round */
+    int state;
+    int bids;
+    int candidates;             /* groups bidding for the floor */
+    int owner;                  /* winning group once won */
+} __attribute__((aligned(64)));
+
+struct board {
+    int num_floors;
+    int num_groups;
+    struct board_call calls[];  /* floor*2 + (type == GoingDown) */
+};
+
+struct group_stats {
+    int first, last;            /* cabins */
+    int low, high;              /* floors of the zone */
+    uint64_t bids;              /* calls bid for */
+    uint64_t assigned;          /* calls won and assigned */
+    uint64_t contested;         /* of those, bid for by other groups too */
+};
+
+/* Split the fleet and floors into groups and start them, 0 on success */
+int group_open(int num_groups);
+
+/*
+ * Stop the group threads and release the board. Calls posted and not yet
+ * assigned are dispatched to a cabin of any group, so that none is lost on
+ * shutdown or handoff.
+ */
+void group_close();
+
+/*
+ * Post a hall call on the board. Returns 0 once posted, 1 if the call is
+ * already being settled and will be assigned without it, -1 if the groups
+ * are closed and the caller is to dispatch it to a cabin itself.
+ */
+int group_post(FloorButtonPressDesc *call);
+
+/* Number of groups running, 0 if not open */
+int group_count();
+
+/* Group serving cabin id, 0 if not open */
+int group_of(int id);
+
+/* Copy the statistics of group g, 0 <= g < group_count() */
+void group_stats(int g, struct group_stats *stats);
+
+#endif
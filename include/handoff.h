@@ -0,0 +1,90 @@
+/*
+ * Handoff of the hardware connection to a new controller
+ *
+ * Deploying a new build used to mean disconnecting from the hardware and
+ * starting over. Started with '-u <control socket>' a controller instead
+ * comes up without connecting, and asks the one running for its connection
+ * with the control command "handoff <cabins> <floors>":
+ *
+ *  1. The running controller checks the fleet is the same, stops its
+ *     dispatcher at the next event, asking the hardware for its speed to
+ *     have one, and shuts its threads down as on exit, every elevator thread
+ *     checkpointing its plan last, see include/journal.h. Hall calls still
+ *     on the group board or held back for want of room are assigned first.
+ *     Commands queued for the hardware are sent.
+ *  2. It sends struct handoff_header, carrying the socket to the hardware
+ *     as SCM_RIGHTS ancillary data, the characters read from it but not
+ *     parsed yet and the last checkpoint of every cabin, then exits without
+ *     telling the hardware to terminate. Its control socket, telemetry and
+ *     journal file are left to the new controller. With destination
+ *     dispatch the passengers follow, see below.
+ *  3. The new controller parses on from those characters, syncs with the
+ *     hardware and replays the checkpoints, as after a crash, and starts
+ *     dispatching. Events sent meanwhile wait in the socket.
+ *
+ * Passengers are not in the checkpoints, which only carry stops. Those
+ * waiting for a cabin with room, num_backlog of them, are sent after the
+ * checkpoints, then for every cabin the number of passengers assigned to it
+ * and not boarded yet, those passengers, the number riding to each floor,
+ * the number to board or leave at each floor and the load, all int32_t.
+ *
+ * The pause, from the old dispatcher stopping until the new one starts, is
+ * printed and logged. The learned models of the old controller, see
+ * include/eta.h and include/dwell.h, are not handed over and are learned
+ * anew.
+ *
+ * Without '-j' the checkpoints are only kept in memory, given '-c' or '-u'.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __HANDOFF_H
+#define __HANDOFF_H
+
+#include <stdint.h>
+
+#define HANDOFF_MAGIC   0x4f444e48      /* "HNDO" */
+#define HANDOFF_VERSION 2
+
+/* Longest a new controller waits for the running one, ms */
+#ifndef HANDOFF_TIMEOUT
+#define HANDOFF_TIMEOUT 5000
+#endif
+
+struct handoff_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;                    /* of the controller handing over */
+    int32_t num_cabins;
+    int32_t num_floors;
+    int32_t binary;                 /* protocol negotiated */
+    int32_t destination;
+    int32_t text;                   /* unread characters still text lines */
+    int32_t unread;                 /* characters following the header */
+    uint32_t slot_size;             /* of each checkpoint following them */
+    int32_t num_backlog;            /* passengers following them */
+    double speed;
+    int64_t stopped;                /* CLOCK_MONOTONIC, ns, dispatcher stopped */
+};
+
+/* Ask the running controller to hand over, by the control thread. Returns 0
+   once the dispatcher is stopping, the reply is sent by handoff_send() */
+int handoff_request(int fd, int cabins, int floors, const char **reason);
+
+/* Whether a handoff was asked for, once the dispatcher has returned, which
+   starts the pause */
+int handoff_pending();
+
+/* Send the connection and state to the new controller, once all threads
+   but the main one are done. Returns 0 on success, to exit right after */
+int handoff_send();
+
+/* Take over from the controller at the control socket path, before syncing
+   with the hardware. Returns 0 on success */
+int handoff_receive(const char *path);
+
+/* Pause since the old dispatcher stopped, ms, once taken over */
+double handoff_pause();
+
+#endif
@@ -25,7 +25,10 @@ typedef enum {
   Speed,
   Door,
   Error,
-  Shutdown
+  Shutdown,
+  Service,
+  Destination,
+  Resume
 } EventType;
 typedef enum {
   GoingUp = 1,
@@ -44,6 +47,11 @@ typedef enum {
   MotorDown = -1
 } MotorAction;
 
+//
+// Positions are fixed point, in units of 1/HW_POSITION_SCALE floor
+// (millifloors), rounded to the nearest as they are parsed.
+#define HW_POSITION_SCALE	1000
+
 //
 typedef struct {
   int floor;
@@ -55,7 +63,7 @@ typedef struct {
 } CabinButtonPressDesc;
 typedef struct {
   int cabin;
-  double position;
+  int position;			// in units of 1/HW_POSITION_SCALE floor
 } CabinPositionDesc;
 typedef struct {
   double speed;
@@ -68,6 +76,14 @@ typedef struct {
   // static memory - will be scrambled by the next waitForEvent;
   char *str;
 } ErrorDesc;
+typedef struct {
+    int cabin;
+    int in_service;
+} ServiceDesc;
+typedef struct {
+  int floor;
+  int destination;
+} DestinationPressDesc;
 //
 typedef union {
   FloorButtonPressDesc fbp;
@@ -76,6 +92,8 @@ typedef union {
   SpeedDesc s;
   DoorState ds;
   ErrorDesc e;
+  ServiceDesc sd;
+  DestinationPressDesc dp;
 } EventDesc;
 
 // 
@@ -84,6 +102,11 @@ typedef union {
 // 'waitForEvent()' running simultaneously;
 EventType waitForEvent(EventDesc *event);
 
+//
+// Waits at most 'timeout' ms for an event. Returns 1 if 'waitForEvent()'
+// will return one without blocking, 0 otherwise;
+int pollHW(int timeout);
+
 //
 // Primitives controlling the hardware (motors, doors & status
 // panels), as well as for state enquiry. These primitives are
@@ -97,4 +120,72 @@ void getSpeed();
 //
 void terminate();
 
+//
+// Hands the connection over to another process. Returns the socket
+// and copies the characters received but not parsed yet to 'unread',
+// at most HW_BUFFER_SIZE, setting 'len', whether frames are used and
+// how many of the characters are still text lines. The connection is
+// not used any further by this process;
+#define HW_BUFFER_SIZE		4096
+int detachHW(char *unread, int *len, int *useBinary, int *text);
+
+//
+// Takes over a connection handed over by 'detachHW()', parsing the
+// characters given before reading any further;
+void reattachHW(int fd, int useBinary, int text, const char *unread, int len);
+
+//
+// Optional binary framing. Once negotiated, every command and event
+// is a fixed size frame in network byte order instead of a text line.
+// 'type' is the letter of the corresponding text command or event,
+// 'cabin' is the floor for 'b' events, 'value' carries positions and
+// speed in units of 1/HW_FRAME_SCALE floor.
+typedef struct {
+  unsigned char type;
+  unsigned char reserved;
+  unsigned short cabin;
+  int value;
+} HWFrame;
+#define HW_FRAME_SCALE		1000000
+
+//
+// Sent as a text line to ask for binary framing; a simulator
+// supporting it answers with the same line and uses frames for
+// everything after it.
+#define HW_BINARY_REQUEST	"x 1\n"
+
+//
+// Asks the simulator for binary framing and waits at most 'timeout'
+// ms for the answer. Returns 1 if frames are used from now on, 0 if
+// the text protocol is kept. Must be called before any other command.
+int negotiateBinaryHW(int timeout);
+
+//
+// Optional destination dispatch. Instead of hall buttons the simulator
+// reports the floor and destination of every passenger as "g <floor>
+// <destination>", and is told which cabin the next passenger waiting at
+// a floor for a destination is to take by "a <cabin> <floor>
+// <destination>", one for every 'g'. In frames 'cabin' is the floor of 'g' events and the
+// value of 'a' commands is the floor and destination packed by
+// HW_DESTINATION().
+#define HW_DESTINATION_REQUEST	"y 1\n"
+#define HW_DESTINATION(floor, destination) ((floor) << 16 | (destination))
+#define HW_DESTINATION_FLOOR(value)	((value) >> 16)
+#define HW_DESTINATION_TO(value)	((value) & 0xffff)
+
+//
+// Asks the simulator for destination dispatch, as 'negotiateBinaryHW()'
+// does for frames. Must be called before 'negotiateBinaryHW()'.
+int negotiateDestinationHW(int timeout);
+
+//
+// Tells the next passenger waiting at 'floor' for 'destination' to
+// take 'cabin'. Only with destination dispatch negotiated.
+void assignDestination(int cabin, int floor, int destination);
+
+//
+// Adopts an already connected socket instead of 'initHW()', using
+// binary framing if 'binary' is set.
+void attachHW(int fd, int binary);
+
 #endif
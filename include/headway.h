@@ -0,0 +1,91 @@
+/*
+ * Headway control
+ *
+ * Giving every hall call to the cabin serving it soonest bunches cabins. The
+ * cabin in front picks up the calls ahead of it, stops more often and is
+ * caught up by the one behind it, which then arrives at floors just served.
+ * Waits at a floor then come in long and short intervals instead of even
+ * ones.
+ *
+ * Cabins are placed on a loop up the shaft and back down, 2*(floors-1)
+ * floors around, by their position and the way they are heading. Spread out
+ * evenly the cabins of a group on it would be a headway of the loop divided
+ * by their number apart. Idle cabins are not on it.
+ *
+ *  - A cabin with another closer behind it than the headway is scored for
+ *    hall calls as if it had the floors missing to go as well, weighted by
+ *    HEADWAY_WEIGHT percent. The call is left to the cabin behind, which is
+ *    slowed down in turn.
+ *  - A cabin stopped with no passengers aboard less than half the headway
+ *    behind the next one holds its doors open, up to HEADWAY_HOLD_MAX ms,
+ *    for the gap to open up.
+ *  - A cabin idle for HEADWAY_PARK_SCANS looks at the board, see
+ *    include/steal.h, with another cabin within HEADWAY_PARK_NEAR floors
+ *    parks at the floor farthest from the other cabins, without opening its
+ *    doors. Of two cabins close to each other the higher one moves.
+ *
+ * Off in destination dispatch, where passengers were told which cabin to
+ * board.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __HEADWAY_H
+#define __HEADWAY_H
+
+#include <stdint.h>
+
+#include "cabin.h"
+
+/* Share of the floors missing to the headway added to scores, percent */
+#ifndef HEADWAY_WEIGHT
+#define HEADWAY_WEIGHT 50
+#endif
+
+/* Longest a cabin holds its doors open for the gap ahead, ms */
+#ifndef HEADWAY_HOLD_MAX
+#define HEADWAY_HOLD_MAX 4000
+#endif
+
+/* Looks at the board idle before parking */
+#ifndef HEADWAY_PARK_SCANS
+#define HEADWAY_PARK_SCANS 8
+#endif
+
+/* Floors to another cabin an idle cabin parks away from */
+#ifndef HEADWAY_PARK_NEAR
+#define HEADWAY_PARK_NEAR 1
+#endif
+
+struct headway_stats {
+    int position;               /* on the loop, 1/HW_POSITION_SCALE floor, -1 idle */
+    int gap;                    /* to the cabin behind it, -1 if none */
+    uint64_t penalized;         /* hall calls scored with a penalty */
+    uint64_t holds;
+    uint64_t held_ms;
+    uint64_t parks;
+};
+
+/* Allocate the loop, 0 on success or if disabled */
+int headway_open(int num_floors, int num_cabins);
+void headway_close();
+
+int headway_enabled();
+
+/* Place cabin id at position heading up or down, or 0 if idle, by its
+   elevator thread */
+void headway_update(int id, int position, int heading);
+
+/* Added to the score of cabin id for a hall call, in the units of the score */
+int headway_penalty(int id);
+
+/* Extra ms cabin id stopped holds its doors open, by its elevator thread */
+int headway_hold(int id);
+
+/* Floor for idle cabin id to park at, -1 to stay, by its elevator thread */
+int headway_park(int id);
+
+void headway_stats(int id, struct headway_stats *stats);
+
+#endif
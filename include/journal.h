@@ -0,0 +1,146 @@
+/*
+ * Checkpoint journal of the cabin plans
+ *
+ * The controller exits on any error on its connection to the hardware, and
+ * the stops of every cabin went with it, hall calls included, which the
+ * hardware shows as taken and passengers do not press again. Given '-j'
+ * every elevator thread checkpoints its stops, the floor it is at, the way
+ * its motor runs and whether its doors are open into a file mapped shared,
+ * so that whatever is stored survives the process however it ends.
+ *
+ * Layout: struct journal_header and two slots per cabin (index 0 is cabin
+ * 1), each a struct journal_slot and max_stops struct journal_stop. A
+ * checkpoint is written by the elevator thread of the cabin alone, into the
+ * slot not holding the last one, with the seq of the slot odd while doing
+ * so, and only if anything changed. A checkpoint torn by a crash is left
+ * odd and the one before it in the other slot is kept. No system calls are
+ * made, the page cache keeps the file for the next run, not across a crash
+ * of the host.
+ *
+ * On startup the last checkpoint of every cabin is read before anything is
+ * written. Once the hardware is synced, see sync_hardware(), it is replayed
+ * if the positions reported by whereIs() agree with it: every cabin idle at
+ * the floor checkpointed, the moving ones no further back than it. A
+ * journal that does not agree, is older than JOURNAL_MAX_AGE ms or was
+ * closed on an orderly shutdown is not replayed. Each elevator thread
+ * pushes its stops back into its queue, starts the motor the way it ran and
+ * finishes the door cycle it was in, reopening doors left moving for the
+ * passengers who had not boarded yet, before checkpointing again.
+ *
+ * Destination dispatch gets its stops back, not the passengers assigned to
+ * them, a controller taking over is sent those as well, see
+ * include/handoff.h. Hall calls not in the plan of any cabin, those held back for want of
+ * room, see hold_hall_call(), and those still on the board of the groups,
+ * see include/group.h, are not checkpointed and are lost on a crash. A
+ * controller handing over dispatches them to a cabin first.
+ *
+ * The checkpoints are handed to a new controller taking over as well, see
+ * include/handoff.h, kept in anonymous memory if not in a file.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+#include <stdint.h>
+
+#include "cabin.h"
+
+#define JOURNAL_MAGIC   0x4c4e524a      /* "JRNL" */
+#define JOURNAL_VERSION 1
+
+/* Checkpoints older than this are of another run, ms */
+#ifndef JOURNAL_MAX_AGE
+#define JOURNAL_MAX_AGE 300000
+#endif
+
+/* Doors of a checkpoint */
+#define JOURNAL_DOORS_CLOSED 0
+#define JOURNAL_DOORS_MOVING 1
+#define JOURNAL_DOORS_OPEN   2
+
+/* Stops of a slot, a hall call each way and a cabin call at every floor */
+#define JOURNAL_STOPS(num_floors) (3*(num_floors))
+
+struct journal_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                  /* of the whole file */
+    int32_t num_cabins;
+    int32_t num_floors;
+    int32_t max_stops;              /* per slot */
+    uint32_t clean;                 /* closed on an orderly shutdown */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct journal_stop {
+    int16_t floor;
+    int16_t direction;              /* of the hall call, 0 for a cabin call */
+};
+
+struct journal_slot {
+    uint32_t seq;                   /* odd while written, the newest is kept */
+    int32_t floor;
+    int32_t direction;              /* of the motor */
+    int32_t doors;                  /* JOURNAL_DOORS_* */
+    int32_t num_stops;
+    int64_t written;                /* wall clock, ms */
+    struct journal_stop stops[];
+};
+
+struct journal_stats {
+    int replayed;                   /* of the run before, or -1 if rejected */
+    int cabins;                     /* resumed so far */
+    int stops;                      /* replayed */
+    double resume_ms;               /* from sync until the last cabin resumed */
+    uint64_t checkpoints;
+    uint64_t unchanged;             /* skipped */
+    uint64_t truncated;             /* plans longer than a slot */
+};
+
+static inline uint32_t journal_slot_size(int max_stops)
+{
+    uint32_t size = sizeof(struct journal_slot) + max_stops*sizeof(struct journal_stop);
+
+    return (size + CACHE_LINE_SIZE-1) & ~(CACHE_LINE_SIZE-1);
+}
+
+static inline uint32_t journal_size(int num_cabins, int num_floors)
+{
+    return sizeof(struct journal_header) +
+           2*num_cabins*journal_slot_size(JOURNAL_STOPS(num_floors));
+}
+
+/* Map the file, keeping the last checkpoints to replay, or anonymous memory
+   given no path. 0 on success */
+int journal_open(const char *path, int num_cabins, int num_floors);
+
+/* Mark the journal clean, only on an orderly shutdown */
+void journal_close();
+
+int journal_enabled();
+
+/* Copy the last checkpoint of every cabin, journal_slot_size() bytes each,
+   to buf once the elevator threads are done. Returns the bytes copied */
+int journal_save(char *buf);
+
+/* Replay the checkpoints in buf, as saved, instead of those read on open */
+void journal_load(const char *buf);
+
+/* Verify the checkpoints against the positions synced, by the main thread.
+   Returns the cabins with stops to replay, -1 if rejected */
+int journal_replay();
+
+/* Push the stops checkpointed back into the queue of cabin id and start
+   checkpointing, by its elevator thread. Returns the direction the motor
+   ran and sets doors to the JOURNAL_DOORS_* they were left */
+int journal_resume(int id, elevator_information *info, int *doors);
+
+/* Checkpoint cabin id, by its elevator thread */
+void journal_checkpoint(int id, int position, int direction, int doors,
+                        stop_queue *queue);
+
+void journal_stats(struct journal_stats *stats);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * Asynchronous binary logger
+ *
+ * Every thread writes fixed size records, a format id and its numeric
+ * arguments, into a lock-free ring of its own. A background thread drains the
+ * rings either to a binary file, to be decoded offline by tools/logdecode, or
+ * decodes them itself and prints them to stdout.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __LOG_H
+#define __LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Levels, a record is kept if its level is at most the current level */
+#define LOG_ERROR 0
+#define LOG_INFO  1
+#define LOG_DEBUG 2
+
+/* Arguments per record */
+#define LOG_MAX_ARGS 6
+
+/* Records per thread ring, must be a power of two */
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE 4096
+#endif
+
+/* Written first in binary log files */
+#define LOG_MAGIC   0x474f4c45      /* "ELOG" */
+#define LOG_VERSION 2
+
+/*
+ * All messages that can be logged. Arguments are stored as doubles, integer
+ * conversions in the format are printed from the truncated value. A record
+ * carrying fewer arguments than its format has conversions is cut off at the
+ * first conversion missing an argument.
+ *
+ * Formats are only ever appended, ids of those logged by older builds stay
+ * the same. Bump LOG_VERSION if any is moved or removed.
+ */
+#define LOG_FORMATS(X) \
+    X(LOG_DROPPED,          "%d records dropped by thread %d") \
+    X(LOG_DISPATCHER_UP,    "dispatcher up and running") \
+    X(LOG_DISPATCHER_DOWN,  "Dispatcher has terminated.") \
+    X(LOG_FLOOR_BUTTON,     "floor button pressed: floor %d, type %d") \
+    X(LOG_SUITABLE,         "found suitable elevator %d") \
+    X(LOG_CABIN_BUTTON,     "cabin button pressed: cabin %d, floor %d") \
+    X(LOG_POSITION,         "cabin position: cabin %d, position %1.4f") \
+    X(LOG_SPEED,            "speed %f") \
+    X(LOG_UNKNOWN_EVENT,    "Received unknown event (type %d)") \
+    X(LOG_ELEVATOR_UP,      "elevator %d up and running") \
+    X(LOG_ELEVATOR_DOWN,    "Elevator %d has terminated.") \
+    X(LOG_ELEVATOR_EVENT,   "elevator %d received type %d") \
+    X(LOG_ELEVATOR_UNKNOWN, "Elevator %d received unknown event (type %d)") \
+    X(LOG_QUEUE,            "Queue %d, %d stops: %d, %d, %d, %d") \
+    X(LOG_SERVICE,          "elevator %d in service: %d") \
+    X(LOG_REDISPATCH,       "elevator %d hands over hall call: floor %d, type %d") \
+    X(LOG_WEIGHTS,          "score function weights: distance %d, stops %d") \
+    X(LOG_SNAPSHOT,         "snapshot: cabin %d, in service %d, position %1.4f, %d events, %d stops: %d") \
+    X(LOG_DESTINATION,      "destination call: floor %d, destination %d, elevator %d") \
+    X(LOG_EMERGENCY,        "emergency stop: cabin %d") \
+    X(LOG_GROUP_UP,         "group %d up: cabins %d-%d, floors %d-%d") \
+    X(LOG_GROUP_DOWN,       "Group %d has terminated.") \
+    X(LOG_GROUP_ASSIGN,     "group %d assigns hall call: floor %d, type %d, %d bids, elevator %d") \
+    X(LOG_SHED,             "elevator %d overloaded, event not queued (type %d)") \
+    X(LOG_DWELL,            "elevator %d dwell %d ms at floor %d: demand %d, expected %1.2f, %d cabins busy") \
+    X(LOG_DWELL_CONFIG,     "door dwell: min %d ms, max %d ms, %d ms per passenger") \
+    X(LOG_ETA_RUN,          "run of %1.2f floors in %d ms: speed %1.3f floors/s, acceleration %1.0f ms") \
+    X(LOG_STEAL,            "elevator %d steals hall call: floor %d, type %d, from elevator %d, score %d against %d") \
+    X(LOG_HEADWAY_HOLD,     "elevator %d holds doors %d ms: %1.2f floors to the next cabin, headway %1.2f") \
+    X(LOG_HEADWAY_PARK,     "elevator %d parks at floor %d, %1.2f floors from the others") \
+    X(LOG_TRAFFIC,          "traffic pattern %d, mode %d: %1.1f hall calls/min, %1.2f from lobby, %1.2f down") \
+    X(LOG_JOURNAL_REPLAY,   "journal replays %d cabins, %d stops, checkpointed %1.0f ms ago") \
+    X(LOG_JOURNAL_REJECTED, "journal rejected: elevator %d at floor %d, checkpointed at floor %d heading %d, %1.0f ms ago") \
+    X(LOG_JOURNAL_RESUME,   "elevator %d resumes %d stops, motor %d, doors %d, %1.1f ms after sync") \
+    X(LOG_HANDOFF_SENT,     "handed over the hardware: %d characters unread, %1.1f ms after the dispatcher stopped") \
+    X(LOG_HANDOFF_TAKEN,    "took over the hardware from pid %d: %d characters unread, %1.1f ms after its dispatcher stopped") \
+    X(LOG_HANDOFF_PAUSE,    "dispatching again %1.1f ms after the dispatcher handing over stopped") \
+    X(LOG_GROUP_UNSETTLED,  "hall call left on the board: floor %d, type %d, dispatched to a cabin") \
+    X(LOG_SYNCED,           "hardware synced in %1.1f ms, speed %f") \
+    X(LOG_BAD_DESTINATION,  "destination call dropped: floor %d, destination %d")
+
+enum log_format {
+#define LOG_ENUM(id, format) id,
+    LOG_FORMATS(LOG_ENUM)
+#undef LOG_ENUM
+    LOG_NUM_FORMATS
+};
+
+/* One cache line per record */
+struct log_record {
+    uint64_t time;                  /* ns since log_open() */
+    uint16_t format;
+    uint8_t level;
+    uint8_t num_args;
+    uint32_t thread;
+    double args[LOG_MAX_ARGS];
+};
+
+/* Header of binary log files */
+struct log_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t num_formats;
+};
+
+extern int log_level;
+
+/*
+ * Log a message if level is enabled, e.g.
+ *  log_msg(LOG_DEBUG, LOG_SUITABLE, e);
+ */
+#define log_msg(level, format, ...)                                         \
+    do {                                                                    \
+        if ((level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED)) {     \
+            const double __args[] = { 0, ##__VA_ARGS__ };                   \
+            log_write((level), (format),                                    \
+                      sizeof(__args)/sizeof(double)-1, __args+1);           \
+        }                                                                   \
+    } while (0)
+
+/*
+ * Start the drain thread. Records are written in binary to path, or decoded
+ * and printed to stdout if path is NULL. Returns 0 on success.
+ */
+int log_open(const char *path, int level);
+
+/* Drain all rings and stop the drain thread */
+void log_close();
+
+void log_set_level(int level);
+
+/* Put a record in the calling threads ring, dropped if the ring is full */
+void log_write(int level, int format, int num_args, const double *args);
+
+/* Print a record as text */
+void log_decode(FILE *out, struct log_record *record);
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * Prioritized output to the hardware
+ *
+ * All commands to the hardware are queued here and written by a single
+ * sender thread, which satisfies the hardware APIs demand that no two
+ * commands are sent in parallel. Commands are sent by class, a stop never
+ * waits behind anything but other stops. Indicator updates are rate limited
+ * and an update of a cabin still queued is replaced by a newer one.
+ *
+ * The last commanded motor, door and indicator state of each cabin is kept
+ * as a shadow of the hardware, commands that would not change it are
+ * dropped before they are queued.
+ *
+ * Emergency stops bypass all queues through a slot reserved for each cabin,
+ * waiting for nothing but a command already being written.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __OUTPUT_H
+#define __OUTPUT_H
+
+#include <stdint.h>
+
+/* Classes, in order of priority */
+enum output_class {
+    OUTPUT_EMERGENCY,           /* emergency stops */
+    OUTPUT_STOP,                /* motor stops */
+    OUTPUT_MOTION,              /* motor starts, doors, assignments and enquiries */
+    OUTPUT_INDICATOR,           /* floor indicators */
+    OUTPUT_NUM_CLASSES
+};
+
+/* Indicator updates per second, and how many may be sent back to back */
+#ifndef OUTPUT_INDICATOR_RATE
+#define OUTPUT_INDICATOR_RATE 200
+#endif
+#ifndef OUTPUT_INDICATOR_BURST
+#define OUTPUT_INDICATOR_BURST 16
+#endif
+
+/* Queueing delay histogram, bucket i counts delays below 2^i us */
+#define OUTPUT_HISTOGRAM_BUCKETS 24
+
+struct output_stats {
+    uint64_t sent;
+    uint64_t replaced;          /* indicator updates made redundant */
+    uint64_t suppressed;        /* dropped by the shadow state */
+    uint64_t histogram[OUTPUT_HISTOGRAM_BUCKETS];
+};
+
+/* Start the sender thread, returns 0 on success */
+int output_open(int num_cabins);
+
+/* Send everything still queued and stop the sender thread */
+void output_close();
+
+/*
+ * Queue a command, type being the letter of the text protocol:
+ * 'm' motor, 'd' door, 's' scale, 'w' where, 'v' speed and 'a' destination
+ * assignment, its value packed by HW_DESTINATION()
+ */
+void output_send(char type, int cabin, int value);
+
+/*
+ * Stop the motor of a cabin ahead of everything queued. Motor starts of the
+ * cabin are dropped until output_resume().
+ */
+void output_emergency_stop(int cabin);
+void output_resume(int cabin);
+
+/*
+ * Forget the shadow state of a cabin, or of all of them given 0, and send
+ * the last commanded state again
+ */
+void output_resync(int cabin);
+
+/* Copy of the statistics of a class */
+void output_stats(enum output_class class, struct output_stats *stats);
+
+/* Upper bound of the p:th percentile (0-1) of the queueing delay, us */
+uint64_t output_percentile(struct output_stats *stats, double p);
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * Pipelined dispatcher
+ *
+ * Instead of one dispatcher reading, parsing and dispatching every event in
+ * turn, the work is split over stages connected by single producer, single
+ * consumer rings:
+ *
+ *  reader      the dispatcher thread, reads and parses events off the
+ *              connection and passes them on without looking at them
+ *  fan-out     takes the events in batches, routes cabin buttons and
+ *              positions straight to the cabins and wakes every cabin once
+ *              per batch, hands hall calls to the scorers by turns
+ *  scorers     rank the cabins for the hall calls and assign them
+ *
+ * The reader never waits for a hall call to be scored. Destination calls and
+ * their backlog stay on the fan-out stage, which keeps them in order.
+ *
+ * A stage waiting for events spins briefly, then sleeps until its producer
+ * wakes it.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <stdint.h>
+
+#include "cabin.h"
+
+/* Events each ring holds, a power of two */
+#ifndef PIPELINE_RING_SIZE
+#define PIPELINE_RING_SIZE 1024
+#endif
+
+/* Most events taken by a stage at once */
+#ifndef PIPELINE_BATCH
+#define PIPELINE_BATCH 64
+#endif
+
+/* Times a stage yields before sleeping on an empty ring */
+#define PIPELINE_SPINS 16
+
+#define PIPELINE_MAX_SCORERS 16
+
+struct pipeline_stats {
+    uint64_t events;            /* taken by the stage */
+    uint64_t batches;
+    uint64_t depth;             /* events waiting now */
+    uint64_t max_depth;
+};
+
+/* Start the fan-out stage and scorers, 0 on success */
+int pipeline_open(int num_scorers);
+
+/* Stop and join the stages and free their rings, it may be opened again */
+void pipeline_close();
+
+/*
+ * Pass an event read by the dispatcher down the pipeline. Returns 0 once
+ * passed, 1 if the pipeline is not running and the caller dispatches it.
+ */
+int pipeline_read(struct event *event);
+
+/*
+ * Hand a hall call to a scorer, only called by the fan-out stage. Returns 0
+ * once handed over, 1 if it is to be scored by the caller.
+ */
+int pipeline_score(struct event *event);
+
+/*
+ * Stages, 0 the fan-out stage and 1 to pipeline_count()-1 the scorers. The
+ * statistics of a stage closed meanwhile are all 0.
+ */
+int pipeline_count();
+void pipeline_stats(int stage, struct pipeline_stats *stats);
+
+#endif
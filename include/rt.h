@@ -0,0 +1,102 @@
+/*
+ * Real-time scheduling
+ *
+ * Under load from other processes the threads of the controller are woken
+ * late by tens of ms when scheduled as any other. Given '-R' the dispatcher,
+ * which also reads the hardware, the output sender and the elevator threads
+ * run under SCHED_FIFO instead, each role at a priority of its own. Threads
+ * dispatching for the dispatcher, the zones and pipeline stages, run at its
+ * priority. The control socket and the log drainer stay as they are.
+ *
+ * Memory is locked, the heap is never given back and the first RT_PREFAULT_HEAP
+ * bytes of it and the stack of every real-time thread are touched up front so
+ * that no page faults are taken while running. Threads are given stacks of
+ * RT_STACK_SIZE, every one of them is locked. Mutexes shared by real-time
+ * threads inherit the priority of their waiters.
+ *
+ * Without the privileges the controller falls back on the default scheduler
+ * and says so once. Memory, the heap and stacks are then left as they are
+ * without '-R', neither locked nor prefaulted.
+ *
+ * Either way the elevator threads count how late they wake from waiting for
+ * doors to close or to look at the hall call board, in a histogram of powers
+ * of two us. That is the scheduling latency of a thread woken by a timer,
+ * measured without a thread of its own disturbing the others.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __RT_H
+#define __RT_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Stack of every thread, locked in full */
+#ifndef RT_STACK_SIZE
+#define RT_STACK_SIZE (1 << 20)
+#endif
+
+/* Touched of the stack of a real-time thread as it starts */
+#ifndef RT_PREFAULT_STACK
+#define RT_PREFAULT_STACK (64 << 10)
+#endif
+
+/* Touched of the heap before any thread starts */
+#ifndef RT_PREFAULT_HEAP
+#define RT_PREFAULT_HEAP (8 << 20)
+#endif
+
+/* Bucket i counts wake-ups late by [2^(i-1), 2^i) us, the last one the rest */
+#define RT_JITTER_BUCKETS 24
+
+enum rt_role {
+    RT_DISPATCHER,
+    RT_OUTPUT,
+    RT_CABIN,
+    RT_NUM_ROLES
+};
+
+enum rt_mode {
+    RT_OFF,                     /* not asked for */
+    RT_FALLBACK,                /* asked for, not permitted */
+    RT_FIFO
+};
+
+struct rt_stats {
+    int mode;
+    int priorities[RT_NUM_ROLES];
+    int locked;                 /* memory locked */
+    int threads;                /* threads running under SCHED_FIFO */
+
+    uint64_t samples;
+    uint64_t max_us;
+    uint64_t buckets[RT_JITTER_BUCKETS];
+};
+
+/* Priorities of the roles, as "<dispatcher>[,<output>[,<cabins>]]", the
+   ones left out take the last given. Returns 0 on success */
+int rt_parse(const char *list);
+
+/* Lock and prefault memory if permitted to run real-time, before any other
+   thread is started. Returns 0 if running real-time, falling back is not an
+   error */
+int rt_open();
+void rt_close();
+
+/* Run the calling thread at the priority of role, nothing unless open */
+void rt_thread(enum rt_role role);
+
+/* Initialize a mutex shared by real-time threads */
+void rt_mutex_init(pthread_mutex_t *mutex);
+
+/* pthread_cond_timedwait() on a condition on the monotonic clock, counting
+   how late it woke on timing out unless not asked for real-time */
+int rt_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                 const struct timespec *deadline);
+
+void rt_stats(struct rt_stats *stats);
+
+#endif
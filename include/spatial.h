@@ -0,0 +1,59 @@
+/*
+ * Spatial index of cabins for dispatch
+ *
+ * Ranking every cabin for every hall call is linear in the fleet. The index
+ * keeps a bitmap of cabins per floor band, by the floor each cabin is at, and
+ * a bitmap of busy cabins per reach, the number of floors to their first
+ * stop. A hall call is ranked against the cabins nearest its floor first,
+ * widening until no cabin left can beat the best one found.
+ *
+ * The bound, for weights wd, ws >= 0 from score_bound(), a cabin at floor c,
+ * a call at floor f and the first stop at floor s: distance_to_floor() either
+ * places the call before the first stop, scoring at least wd*|c-f|, or
+ * passes at least that stop, scoring at least ws + wd*|c-s|. So no cabin
+ * scores below
+ *
+ *      min(wd*|c-f|, ws + wd*|c-s|)
+ *
+ * less wd/2 as c is the nearest floor, and a time of arrival is taken from
+ * where the cabin actually is. A cabin is skipped only when both terms exceed
+ * the best score found. The headway and traffic penalties, see
+ * include/headway.h and include/traffic.h, are never negative and only add
+ * to that. Ties go to the lowest cabin, as with the linear search, so the
+ * index picks the very same cabin. The bound holds for the floors and stops
+ * in the index, which trail the cabins by the events their elevators are
+ * handling.
+ *
+ * Each elevator thread indexes its own cabin, only once it moves to another
+ * floor or its first stop changes.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __SPATIAL_H
+#define __SPATIAL_H
+
+#include "hardwareAPI.h"
+#include "cabin.h"
+
+/* Smaller fleets are ranked linearly, which is cheaper for them */
+#ifndef SPATIAL_MIN_CABINS
+#define SPATIAL_MIN_CABINS 16
+#endif
+
+/* Allocate the index, 0 on success */
+int spatial_open(int num_cabins, int num_floors);
+void spatial_close();
+
+/* Index cabin id at position with the stops of queue, by its elevator thread */
+void spatial_update(int id, int position, stop_queue *queue);
+
+/*
+ * The most suitable of the available cabins first to last and its score,
+ * 0 if the index cannot tell: not open, not every cabin indexed yet,
+ * negative weights or none of the cabins available.
+ */
+int spatial_search(FloorButtonPressDesc *floor_button, int first, int last, int *score);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * Hall call stealing
+ *
+ * A hall call stays with the cabin it was assigned to, even when that cabin
+ * is held up and another one is left idle next to the floor. Every hall call
+ * in a stop queue is therefore published on a board, one slot per floor and
+ * direction, naming the cabin owning it. Idle cabins and cabins on the move
+ * look at the board every STEAL_INTERVAL ms and claim the calls they would
+ * serve sooner than their owner, by more than STEAL_MARGIN stops as scored
+ * by distance_to_floor(), so that two cabins never trade a call back and
+ * forth on noise.
+ *
+ * A slot holds the owner and the number of times it changed hands in a
+ * single word, a claim is a compare and swap on it and fails if the owner
+ * served the call or another cabin claimed it first. The cabin claiming a
+ * call puts it in its own stop queue, the owner is told and drops the calls
+ * it no longer owns from its queue. Only its own elevator thread ever
+ * changes a stop queue.
+ *
+ * Calls are only stolen within a group, and not at all in destination
+ * dispatch where passengers were told which cabin to board.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __STEAL_H
+#define __STEAL_H
+
+#include <stdint.h>
+
+#include "hardwareAPI.h"
+
+/* How often a cabin looks at the board, ms */
+#ifndef STEAL_INTERVAL
+#define STEAL_INTERVAL 250
+#endif
+
+/* Stops, as scored, by which a cabin must beat the owner of a call */
+#ifndef STEAL_MARGIN
+#define STEAL_MARGIN 1
+#endif
+
+struct steal_stats {
+    uint64_t claimed;           /* calls taken from other cabins */
+    uint64_t lost;              /* calls taken by other cabins */
+};
+
+/* Allocate the board for num_cabins once synced, 0 on success or if disabled */
+int steal_open(int num_floors, int num_cabins);
+void steal_close();
+
+/* Whether cabins look at the board */
+int steal_enabled();
+
+/*
+ * By the elevator thread id only
+ */
+/* Publish a hall call put in the stop queue of cabin id */
+void steal_post(int id, FloorButtonPressDesc *call);
+
+/* Take a hall call of cabin id off the board, it was served */
+void steal_served(int id, FloorButtonPressDesc *call);
+
+/* Claim the calls cabin id beats their owners to, returns the number */
+int steal_scan(int id);
+
+/* Drop the hall calls claimed by other cabins from the stop queue of id */
+void steal_drop(int id);
+
+void steal_stats(int id, struct steal_stats *stats);
+
+#endif
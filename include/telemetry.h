@@ -0,0 +1,157 @@
+/*
+ * Live telemetry in shared memory
+ *
+ * The controller publishes the state of every cabin and the fleet wide hall
+ * call backlog in a POSIX shared memory object (/dev/shm/<name>). Readers map
+ * it read-only and poll it without any system calls or locks.
+ *
+ * Layout: struct telemetry_header, num_cabins struct telemetry_cabin (index 0
+ * is cabin 1) and one byte of pending hall calls per floor.
+ *
+ * Each cabin section is written by its elevator thread only and protected by
+ * a seqlock, seq is odd while a write is in progress. Counters and the fields
+ * written by the dispatcher are updated atomically outside of the seqlock.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __TELEMETRY_H
+#define __TELEMETRY_H
+
+#include <stdint.h>
+
+#include "cabin.h"
+
+#define TELEMETRY_DEFAULT_NAME "/elevator-controller"
+
+#define TELEMETRY_MAGIC   0x4d4c4554    /* "TELM" */
+#define TELEMETRY_VERSION 2
+
+/* Stops of the plan that are published */
+#define TELEMETRY_MAX_STOPS 16
+
+/* Bits of the hall call bytes */
+#define TELEMETRY_HALL_UP   1
+#define TELEMETRY_HALL_DOWN 2
+
+struct telemetry_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                  /* of the whole region */
+    int32_t num_cabins;
+    int32_t num_floors;
+
+    /* Floor and direction pairs with an unserved hall call */
+    int32_t hall_call_backlog;
+    uint64_t hall_calls;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct telemetry_cabin {
+    /* Seqlock protected, written by the elevator thread */
+    uint32_t seq;
+    int32_t direction;
+    int32_t door_state;
+    int32_t num_stops;
+    double position;                /* in floors */
+    int32_t stops[TELEMETRY_MAX_STOPS];
+
+    /* Counters */
+    uint64_t stops_served;
+    uint64_t motor_commands;
+    uint64_t door_commands;
+
+    /* Written by the dispatcher */
+    uint64_t events __attribute__((aligned(CACHE_LINE_SIZE)));
+    int32_t queue_depth;
+
+    /* Overload of the event buffer, see include/cabin.h */
+    uint64_t conflated;             /* positions and door states replaced */
+    uint64_t merged;                /* buttons already queued */
+    uint64_t shed;
+    uint64_t saturated;             /* times */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Counters of struct telemetry_cabin */
+enum telemetry_counter {
+    TELEMETRY_STOPS,
+    TELEMETRY_MOTOR,
+    TELEMETRY_DOOR,
+    TELEMETRY_CONFLATED,
+    TELEMETRY_MERGED,
+    TELEMETRY_SHED,
+    TELEMETRY_SATURATED
+};
+
+static inline struct telemetry_cabin *telemetry_cabins(struct telemetry_header *header)
+{
+    return (struct telemetry_cabin*) (header+1);
+}
+
+static inline uint8_t *telemetry_hall(struct telemetry_header *header)
+{
+    return (uint8_t*) (telemetry_cabins(header)+header->num_cabins);
+}
+
+static inline uint32_t telemetry_size(int num_cabins, int num_floors)
+{
+    return sizeof(struct telemetry_header) +
+           num_cabins*sizeof(struct telemetry_cabin) + num_floors;
+}
+
+static inline void seqlock_write_begin(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq+1, __ATOMIC_RELEASE);
+}
+
+/* Returns a sequence to pass to seqlock_read_retry() after copying */
+static inline uint32_t seqlock_read_begin(uint32_t *seq)
+{
+    uint32_t s;
+
+    while ((s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+        ;
+
+    return s;
+}
+
+/* True if the copy made since seqlock_read_begin() may be torn */
+static inline int seqlock_read_retry(uint32_t *seq, uint32_t s)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != s;
+}
+
+/* Create and map the region, returns 0 on success */
+int telemetry_open(const char *name, int num_cabins, int num_floors);
+
+/* Unmap and remove the region */
+void telemetry_close();
+
+/*
+ * Updates, all of them are no-ops unless telemetry_open() succeeded
+ */
+/* Publish the state of cabin id, from its elevator thread */
+void telemetry_cabin(int id, int position, int direction, int door_state,
+                     stop_queue *queue);
+void telemetry_count(int id, enum telemetry_counter counter);
+
+/* Publish the event buffer of cabin id, holding its mutex */
+void telemetry_events(int id, int queue_depth, int enqueued);
+
+void telemetry_hall_call(int floor, FloorButtonType type);
+
+/* Consistent copy of the section of cabin id, returns 0 on success */
+int telemetry_read_cabin(int id, struct telemetry_cabin *copy);
+
+/* Clear the hall call of a stop served, direction 0 for a cabin call */
+void telemetry_floor_served(int floor, int direction);
+
+#endif
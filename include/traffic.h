@@ -0,0 +1,166 @@
+/*
+ * Traffic patterns and operating modes
+ *
+ * Hall calls and the trips they lead to are counted as they are routed, cabin
+ * calls from the floor the cabin is at to the one pressed and destination
+ * calls as they are given, decaying by e every TRAFFIC_WINDOW ms.
+ *
+ * A button is pressed once for everyone waiting on it, so the counts are of
+ * calls rather than passengers. The trips to the lobby, floor 0, of a cabin
+ * full of passengers leaving for it are a single cabin call, while every
+ * floor they come from calls a cabin down. So passengers from the lobby are
+ * told by the trips starting there, passengers to the lobby by the hall
+ * calls going down, and the traffic classified as
+ *
+ *  - off-peak      fewer than TRAFFIC_QUIET hall calls a minute
+ *  - lunch         TRAFFIC_LUNCH_UP_SHARE percent of the trips from the lobby
+ *                  and TRAFFIC_LUNCH_DOWN_SHARE percent of hall calls down
+ *  - up-peak       TRAFFIC_UP_SHARE percent of the trips from the lobby
+ *  - down-peak     TRAFFIC_DOWN_SHARE percent of the hall calls down
+ *  - inter-floor   anything else, half the hall calls go down
+ *
+ * The first pattern matching is classified, unless the one running still
+ * matches with its thresholds missed by TRAFFIC_HYSTERESIS percent. Another
+ * pattern has to be classified for TRAFFIC_HOLD ms in a row before taking
+ * over. Each pattern runs a mode:
+ *
+ *  - collective    off-peak, hall calls go to the cabin serving them soonest
+ *                  and idle cabins spread out, see include/headway.h
+ *  - express       up-peak, idle cabins return to the lobby and cabins
+ *                  leaving it upwards are scored TRAFFIC_EXPRESS_STOPS stops
+ *                  more for hall calls until they turn around
+ *  - sectors       down-peak, lunch and inter-floor, the floors of every zone
+ *                  are split among its cabins by the hall calls at them, a
+ *                  cabin is scored TRAFFIC_SECTOR_STOPS stops more for hall
+ *                  calls outside its sector and parks in it when idle
+ *
+ * A mode may be pinned with '-m', the pattern is still classified.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef __TRAFFIC_H
+#define __TRAFFIC_H
+
+#include <stdint.h>
+
+/* Calls are forgotten by e every, ms */
+#ifndef TRAFFIC_WINDOW
+#define TRAFFIC_WINDOW 60000
+#endif
+
+/* A pattern classified this long in a row takes over, ms */
+#ifndef TRAFFIC_HOLD
+#define TRAFFIC_HOLD 10000
+#endif
+
+/* Hall calls a minute below which it is off-peak */
+#ifndef TRAFFIC_QUIET
+#define TRAFFIC_QUIET 6
+#endif
+
+/* Share of trips from the lobby in up-peak, percent */
+#ifndef TRAFFIC_UP_SHARE
+#define TRAFFIC_UP_SHARE 40
+#endif
+
+/* Share of hall calls going down in down-peak, percent */
+#ifndef TRAFFIC_DOWN_SHARE
+#define TRAFFIC_DOWN_SHARE 65
+#endif
+
+/* Shares of trips from the lobby and hall calls going down at lunch */
+#ifndef TRAFFIC_LUNCH_UP_SHARE
+#define TRAFFIC_LUNCH_UP_SHARE 35
+#endif
+#ifndef TRAFFIC_LUNCH_DOWN_SHARE
+#define TRAFFIC_LUNCH_DOWN_SHARE 55
+#endif
+
+/* Slack of the thresholds of the pattern running, percent */
+#ifndef TRAFFIC_HYSTERESIS
+#define TRAFFIC_HYSTERESIS 10
+#endif
+
+/* Fewer calls counted give no share */
+#define TRAFFIC_MIN_TRIPS 4
+
+/* Added to scores for hall calls outside the sector of a cabin, stops */
+#ifndef TRAFFIC_SECTOR_STOPS
+#define TRAFFIC_SECTOR_STOPS 2
+#endif
+
+/* Added to scores of cabins leaving the lobby upwards, stops */
+#ifndef TRAFFIC_EXPRESS_STOPS
+#define TRAFFIC_EXPRESS_STOPS 4
+#endif
+
+/* Looks at the board idle before returning to the lobby or sector */
+#ifndef TRAFFIC_PARK_SCANS
+#define TRAFFIC_PARK_SCANS 2
+#endif
+
+enum traffic_pattern {
+    TRAFFIC_OFF_PEAK,
+    TRAFFIC_UP_PEAK,
+    TRAFFIC_DOWN_PEAK,
+    TRAFFIC_LUNCH,
+    TRAFFIC_INTERFLOOR,
+    TRAFFIC_NUM_PATTERNS
+};
+
+enum traffic_mode {
+    TRAFFIC_COLLECTIVE,
+    TRAFFIC_EXPRESS,
+    TRAFFIC_SECTORS,
+    TRAFFIC_NUM_MODES
+};
+
+struct traffic_stats {
+    int pattern;
+    int mode;
+    int pinned;                 /* mode given by '-m' */
+    double rate;                /* hall calls a minute */
+    double from_lobby;          /* share of the trips */
+    double down;                /* share of the hall calls going down */
+    uint64_t switches;          /* of pattern */
+    uint64_t ms[TRAFFIC_NUM_MODES];
+};
+
+/* Pin the mode, by name, or "auto". Returns 0 on success */
+int traffic_parse(const char *mode);
+
+int traffic_open(int num_floors, int num_cabins);
+void traffic_close();
+
+int traffic_enabled();
+
+/* Count a hall call and a trip, by the thread routing events */
+void traffic_hall(int floor, int type);
+void traffic_trip(int origin, int destination);
+
+/* Classify as time passes without calls, by the elevator threads */
+void traffic_tick();
+
+int traffic_mode();
+
+/* Added to the score of cabin id for a hall call at floor */
+int traffic_penalty(int id, int floor);
+
+/* Cabin id at floor heading up or down, or 0 if idle, by its elevator thread */
+void traffic_update(int id, int floor, int heading);
+
+/* Floor for idle cabin id to park at, -1 to stay, by its elevator thread */
+int traffic_park(int id);
+
+/* Floors of the sector of cabin id, as of the last split */
+void traffic_sector(int id, int *low, int *high);
+int traffic_express(int id);
+
+void traffic_stats(struct traffic_stats *stats);
+
+const char *traffic_pattern_name(int pattern);
+const char *traffic_mode_name(int mode);
+
+#endif
@@ -0,0 +1,433 @@
+/*
+ * Checkpoint journal of the cabin plans, see include/journal.h
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hardwareAPI.h"
+#include "controller.h"
+#include "journal.h"
+#include "log.h"
+#include "steal.h"
+#include "telemetry.h"
+
+struct journal_counts {
+    uint64_t checkpoints;
+    uint64_t unchanged;
+    uint64_t truncated;
+};
+
+static struct journal_header *journal = NULL;
+
+/* Per cabin, indexed by id */
+static struct journal_slot **last = NULL;      /* of the run before, to replay */
+static uint32_t *generation = NULL;            /* of the newest slot written */
+static short *armed = NULL;                    /* resumed, checkpointing */
+
+static uint32_t slot_size;
+static struct timespec replay_start;
+static int replayed = 0;
+static int resumed = 0;
+static int stops_replayed = 0;
+static uint64_t resume_us = 0;
+static struct journal_counts counts;
+
+static struct journal_slot *slot(int id, uint32_t generation)
+{
+    return (struct journal_slot*) ((char*) journal + sizeof(struct journal_header) +
+                                   (2*(id-1) + (generation & 1))*slot_size);
+}
+
+static int64_t wall_ms()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (int64_t) now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+/*
+ * The newest complete checkpoint of cabin id in the journal, NULL if none.
+ * Checkpoints go on from the newest slot written, torn ones included.
+ */
+static struct journal_slot *newest(int id)
+{
+    int k;
+    uint32_t seq, best = 0;
+    struct journal_slot *from = NULL;
+
+    for (k = 0; k < 2; k++) {
+        seq = slot(id, k)->seq;
+
+        if (seq > generation[id]*2)
+            generation[id] = (seq+1)/2;
+
+        if (seq && !(seq & 1) && seq > best) {
+            best = seq;
+            from = slot(id, k);
+        }
+    }
+
+    return from;
+}
+
+/* Copy of a checkpoint to replay, NULL if none or not valid */
+static struct journal_slot *copy(const struct journal_slot *from)
+{
+    int i;
+    struct journal_slot *to;
+
+    if (!from || from->num_stops < 0 || from->num_stops > journal->max_stops)
+        return NULL;
+
+    if (from->direction < -1 || from->direction > 1 ||
+            from->doors < JOURNAL_DOORS_CLOSED || from->doors > JOURNAL_DOORS_OPEN)
+        return NULL;
+
+    /* Floors index the plans of the cabin once replayed */
+    for (i = 0; i < from->num_stops; i++)
+        if (from->stops[i].floor < 0 || from->stops[i].floor >= journal->num_floors ||
+                from->stops[i].direction < -1 || from->stops[i].direction > 1)
+            return NULL;
+
+    if ((to = malloc(slot_size)) != NULL)
+        memcpy(to, from, slot_size);
+
+    return to;
+}
+
+/* Take a mapping as the journal, keeping its checkpoints unless fresh */
+static int adopt(struct journal_header *header, int num_cabins, int num_floors, int fresh)
+{
+    int i;
+    uint32_t size = journal_size(num_cabins, num_floors);
+
+    last = calloc(num_cabins+1, sizeof(struct journal_slot*));
+    generation = calloc(num_cabins+1, sizeof(uint32_t));
+    armed = calloc(num_cabins+1, sizeof(short));
+
+    if (!last || !generation || !armed) {
+        free(last);
+        free(generation);
+        free(armed);
+        munmap(header, size);
+        return 1;
+    }
+
+    slot_size = journal_slot_size(JOURNAL_STOPS(num_floors));
+    journal = header;
+
+    /* Read before any cabin writes, nothing is left after an orderly shutdown */
+    if (!fresh && !header->clean) {
+        for (i = 1; i <= num_cabins; i++)
+            last[i] = copy(newest(i));
+    }
+    else {
+        memset(header, 0, size);
+        header->version = JOURNAL_VERSION;
+        header->size = size;
+        header->num_cabins = num_cabins;
+        header->num_floors = num_floors;
+        header->max_stops = JOURNAL_STOPS(num_floors);
+        __atomic_store_n(&header->magic, JOURNAL_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    header->clean = 0;
+
+    return 0;
+}
+
+int journal_open(const char *path, int num_cabins, int num_floors)
+{
+    int fd, fresh;
+    uint32_t size = journal_size(num_cabins, num_floors);
+    struct journal_header *header;
+    struct stat st;
+
+    /* Kept in memory for a handoff alone */
+    if (!path) {
+        header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (header == MAP_FAILED)
+            return 1;
+
+        return adopt(header, num_cabins, num_floors, 1);
+    }
+
+    if ((fd = open(path, O_CREAT | O_RDWR, 0644)) < 0)
+        return 1;
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return 1;
+    }
+
+    /* A file of another size is of another fleet, start over */
+    fresh = st.st_size != size;
+
+    if (fresh && (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0)) {
+        close(fd);
+        return 1;
+    }
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (header == MAP_FAILED)
+        return 1;
+
+    if (header->magic != JOURNAL_MAGIC || header->version != JOURNAL_VERSION ||
+            header->size != size || header->num_cabins != num_cabins ||
+            header->num_floors != num_floors ||
+            header->max_stops != JOURNAL_STOPS(num_floors))
+        fresh = 1;
+
+    return adopt(header, num_cabins, num_floors, fresh);
+}
+
+void journal_close()
+{
+    int i;
+
+    if (!journal)
+        return;
+
+    journal->clean = 1;
+    msync(journal, journal->size, MS_SYNC);
+
+    for (i = 1; i <= journal->num_cabins; i++)
+        free(last[i]);
+
+    munmap(journal, journal->size);
+    free(last);
+    free(generation);
+    free(armed);
+
+    journal = NULL;
+    last = NULL;
+    generation = NULL;
+    armed = NULL;
+}
+
+int journal_enabled()
+{
+    return journal != NULL;
+}
+
+int journal_save(char *buf)
+{
+    int i;
+    struct journal_slot *from;
+
+    for (i = 1; i <= journal->num_cabins; i++, buf += slot_size) {
+        if ((from = newest(i)) != NULL)
+            memcpy(buf, from, slot_size);
+        else
+            memset(buf, 0, slot_size);
+    }
+
+    return journal->num_cabins*slot_size;
+}
+
+void journal_load(const char *buf)
+{
+    int i;
+    const struct journal_slot *from;
+
+    for (i = 1; i <= journal->num_cabins; i++, buf += slot_size) {
+        from = (const struct journal_slot*) buf;
+
+        /* Written to by the controller handing over since opened */
+        newest(i);
+
+        free(last[i]);
+        last[i] = from->seq && !(from->seq & 1) ? copy(from) : NULL;
+    }
+}
+
+int journal_replay()
+{
+    int i, at, count = 0, stops = 0;
+    int64_t written = 0;
+    struct journal_slot *s;
+
+    clock_gettime(CLOCK_MONOTONIC, &replay_start);
+
+    if (!journal)
+        return 0;
+
+    for (i = 1; i <= journal->num_cabins; i++) {
+        if (last[i] && last[i]->written > written)
+            written = last[i]->written;
+    }
+
+    for (i = 1; i <= journal->num_cabins && written; i++) {
+        if (!(s = last[i]))
+            continue;
+
+        /* Idle where it was left, or no further back than it when moving */
+        at = position_floor(cabins[i]->info.position);
+
+        if (wall_ms() - written > JOURNAL_MAX_AGE ||
+                (!s->direction && at != s->floor) ||
+                (s->direction && (at - s->floor)*s->direction < 0)) {
+            log_msg(LOG_ERROR, LOG_JOURNAL_REJECTED, i, at, s->floor, s->direction,
+                    (double) (wall_ms() - written));
+            count = -1;
+            break;
+        }
+
+        if (s->num_stops || s->direction || s->doors) {
+            count++;
+            stops += s->num_stops;
+        }
+    }
+
+    /* Doors open report nothing until closed, told apart from then on */
+    for (i = 1; i <= journal->num_cabins && count > 0; i++) {
+        if (last[i] && last[i]->doors == JOURNAL_DOORS_OPEN) {
+            cabins[i]->door.state = DoorOpen;
+            __atomic_store_n(&cabins[i]->door.commanded, DoorOpen, __ATOMIC_RELEASE);
+        }
+    }
+
+    if (count < 0) {
+        for (i = 1; i <= journal->num_cabins; i++) {
+            free(last[i]);
+            last[i] = NULL;
+        }
+    }
+    else if (written)
+        log_msg(LOG_INFO, LOG_JOURNAL_REPLAY, count, stops, (double) (wall_ms() - written));
+
+    replayed = count;
+
+    return count;
+}
+
+int journal_resume(int id, elevator_information *info, int *doors)
+{
+    int i, direction = 0;
+    uint64_t us, seen;
+    struct timespec now;
+    struct journal_slot *s;
+    FloorButtonPressDesc call;
+
+    *doors = JOURNAL_DOORS_CLOSED;
+
+    if (!journal)
+        return 0;
+
+    if ((s = last[id]) != NULL) {
+        for (i = 0; i < s->num_stops; i++) {
+            push_stop_queue(s->stops[i].floor, s->stops[i].direction, info->position, info);
+
+            /* Hall calls are on the board and pending as when first pressed */
+            if (s->stops[i].direction) {
+                call.floor = s->stops[i].floor;
+                call.type = (FloorButtonType) s->stops[i].direction;
+
+                steal_post(id, &call);
+                telemetry_hall_call(call.floor, call.type);
+            }
+        }
+
+        direction = s->direction;
+        *doors = s->doors;
+
+        __atomic_add_fetch(&stops_replayed, s->num_stops, __ATOMIC_RELAXED);
+
+        last[id] = NULL;
+    }
+
+    armed[id] = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec-replay_start.tv_sec)*1000000 + (now.tv_nsec-replay_start.tv_nsec)/1000;
+
+    seen = __atomic_load_n(&resume_us, __ATOMIC_RELAXED);
+    while (us > seen && !__atomic_compare_exchange_n(&resume_us, &seen, us, 0,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    __atomic_add_fetch(&resumed, 1, __ATOMIC_RELAXED);
+
+    if (s) {
+        log_msg(LOG_INFO, LOG_JOURNAL_RESUME, id, s->num_stops, direction, *doors, us/1e3);
+        free(s);
+    }
+
+    return direction;
+}
+
+void journal_checkpoint(int id, int position, int direction, int doors,
+                        stop_queue *queue)
+{
+    int i, floor;
+    node_stop_queue *stop;
+    struct journal_slot *s;
+
+    if (!journal || !armed[id])
+        return;
+
+    floor = position_floor(position);
+
+    /* Most iterations only move the cabin within the floor it is at */
+    s = slot(id, generation[id]);
+
+    if (generation[id] && s->seq == 2*generation[id] && s->floor == floor && s->direction == direction &&
+            s->doors == doors && s->num_stops <= queue->size) {
+        for (i = 0, stop = queue->first; i < s->num_stops && stop; i++, stop = stop->next) {
+            if (s->stops[i].floor != stop->floor || s->stops[i].direction != stop->direction)
+                break;
+        }
+
+        if (i == s->num_stops && (!stop || i == journal->max_stops)) {
+            __atomic_add_fetch(&counts.unchanged, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    /* Into the other slot, the last checkpoint stays whole until done */
+    s = slot(id, ++generation[id]);
+
+    __atomic_store_n(&s->seq, 2*generation[id]-1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    s->floor = floor;
+    s->direction = direction;
+    s->doors = doors;
+    s->written = wall_ms();
+
+    for (i = 0, stop = queue->first; i < journal->max_stops && stop; i++, stop = stop->next) {
+        s->stops[i].floor = stop->floor;
+        s->stops[i].direction = stop->direction;
+    }
+    s->num_stops = i;
+
+    if (stop)
+        __atomic_add_fetch(&counts.truncated, 1, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&s->seq, 2*generation[id], __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&counts.checkpoints, 1, __ATOMIC_RELAXED);
+}
+
+void journal_stats(struct journal_stats *stats)
+{
+    stats->replayed = replayed;
+    stats->cabins = __atomic_load_n(&resumed, __ATOMIC_RELAXED);
+    stats->stops = __atomic_load_n(&stops_replayed, __ATOMIC_RELAXED);
+    stats->resume_ms = __atomic_load_n(&resume_us, __ATOMIC_RELAXED)/1e3;
+    stats->checkpoints = __atomic_load_n(&counts.checkpoints, __ATOMIC_RELAXED);
+    stats->unchanged = __atomic_load_n(&counts.unchanged, __ATOMIC_RELAXED);
+    stats->truncated = __atomic_load_n(&counts.truncated, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,273 @@
+/*
+ * Asynchronous binary logger
+ *
+ * Each ring has a single producer, its thread, and a single consumer, the
+ * drain thread, so head and tail only need acquire/release ordering. Rings
+ * are never freed, a thread that exits leaves its ring to be drained.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+
+/* How long the drain thread sleeps when all rings are empty */
+#define LOG_DRAIN_INTERVAL_NS 1000000
+
+struct log_ring {
+    struct log_record records[LOG_RING_SIZE];
+
+    /* Written by the producer */
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t dropped;
+
+    /* Written by the drain thread */
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t reported;
+
+    uint32_t thread;
+    struct log_ring *next;
+};
+
+int log_level = LOG_INFO;
+
+static const char *log_formats[] = {
+#define LOG_STRING(id, format) format,
+    LOG_FORMATS(LOG_STRING)
+#undef LOG_STRING
+};
+
+/* All registered rings, pushed lock-free by their threads */
+static struct log_ring *rings = NULL;
+static uint32_t num_rings = 0;
+
+static __thread struct log_ring *own_ring = NULL;
+
+static FILE *output = NULL;
+static int binary = 0;
+static struct timespec start;
+
+static pthread_t drain_thread;
+static int draining = 0;
+
+static uint64_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) (ts.tv_sec-start.tv_sec)*1000000000 + ts.tv_nsec-start.tv_nsec;
+}
+
+/* Allocate a ring for the calling thread and register it */
+static struct log_ring *register_ring()
+{
+    struct log_ring *ring;
+
+    if (posix_memalign((void**) &ring, 64, sizeof(struct log_ring)))
+        return NULL;
+
+    memset(ring, 0, sizeof(struct log_ring));
+    ring->thread = __atomic_add_fetch(&num_rings, 1, __ATOMIC_RELAXED);
+
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    return ring;
+}
+
+void log_write(int level, int format, int num_args, const double *args)
+{
+    struct log_ring *ring = own_ring;
+    struct log_record *record;
+    uint64_t head;
+
+    if (ring == NULL && (ring = own_ring = register_ring()) == NULL)
+        return;
+
+    head = ring->head;
+
+    /* Never block the caller, count and drop */
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+        ring->dropped++;
+        return;
+    }
+
+    if (num_args > LOG_MAX_ARGS)
+        num_args = LOG_MAX_ARGS;
+
+    record = &ring->records[head & (LOG_RING_SIZE-1)];
+    record->time = now();
+    record->format = format;
+    record->level = level;
+    record->num_args = num_args;
+    record->thread = ring->thread;
+    memcpy(record->args, args, num_args*sizeof(double));
+
+    __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+void log_decode(FILE *out, struct log_record *record)
+{
+    char conversion[16];
+    const char *curr, *end;
+    int arg = 0;
+
+    fprintf(out, "[%llu.%06llu] T%u ",
+            (unsigned long long) record->time/1000000000,
+            (unsigned long long) record->time/1000%1000000, record->thread);
+
+    if (record->format >= LOG_NUM_FORMATS) {
+        fprintf(out, "unknown format %u\n", record->format);
+        return;
+    }
+
+    for (curr = log_formats[record->format]; *curr; curr++) {
+        if (*curr != '%') {
+            fputc(*curr, out);
+            continue;
+        }
+
+        /* Cut off at the first conversion without argument */
+        if (arg == record->num_args)
+            break;
+
+        /* Copy the conversion up to and including its type */
+        end = curr+1;
+        while (*end && !strchr("dif", *end))
+            end++;
+        if (!*end || end-curr+2 > sizeof(conversion))
+            break;
+
+        memcpy(conversion, curr, end-curr+1);
+        conversion[end-curr+1] = '\0';
+
+        if (*end == 'f')
+            fprintf(out, conversion, record->args[arg++]);
+        else
+            fprintf(out, conversion, (int) record->args[arg++]);
+
+        curr = end;
+    }
+
+    fputc('\n', out);
+}
+
+static void output_record(struct log_record *record)
+{
+    if (binary)
+        fwrite(record, sizeof(struct log_record), 1, output);
+    else
+        log_decode(output, record);
+}
+
+/* Move everything in the rings to the output, returns number of records */
+static int drain()
+{
+    struct log_ring *ring;
+    struct log_record dropped;
+    uint64_t head, tail, count;
+    int drained = 0;
+
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        for (tail = ring->tail; tail != head; tail++, drained++)
+            output_record(&ring->records[tail & (LOG_RING_SIZE-1)]);
+
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        /* Racy read, a late count is reported on the next pass */
+        count = ring->dropped;
+        if (count != ring->reported) {
+            memset(&dropped, 0, sizeof(dropped));
+            dropped.time = now();
+            dropped.format = LOG_DROPPED;
+            dropped.level = LOG_ERROR;
+            dropped.num_args = 2;
+            dropped.args[0] = count-ring->reported;
+            dropped.args[1] = ring->thread;
+            output_record(&dropped);
+
+            ring->reported = count;
+        }
+    }
+
+    if (drained)
+        fflush(output);
+
+    return drained;
+}
+
+static void *drainer(void *arg)
+{
+    struct timespec interval = { 0, LOG_DRAIN_INTERVAL_NS };
+
+    while (__atomic_load_n(&draining, __ATOMIC_ACQUIRE)) {
+        if (!drain())
+            nanosleep(&interval, NULL);
+    }
+
+    drain();
+
+    return ((void*) NULL);
+}
+
+int log_open(const char *path, int level)
+{
+    struct log_header header = {
+        LOG_MAGIC, LOG_VERSION, sizeof(struct log_record), LOG_NUM_FORMATS
+    };
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    log_set_level(level);
+
+    if (path) {
+        if ((output = fopen(path, "wb")) == NULL)
+            return 1;
+
+        fwrite(&header, sizeof(header), 1, output);
+        binary = 1;
+    } else {
+        output = stdout;
+        binary = 0;
+    }
+
+    draining = 1;
+    if (pthread_create(&drain_thread, NULL, drainer, NULL) != 0) {
+        draining = 0;
+        return 1;
+    }
+
+    return 0;
+}
+
+void log_close()
+{
+    if (!__atomic_exchange_n(&draining, 0, __ATOMIC_ACQ_REL))
+        return;
+
+    pthread_join(drain_thread, NULL);
+
+    if (binary)
+        fclose(output);
+    else
+        fflush(output);
+}
+
+void log_set_level(int level)
+{
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
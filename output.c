@@ -0,0 +1,473 @@
+/*
+ * Prioritized output to the hardware
+ *
+ * One FIFO per class, all protected by a single mutex which is never held
+ * while writing to the socket.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "hardwareAPI.h"
+#include "output.h"
+#include "rt.h"
+
+struct command {
+    char type;
+    int cabin;
+    int value;
+    uint64_t queued;            /* ns */
+};
+
+/* Growing ring buffer */
+struct fifo {
+    struct command *commands;
+    int size;
+    int first;
+    int count;
+};
+
+static struct fifo fifos[OUTPUT_NUM_CLASSES];
+static struct output_stats stats[OUTPUT_NUM_CLASSES];
+
+/* Last commanded state of a cabin */
+#define SHADOW_UNKNOWN INT_MIN
+
+struct shadow {
+    int motor;
+    int door;
+    int scale;
+};
+
+static struct shadow *shadows;
+
+/* Reserved emergency stop slot of each cabin, time queued or 0 if empty */
+static uint64_t *emergency_queued;
+static int num_emergency;
+
+/* Cabins stopped by an emergency stop, no motor starts until resumed */
+static char *halted;
+
+/* Whether an indicator update of each cabin is queued */
+static char *queued_indicator;
+static int num_indicators;
+
+/* Token bucket of the indicator class */
+static double tokens = OUTPUT_INDICATOR_BURST;
+static uint64_t refilled;
+
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t output_signal;
+static pthread_t sender_thread;
+static int sending = 0;
+
+static uint64_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static enum output_class classify(char type, int value)
+{
+    switch (type) {
+    case 'm':
+        return value == MotorStop ? OUTPUT_STOP : OUTPUT_MOTION;
+    case 's':
+        return OUTPUT_INDICATOR;
+    default:
+        return OUTPUT_MOTION;
+    }
+}
+
+static void push(struct fifo *fifo, struct command *command)
+{
+    int i;
+    struct command *commands;
+
+    if (fifo->count == fifo->size) {
+        commands = malloc(2*fifo->size*sizeof(struct command));
+        for (i = 0; i < fifo->count; i++)
+            commands[i] = fifo->commands[(fifo->first+i) % fifo->size];
+
+        free(fifo->commands);
+        fifo->commands = commands;
+        fifo->size *= 2;
+        fifo->first = 0;
+    }
+
+    fifo->commands[(fifo->first+fifo->count) % fifo->size] = *command;
+    fifo->count++;
+}
+
+static struct command pop(struct fifo *fifo)
+{
+    struct command command = fifo->commands[fifo->first];
+
+    fifo->first = (fifo->first+1) % fifo->size;
+    fifo->count--;
+
+    return command;
+}
+
+/* Shadowed state a command sets, NULL if not shadowed */
+static int *shadowed(char type, int cabin)
+{
+    if (cabin < 0 || cabin >= num_indicators)
+        return NULL;
+
+    switch (type) {
+    case 'm':
+        return &shadows[cabin].motor;
+    case 'd':
+        return &shadows[cabin].door;
+    case 's':
+        return &shadows[cabin].scale;
+    default:
+        return NULL;
+    }
+}
+
+/* Drop queued motor starts of a cabin, a stop would otherwise overtake them */
+static void drop_motor_starts(int cabin)
+{
+    struct fifo *fifo = &fifos[OUTPUT_MOTION];
+    int i, kept = 0;
+    struct command *command;
+
+    for (i = 0; i < fifo->count; i++) {
+        command = &fifo->commands[(fifo->first+i) % fifo->size];
+
+        if (command->type == 'm' && command->cabin == cabin)
+            stats[OUTPUT_MOTION].suppressed++;
+        else
+            fifo->commands[(fifo->first+kept++) % fifo->size] = *command;
+    }
+
+    fifo->count = kept;
+}
+
+/* Queue a command, holding output_mutex */
+static void queue_command(char type, int cabin, int value)
+{
+    struct command command = { type, cabin, value, now() };
+    enum output_class class = classify(type, value);
+    struct fifo *fifo = &fifos[class];
+    int *state = shadowed(type, cabin);
+    int i, index;
+
+    if (type == 'm' && value != MotorStop && cabin >= 0 && cabin < num_indicators &&
+            halted[cabin]) {
+        stats[class].suppressed++;
+        return;
+    }
+
+    if (state && *state == value) {
+        stats[class].suppressed++;
+        return;
+    }
+    if (state)
+        *state = value;
+
+    if (class == OUTPUT_STOP)
+        drop_motor_starts(cabin);
+
+    /*
+     * Replace a queued indicator update of the same cabin, the indicator
+     * FIFO never holds more than one update per cabin so the scan is short
+     */
+    if (class == OUTPUT_INDICATOR && cabin >= 0 && cabin < num_indicators &&
+            queued_indicator[cabin]) {
+        for (i = 0; i < fifo->count; i++) {
+            index = (fifo->first+i) % fifo->size;
+            if (fifo->commands[index].cabin == cabin)
+                fifo->commands[index].value = value;
+        }
+        stats[class].replaced++;
+    } else {
+        push(fifo, &command);
+        if (class == OUTPUT_INDICATOR && cabin >= 0 && cabin < num_indicators)
+            queued_indicator[cabin] = 1;
+    }
+
+    pthread_cond_signal(&output_signal);
+}
+
+void output_send(char type, int cabin, int value)
+{
+    pthread_mutex_lock(&output_mutex);
+    queue_command(type, cabin, value);
+    pthread_mutex_unlock(&output_mutex);
+}
+
+void output_emergency_stop(int cabin)
+{
+    if (cabin < 1 || cabin >= num_indicators)
+        return;
+
+    pthread_mutex_lock(&output_mutex);
+
+    if (!emergency_queued[cabin]) {
+        emergency_queued[cabin] = now();
+        num_emergency++;
+    }
+
+    halted[cabin] = 1;
+    shadows[cabin].motor = MotorStop;
+    drop_motor_starts(cabin);
+
+    pthread_cond_signal(&output_signal);
+    pthread_mutex_unlock(&output_mutex);
+}
+
+void output_resume(int cabin)
+{
+    if (cabin < 1 || cabin >= num_indicators)
+        return;
+
+    pthread_mutex_lock(&output_mutex);
+    halted[cabin] = 0;
+    pthread_mutex_unlock(&output_mutex);
+}
+
+static void resync(int cabin)
+{
+    struct shadow last = shadows[cabin];
+
+    shadows[cabin].motor = shadows[cabin].door = shadows[cabin].scale = SHADOW_UNKNOWN;
+
+    if (last.motor != SHADOW_UNKNOWN)
+        queue_command('m', cabin, last.motor);
+    if (last.door != SHADOW_UNKNOWN)
+        queue_command('d', cabin, last.door);
+    if (last.scale != SHADOW_UNKNOWN)
+        queue_command('s', cabin, last.scale);
+}
+
+void output_resync(int cabin)
+{
+    int i;
+
+    pthread_mutex_lock(&output_mutex);
+
+    if (cabin > 0 && cabin < num_indicators)
+        resync(cabin);
+    else if (cabin == 0)
+        for (i = 1; i < num_indicators; i++)
+            resync(i);
+
+    pthread_mutex_unlock(&output_mutex);
+}
+
+/* Highest class ready to send, -1 if none. Holding output_mutex. */
+static int ready(uint64_t t)
+{
+    tokens += (t-refilled)/1e9*OUTPUT_INDICATOR_RATE;
+    if (tokens > OUTPUT_INDICATOR_BURST)
+        tokens = OUTPUT_INDICATOR_BURST;
+    refilled = t;
+
+    if (num_emergency)
+        return OUTPUT_EMERGENCY;
+    if (fifos[OUTPUT_STOP].count)
+        return OUTPUT_STOP;
+    if (fifos[OUTPUT_MOTION].count)
+        return OUTPUT_MOTION;
+    if (fifos[OUTPUT_INDICATOR].count && tokens >= 1.0)
+        return OUTPUT_INDICATOR;
+
+    return -1;
+}
+
+static void send_command(struct command *command)
+{
+    switch (command->type) {
+    case 'm':
+        handleMotor(command->cabin, (MotorAction) command->value);
+        break;
+    case 'd':
+        handleDoor(command->cabin, (DoorAction) command->value);
+        break;
+    case 's':
+        handleScale(command->cabin, command->value);
+        break;
+    case 'w':
+        whereIs(command->cabin);
+        break;
+    case 'v':
+        getSpeed();
+        break;
+    case 'a':
+        assignDestination(command->cabin, HW_DESTINATION_FLOOR(command->value),
+                          HW_DESTINATION_TO(command->value));
+        break;
+    }
+}
+
+static void record(enum output_class class, uint64_t delay)
+{
+    int bucket = 0;
+
+    delay /= 1000;
+    while (bucket < OUTPUT_HISTOGRAM_BUCKETS-1 && delay >= (1ull << bucket))
+        bucket++;
+
+    stats[class].sent++;
+    stats[class].histogram[bucket]++;
+}
+
+/* Take the emergency stop of the lowest cabin, holding output_mutex */
+static struct command pop_emergency()
+{
+    int i;
+    struct command command = { 'm', 0, MotorStop, 0 };
+
+    for (i = 1; i < num_indicators; i++) {
+        if (emergency_queued[i]) {
+            command.cabin = i;
+            command.queued = emergency_queued[i];
+            emergency_queued[i] = 0;
+            num_emergency--;
+            break;
+        }
+    }
+
+    return command;
+}
+
+static void *sender(void *arg)
+{
+    int class;
+    uint64_t t, wait;
+    struct command command;
+    struct timespec until;
+
+    rt_thread(RT_OUTPUT);
+
+    pthread_mutex_lock(&output_mutex);
+
+    while (1) {
+        t = now();
+
+        if ((class = ready(t)) >= 0) {
+            if (class == OUTPUT_EMERGENCY)
+                command = pop_emergency();
+            else
+                command = pop(&fifos[class]);
+
+            if (class == OUTPUT_INDICATOR) {
+                tokens -= 1.0;
+                if (command.cabin >= 0 && command.cabin < num_indicators)
+                    queued_indicator[command.cabin] = 0;
+            }
+
+            record(class, t-command.queued);
+
+            pthread_mutex_unlock(&output_mutex);
+            send_command(&command);
+            pthread_mutex_lock(&output_mutex);
+            continue;
+        }
+
+        /* Only rate limited indicators left, or nothing at all */
+        if (!sending && !fifos[OUTPUT_INDICATOR].count)
+            break;
+
+        if (fifos[OUTPUT_INDICATOR].count) {
+            wait = (uint64_t) ((1.0-tokens)/OUTPUT_INDICATOR_RATE*1e9)+1;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += (until.tv_nsec+wait)/1000000000;
+            until.tv_nsec = (until.tv_nsec+wait)%1000000000;
+            pthread_cond_timedwait(&output_signal, &output_mutex, &until);
+        } else {
+            pthread_cond_wait(&output_signal, &output_mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&output_mutex);
+
+    return ((void*) NULL);
+}
+
+int output_open(int num_cabins)
+{
+    int i;
+
+    for (i = 0; i < OUTPUT_NUM_CLASSES; i++) {
+        fifos[i].size = 16;
+        fifos[i].commands = malloc(fifos[i].size*sizeof(struct command));
+        fifos[i].first = fifos[i].count = 0;
+    }
+
+    num_indicators = num_cabins+1;
+    queued_indicator = calloc(num_indicators, sizeof(char));
+    emergency_queued = calloc(num_indicators, sizeof(uint64_t));
+    halted = calloc(num_indicators, sizeof(char));
+    num_emergency = 0;
+
+    shadows = malloc(num_indicators*sizeof(struct shadow));
+    for (i = 0; i < num_indicators; i++)
+        shadows[i].motor = shadows[i].door = shadows[i].scale = SHADOW_UNKNOWN;
+
+    refilled = now();
+    rt_mutex_init(&output_mutex);
+    pthread_cond_init(&output_signal, NULL);
+
+    sending = 1;
+    if (pthread_create(&sender_thread, NULL, sender, NULL) != 0) {
+        sending = 0;
+        return 1;
+    }
+
+    return 0;
+}
+
+void output_close()
+{
+    pthread_mutex_lock(&output_mutex);
+    if (!sending) {
+        pthread_mutex_unlock(&output_mutex);
+        return;
+    }
+    sending = 0;
+    pthread_cond_signal(&output_signal);
+    pthread_mutex_unlock(&output_mutex);
+
+    pthread_join(sender_thread, NULL);
+}
+
+void output_stats(enum output_class class, struct output_stats *copy)
+{
+    pthread_mutex_lock(&output_mutex);
+    *copy = stats[class];
+    pthread_mutex_unlock(&output_mutex);
+}
+
+uint64_t output_percentile(struct output_stats *stats, double p)
+{
+    int i;
+    uint64_t count = 0;
+
+    if (!stats->sent)
+        return 0;
+
+    for (i = 0; i < OUTPUT_HISTOGRAM_BUCKETS-1; i++) {
+        count += stats->histogram[i];
+        if (count >= p*stats->sent)
+            break;
+    }
+
+    return 1ull << i;
+}
@@ -0,0 +1,334 @@
+/*
+ * Pipelined dispatcher, see include/pipeline.h
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "hardwareAPI.h"
+#include "cabin.h"
+#include "controller.h"
+#include "pipeline.h"
+#include "rt.h"
+
+#define RING_MASK (PIPELINE_RING_SIZE-1)
+
+/* Single producer, single consumer ring of events between two stages */
+struct ring {
+    uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));   /* consumer */
+    uint64_t batches;
+
+    uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE)));   /* producer */
+    uint64_t max_depth;
+
+    /* The consumer sleeps here once it has spun long enough */
+    int waiting __attribute__((aligned(CACHE_LINE_SIZE)));
+    pthread_mutex_t mutex;
+    pthread_cond_t signal;
+
+    struct event events[PIPELINE_RING_SIZE];
+};
+
+/* Rings into the fan-out stage and into each scorer */
+static struct ring *fan_out = NULL;
+static struct ring *scorers[PIPELINE_MAX_SCORERS];
+static pthread_t threads[PIPELINE_MAX_SCORERS+1];
+
+static int num_scorers = 0;
+static int next_scorer = 0;
+static int pipeline_running = 0;
+
+/* Rings are freed on close under it, statistics may be read meanwhile */
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ring *new_ring()
+{
+    struct ring *ring;
+
+    if (posix_memalign((void**) &ring, CACHE_LINE_SIZE, sizeof(struct ring)))
+        return NULL;
+
+    ring->head = ring->tail = 0;
+    ring->batches = ring->max_depth = 0;
+    ring->waiting = 0;
+    rt_mutex_init(&ring->mutex);
+    pthread_cond_init(&ring->signal, NULL);
+
+    return ring;
+}
+
+static void free_ring(struct ring *ring)
+{
+    if (!ring)
+        return;
+
+    pthread_mutex_destroy(&ring->mutex);
+    pthread_cond_destroy(&ring->signal);
+    free(ring);
+}
+
+static void wake(struct ring *ring)
+{
+    pthread_mutex_lock(&ring->mutex);
+    pthread_cond_signal(&ring->signal);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+/* Append an event, waiting for room if the consumer falls behind */
+static void push(struct ring *ring, struct event *event)
+{
+    uint64_t tail = ring->tail;
+
+    while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == PIPELINE_RING_SIZE)
+        sched_yield();
+
+    ring->events[tail & RING_MASK] = *event;
+    __atomic_store_n(&ring->tail, tail+1, __ATOMIC_SEQ_CST);
+
+    if (tail+1 - ring->head > ring->max_depth)
+        __atomic_store_n(&ring->max_depth, tail+1 - ring->head, __ATOMIC_RELAXED);
+
+    /* Pairs with the consumer raising waiting before looking once more */
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST))
+        wake(ring);
+}
+
+/* Wait until there are events, 0 if the pipeline is stopped meanwhile */
+static int wait_ring(struct ring *ring)
+{
+    int spins;
+
+    for (spins = 0; spins < PIPELINE_SPINS; spins++) {
+        if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head)
+            return 1;
+        if (!__atomic_load_n(&pipeline_running, __ATOMIC_RELAXED))
+            return 0;
+
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&ring->mutex);
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == ring->head &&
+           __atomic_load_n(&pipeline_running, __ATOMIC_RELAXED))
+        pthread_cond_wait(&ring->signal, &ring->mutex);
+
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ring->mutex);
+
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head;
+}
+
+/* Take up to PIPELINE_BATCH events, 0 once the pipeline is stopped */
+static int pop_batch(struct ring *ring, struct event *batch)
+{
+    uint64_t head = ring->head;
+    int i, count;
+
+    if (!wait_ring(ring))
+        return 0;
+
+    count = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+    if (count > PIPELINE_BATCH)
+        count = PIPELINE_BATCH;
+
+    for (i = 0; i < count; i++)
+        batch[i] = ring->events[(head+i) & RING_MASK];
+
+    __atomic_store_n(&ring->head, head+count, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->batches, ring->batches+1, __ATOMIC_RELAXED);
+
+    return count;
+}
+
+/* Route a batch at a time, waking each cabin given events once */
+static void *fan_out_stage(void *arg)
+{
+    int i, id, count, num_woken;
+    struct event batch[PIPELINE_BATCH];
+    char *woken = calloc(num_elevators+1, sizeof(char));
+    int *wake_list = malloc(num_elevators*sizeof(int));
+
+    rt_thread(RT_DISPATCHER);
+
+    while ((count = pop_batch(fan_out, batch))) {
+        num_woken = 0;
+
+        for (i = 0; i < count; i++)
+            if ((id = route_event(&batch[i])) && !woken[id]) {
+                woken[id] = 1;
+                wake_list[num_woken++] = id;
+            }
+
+        for (i = 0; i < num_woken; i++) {
+            pthread_cond_signal(&cabins[wake_list[i]]->signal);
+            woken[wake_list[i]] = 0;
+        }
+
+        /* Room may have been made, events keep coming while cabins move */
+        if (num_backlog || __atomic_load_n(&num_held_calls, __ATOMIC_RELAXED))
+            dispatch_backlog();
+    }
+
+    free(woken);
+    free(wake_list);
+
+    return NULL;
+}
+
+static void *scorer_stage(void *arg)
+{
+    struct ring *ring = arg;
+    struct event batch[PIPELINE_BATCH];
+    int i, count;
+
+    rt_thread(RT_DISPATCHER);
+
+    while ((count = pop_batch(ring, batch)))
+        for (i = 0; i < count; i++)
+            dispatch_floor_button(&batch[i]);
+
+    return NULL;
+}
+
+/* Free the rings of the fan-out stage and of count scorers */
+static void free_rings(int count)
+{
+    int i;
+
+    pthread_mutex_lock(&rings_mutex);
+
+    for (i = 0; i < count; i++) {
+        free_ring(scorers[i]);
+        scorers[i] = NULL;
+    }
+    free_ring(fan_out);
+    fan_out = NULL;
+
+    num_scorers = 0;
+    next_scorer = 0;
+
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+int pipeline_open(int count)
+{
+    int i;
+
+    if (count < 1 || count > PIPELINE_MAX_SCORERS)
+        return -1;
+
+    if ((fan_out = new_ring()) == NULL)
+        return -1;
+
+    for (i = 0; i < count; i++)
+        if ((scorers[i] = new_ring()) == NULL)
+            goto fail;
+
+    pipeline_running = 1;
+
+    for (i = 0; i < count; i++) {
+        if (pthread_create(&threads[i+1], NULL, scorer_stage, scorers[i]))
+            goto fail;
+        num_scorers++;
+    }
+
+    if (pthread_create(&threads[0], NULL, fan_out_stage, NULL))
+        goto fail;
+
+    return 0;
+
+fail:
+    /* Nothing was pushed yet, the scorers started return once woken */
+    __atomic_store_n(&pipeline_running, 0, __ATOMIC_RELAXED);
+
+    for (i = 0; i < num_scorers; i++) {
+        wake(scorers[i]);
+        pthread_join(threads[i+1], NULL);
+    }
+
+    free_rings(count);
+
+    return -1;
+}
+
+void pipeline_close()
+{
+    int i;
+
+    if (!__atomic_load_n(&pipeline_running, __ATOMIC_RELAXED))
+        return;
+
+    __atomic_store_n(&pipeline_running, 0, __ATOMIC_RELAXED);
+
+    wake(fan_out);
+    pthread_join(threads[0], NULL);
+
+    for (i = 0; i < num_scorers; i++) {
+        wake(scorers[i]);
+        pthread_join(threads[i+1], NULL);
+    }
+
+    free_rings(num_scorers);
+}
+
+int pipeline_read(struct event *event)
+{
+    if (!__atomic_load_n(&pipeline_running, __ATOMIC_RELAXED))
+        return 1;
+
+    push(fan_out, event);
+
+    return 0;
+}
+
+int pipeline_score(struct event *event)
+{
+    if (!__atomic_load_n(&pipeline_running, __ATOMIC_RELAXED))
+        return 1;
+
+    push(scorers[next_scorer], event);
+    next_scorer = (next_scorer+1) % num_scorers;
+
+    return 0;
+}
+
+int pipeline_count()
+{
+    return __atomic_load_n(&pipeline_running, __ATOMIC_RELAXED) ? num_scorers+1 : 0;
+}
+
+void pipeline_stats(int stage, struct pipeline_stats *stats)
+{
+    struct ring *ring;
+    uint64_t head;
+
+    pthread_mutex_lock(&rings_mutex);
+
+    /* Closed meanwhile */
+    if (!(ring = stage ? scorers[stage-1] : fan_out)) {
+        pthread_mutex_unlock(&rings_mutex);
+        memset(stats, 0, sizeof(struct pipeline_stats));
+        return;
+    }
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    stats->events = head;
+    stats->batches = __atomic_load_n(&ring->batches, __ATOMIC_RELAXED);
+    stats->depth = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) - head;
+    stats->max_depth = __atomic_load_n(&ring->max_depth, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&rings_mutex);
+}
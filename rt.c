@@ -0,0 +1,264 @@
+/*
+ * Real-time scheduling, see include/rt.h
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/capability.h>
+
+#include "rt.h"
+
+static int mode = RT_OFF;
+static int priorities[RT_NUM_ROLES];
+static int locked = 0;
+static int threads = 0;
+
+/* Late wake-ups, by every elevator thread */
+static uint64_t samples = 0;
+static uint64_t max_us = 0;
+static uint64_t buckets[RT_JITTER_BUCKETS];
+
+int rt_parse(const char *list)
+{
+    int i, priority = 0;
+    const char *curr = list;
+    char *end;
+
+    for (i = 0; i < RT_NUM_ROLES; i++) {
+        if (*curr) {
+            priority = strtol(curr, &end, 10);
+            if (end == curr || priority < sched_get_priority_min(SCHED_FIFO) ||
+                    priority > sched_get_priority_max(SCHED_FIFO))
+                return -1;
+
+            if (*end == ',' && end[1])
+                end++;
+            else if (*end)
+                return -1;
+
+            curr = end;
+        }
+
+        priorities[i] = priority;
+    }
+
+    return *curr ? -1 : 0;
+}
+
+/* Fault in the stack below the caller, ahead of needing it */
+static void __attribute__((noinline)) prefault_stack()
+{
+    char stack[RT_PREFAULT_STACK];
+
+    memset(stack, 0, sizeof(stack));
+    __asm__ volatile("" : : "r" (stack) : "memory");
+}
+
+/* Whether the limit on locked memory does not apply */
+static int may_lock_all()
+{
+    struct __user_cap_header_struct header = { _LINUX_CAPABILITY_VERSION_3, 0 };
+    struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+
+    if (syscall(SYS_capget, &header, data))
+        return 0;
+
+    return !!(data[CAP_TO_INDEX(CAP_IPC_LOCK)].effective & CAP_TO_MASK(CAP_IPC_LOCK));
+}
+
+/*
+ * Everything mapped from here on is locked as well, mappings fail once over
+ * the limit, so only if it does not apply or may be lifted
+ */
+static int lock_memory()
+{
+    struct rlimit limit;
+
+    getrlimit(RLIMIT_MEMLOCK, &limit);
+
+    if (limit.rlim_cur != RLIM_INFINITY && !may_lock_all()) {
+        limit.rlim_cur = limit.rlim_max = RLIM_INFINITY;
+
+        if (setrlimit(RLIMIT_MEMLOCK, &limit)) {
+            getrlimit(RLIMIT_MEMLOCK, &limit);
+            fprintf(stderr, "Cannot lock memory: limited to %llu KiB\n",
+                    (unsigned long long) limit.rlim_cur/1024);
+            return 0;
+        }
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        fprintf(stderr, "Cannot lock memory: %s\n", strerror(errno));
+        return 0;
+    }
+
+    return 1;
+}
+
+int rt_open()
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+    char *heap;
+    int error;
+
+    /*
+     * Tried on this thread first, it dispatches once everything is started.
+     * Without the privileges nothing else is changed, memory and stacks are
+     * left as without '-R'.
+     */
+    param.sched_priority = priorities[RT_DISPATCHER];
+    error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+    if (error) {
+        fprintf(stderr, "Cannot run real-time: %s, using the default scheduler\n",
+                strerror(error));
+        mode = RT_FALLBACK;
+        return -1;
+    }
+
+    /* Threads started meanwhile inherit the default scheduler */
+    param.sched_priority = 0;
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    mode = RT_FIFO;
+
+    /* Stacks of the threads started from here on are locked in full */
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+    pthread_setattr_default_np(&attr);
+    pthread_attr_destroy(&attr);
+
+    /* Freed memory stays in the heap, faulted in and locked */
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    locked = lock_memory();
+
+    if ((heap = malloc(RT_PREFAULT_HEAP)) != NULL) {
+        memset(heap, 0, RT_PREFAULT_HEAP);
+        free(heap);
+    }
+    prefault_stack();
+
+    return 0;
+}
+
+void rt_close()
+{
+    if (locked)
+        munlockall();
+    locked = 0;
+}
+
+void rt_thread(enum rt_role role)
+{
+    struct sched_param param;
+    int error;
+
+    if (mode != RT_FIFO)
+        return;
+
+    prefault_stack();
+
+    param.sched_priority = priorities[role];
+    if ((error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)))
+        fprintf(stderr, "Cannot run thread real-time: %s\n", strerror(error));
+    else
+        __atomic_add_fetch(&threads, 1, __ATOMIC_RELAXED);
+}
+
+void rt_mutex_init(pthread_mutex_t *mutex)
+{
+    pthread_mutexattr_t attr;
+
+    if (mode != RT_FIFO) {
+        pthread_mutex_init(mutex, NULL);
+        return;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* How long after deadline it is now, us, negative if before */
+static int64_t since(const struct timespec *deadline)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((int64_t) (now.tv_sec-deadline->tv_sec)*1000000000 +
+            now.tv_nsec-deadline->tv_nsec)/1000;
+}
+
+/* Count a wake-up late by late us */
+static void count_late(int64_t late)
+{
+    uint64_t max;
+    int bucket;
+
+    if (late < 0)
+        late = 0;
+
+    bucket = late ? 64-__builtin_clzll(late) : 0;
+    if (bucket >= RT_JITTER_BUCKETS)
+        bucket = RT_JITTER_BUCKETS-1;
+
+    __atomic_add_fetch(&buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&samples, 1, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&max_us, __ATOMIC_RELAXED);
+    while ((uint64_t) late > max &&
+           !__atomic_compare_exchange_n(&max_us, &max, late, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+int rt_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                 const struct timespec *deadline)
+{
+    int error;
+
+    /* Unless passed already, there is no wake-up to be late for then */
+    if (mode == RT_OFF || since(deadline) >= 0)
+        return pthread_cond_timedwait(cond, mutex, deadline);
+
+    if ((error = pthread_cond_timedwait(cond, mutex, deadline)) == ETIMEDOUT)
+        count_late(since(deadline));
+
+    return error;
+}
+
+void rt_stats(struct rt_stats *stats)
+{
+    int i;
+
+    stats->mode = mode;
+    memcpy(stats->priorities, priorities, sizeof(priorities));
+    stats->locked = locked;
+    stats->threads = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+
+    stats->samples = __atomic_load_n(&samples, __ATOMIC_RELAXED);
+    stats->max_us = __atomic_load_n(&max_us, __ATOMIC_RELAXED);
+    for (i = 0; i < RT_JITTER_BUCKETS; i++)
+        stats->buckets[i] = __atomic_load_n(&buckets[i], __ATOMIC_RELAXED);
+}
@@ -52,8 +52,7 @@ java -jar $bin_elevator -tcp $elevators_arg_gui $top_floor_arg &
 gui_pid=$!
 echo "PID = $gui_pid"
 
-sleep 2
-
+# No need to wait for the GUI, the controller retries until it accepts
 ps -p $gui_pid > /dev/null 2>&1
 if [ $? != 0 ]; then
 	echo ''
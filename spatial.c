@@ -0,0 +1,181 @@
+/*
+ * Spatial index of cabins for dispatch, see include/spatial.h
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "hardwareAPI.h"
+#include "cabin.h"
+#include "controller.h"
+#include "spatial.h"
+
+/* Bitmaps of cabins, num_words per floor band and per reach */
+static uint64_t *floor_maps = NULL;
+static uint64_t *reach_maps = NULL;
+static int num_words;
+
+static int index_cabins;
+static int index_floors;
+static int num_indexed;
+
+/* Where each cabin is indexed, -1 if not, owned by its elevator thread */
+static int *cabin_floor = NULL;
+static int *cabin_reach = NULL;
+
+int spatial_open(int num_cabins, int num_floors)
+{
+    int i;
+
+    num_words = (num_cabins+1 + 63)/64;
+    index_cabins = num_cabins;
+    index_floors = num_floors;
+    num_indexed = 0;
+
+    floor_maps = calloc(num_floors*num_words, sizeof(uint64_t));
+    reach_maps = calloc(num_floors*num_words, sizeof(uint64_t));
+    cabin_floor = malloc((num_cabins+1)*sizeof(int));
+    cabin_reach = malloc((num_cabins+1)*sizeof(int));
+
+    if (!floor_maps || !reach_maps || !cabin_floor || !cabin_reach) {
+        spatial_close();
+        return -1;
+    }
+
+    for (i = 0; i <= num_cabins; i++)
+        cabin_floor[i] = cabin_reach[i] = -1;
+
+    return 0;
+}
+
+void spatial_close()
+{
+    free(floor_maps);
+    free(reach_maps);
+    free(cabin_floor);
+    free(cabin_reach);
+
+    floor_maps = reach_maps = NULL;
+    cabin_floor = cabin_reach = NULL;
+}
+
+static void set_bit(uint64_t *map, int id)
+{
+    __atomic_fetch_or(&map[id/64], 1ull << (id%64), __ATOMIC_RELEASE);
+}
+
+static void clear_bit(uint64_t *map, int id)
+{
+    __atomic_fetch_and(&map[id/64], ~(1ull << (id%64)), __ATOMIC_RELEASE);
+}
+
+void spatial_update(int id, int position, stop_queue *queue)
+{
+    int floor, reach;
+
+    if (!floor_maps)
+        return;
+
+    floor = position_floor(position);
+    if (floor < 0)
+        floor = 0;
+    if (floor >= index_floors)
+        floor = index_floors-1;
+
+    reach = queue->first ? abs(floor - queue->first->floor) : -1;
+    if (reach >= index_floors)
+        reach = index_floors-1;
+
+    if (floor == cabin_floor[id] && reach == cabin_reach[id])
+        return;
+
+    /* Into the new bands before out of the old, a search never misses it */
+    set_bit(&floor_maps[floor*num_words], id);
+    if (reach >= 0)
+        set_bit(&reach_maps[reach*num_words], id);
+
+    if (cabin_floor[id] < 0)
+        __atomic_add_fetch(&num_indexed, 1, __ATOMIC_RELEASE);
+    else if (cabin_floor[id] != floor)
+        clear_bit(&floor_maps[cabin_floor[id]*num_words], id);
+
+    if (cabin_reach[id] >= 0 && cabin_reach[id] != reach)
+        clear_bit(&reach_maps[cabin_reach[id]*num_words], id);
+
+    cabin_floor[id] = floor;
+    cabin_reach[id] = reach;
+}
+
+/* Score the available cabins first to last of a band, keep the best */
+static void rank(uint64_t *map, int first, int last, FloorButtonPressDesc *floor_button,
+                 int *best, int *best_score)
+{
+    int w, id, score;
+    uint64_t bits;
+
+    for (w = first/64; w <= last/64; w++) {
+        bits = __atomic_load_n(&map[w], __ATOMIC_ACQUIRE);
+
+        if (w == first/64)
+            bits &= ~0ull << (first%64);
+        if (w == last/64 && last%64 != 63)
+            bits &= (1ull << (last%64+1)) - 1;
+
+        for (; bits; bits &= bits-1) {
+            id = w*64 + __builtin_ctzll(bits);
+
+            if (!cabin_available(cabins[id]))
+                continue;
+
+            score = hall_call_score(floor_button, id);
+
+            if (!*best || score < *best_score || (score == *best_score && id < *best)) {
+                *best = id;
+                *best_score = score;
+            }
+        }
+    }
+}
+
+int spatial_search(FloorButtonPressDesc *floor_button, int first, int last, int *score)
+{
+    int r, near, busy;
+    int best = 0, best_score = 0;
+    int floor = floor_button->floor;
+    int wd, ws;
+
+    score_bound(&wd, &ws);
+
+    if (!floor_maps || __atomic_load_n(&num_indexed, __ATOMIC_ACQUIRE) < index_cabins ||
+            wd < 0 || ws < 0 || floor < 0 || floor >= index_floors)
+        return 0;
+
+    /* Widen by a floor at a time until the bound rules out the rest, which
+       is half a floor closer for a cabin between floors */
+    for (r = 0; r < index_floors; r++) {
+        near = best && wd*(2*r-1) > 2*best_score;
+        busy = best && 2*ws + wd*(2*r-1) > 2*best_score;
+
+        if (near && busy)
+            break;
+
+        if (!near) {
+            if (floor-r >= 0)
+                rank(&floor_maps[(floor-r)*num_words], first, last, floor_button,
+                     &best, &best_score);
+            if (r && floor+r < index_floors)
+                rank(&floor_maps[(floor+r)*num_words], first, last, floor_button,
+                     &best, &best_score);
+        }
+
+        if (!busy)
+            rank(&reach_maps[r*num_words], first, last, floor_button, &best, &best_score);
+    }
+
+    *score = best_score;
+
+    return best;
+}
@@ -0,0 +1,230 @@
+/*
+ * Hall call stealing, see include/steal.h
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hardwareAPI.h"
+#include "cabin.h"
+#include "controller.h"
+#include "group.h"
+#include "steal.h"
+#include "log.h"
+
+/* Owner of a slot in the low half of the word, changes in the high half */
+#define OWNER(word) ((int) ((word) & 0xffffffff))
+#define HANDED(word, id) ((((word) >> 32) + 1) << 32 | (uint32_t) (id))
+
+/* A floor and direction, each on a cache line of its own */
+struct steal_call {
+    uint64_t word;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Published once open, elevator threads are running by then */
+static struct steal_call *calls = NULL;
+static int steal_floors;
+
+/* Per cabin, indexed by id */
+static struct steal_stats *stats = NULL;
+
+/* Board slot of a floor and direction, NULL if off the board */
+static struct steal_call *slot(int floor, FloorButtonType type)
+{
+    if (!steal_enabled() || floor < 0 || floor >= steal_floors)
+        return NULL;
+
+    return &calls[floor*2 + (type == GoingDown)];
+}
+
+int steal_open(int num_floors, int num_cabins)
+{
+    struct steal_call *board;
+
+    /* Passengers were told which cabin to board */
+    if (destination)
+        return 0;
+
+    if (posix_memalign((void**) &board, CACHE_LINE_SIZE,
+                       num_floors*2*sizeof(struct steal_call)))
+        return -1;
+
+    stats = calloc(num_cabins+1, sizeof(struct steal_stats));
+    if (!stats) {
+        free(board);
+        return -1;
+    }
+
+    memset(board, 0, num_floors*2*sizeof(struct steal_call));
+    steal_floors = num_floors;
+
+    __atomic_store_n(&calls, board, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void steal_close()
+{
+    free(calls);
+    free(stats);
+    calls = NULL;
+    stats = NULL;
+}
+
+int steal_enabled()
+{
+    return __atomic_load_n(&calls, __ATOMIC_ACQUIRE) != NULL;
+}
+
+void steal_post(int id, FloorButtonPressDesc *call)
+{
+    struct steal_call *c = slot(call->floor, call->type);
+    uint64_t word;
+
+    if (!c)
+        return;
+
+    word = __atomic_load_n(&c->word, __ATOMIC_RELAXED);
+    while (OWNER(word) != id &&
+           !__atomic_compare_exchange_n(&c->word, &word, HANDED(word, id), 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+void steal_served(int id, FloorButtonPressDesc *call)
+{
+    struct steal_call *c = slot(call->floor, call->type);
+    uint64_t word;
+
+    if (!c)
+        return;
+
+    /* Unless claimed meanwhile, the thief then stops there too */
+    word = __atomic_load_n(&c->word, __ATOMIC_RELAXED);
+    if (OWNER(word) == id)
+        __atomic_compare_exchange_n(&c->word, &word, HANDED(word, 0), 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/* Tell the owner of a call it was claimed, as emergency_stop() does */
+static void notify(int owner)
+{
+    struct cabin *cabin = cabins[owner];
+
+    __atomic_add_fetch(&stats[owner].lost, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cabin->calls_stolen, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&cabin->event_buffer_mutex);
+    pthread_cond_signal(&cabin->signal);
+    pthread_mutex_unlock(&cabin->event_buffer_mutex);
+}
+
+/*
+ * Whether a cabin may take a call: it is idle, or the call is ahead of it and
+ * for the direction it is going. Not at the floor it is at, doors reopened
+ * right after closing are not told apart from closing by the position reports.
+ */
+static int on_the_way(struct cabin *cabin, FloorButtonPressDesc *call)
+{
+    int direction = __atomic_load_n(&cabin->info.direction, __ATOMIC_RELAXED);
+    int ahead = FLOOR_POSITION(call->floor) - cabin->info.position;
+
+    if (abs(ahead) <= HW_POSITION_SCALE/2)
+        return 0;
+
+    if (!direction)
+        return !cabin->info.queue->size;
+
+    return (int) call->type == direction && ahead*direction > 0;
+}
+
+int steal_scan(int id)
+{
+    int i, owner, mine, theirs, per_floor, per_stop, claimed = 0;
+    uint64_t word;
+    FloorButtonPressDesc call;
+    struct cabin *cabin = cabins[id];
+
+    if (!steal_enabled() || !cabin_available(cabin) ||
+            __atomic_load_n(&cabin->emergency, __ATOMIC_ACQUIRE))
+        return 0;
+
+    score_weights(&per_floor, &per_stop);
+
+    for (i = 0; i < steal_floors*2; i++) {
+        word = __atomic_load_n(&calls[i].word, __ATOMIC_ACQUIRE);
+        owner = OWNER(word);
+
+        if (!owner || owner == id || group_of(owner) != group_of(id))
+            continue;
+
+        call.floor = i/2;
+        call.type = i%2 ? GoingDown : GoingUp;
+
+        if (!on_the_way(cabin, &call))
+            continue;
+
+        /* The owner is scored as if stopping once more, for the call itself */
+        mine = hall_call_score(&call, id);
+        theirs = hall_call_score(&call, owner) - per_stop;
+
+        if (theirs - mine <= STEAL_MARGIN*per_stop)
+            continue;
+
+        if (!__atomic_compare_exchange_n(&calls[i].word, &word, HANDED(word, id), 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            continue;
+
+        push_stop_queue(call.floor, (int) call.type, cabin->info.position, &cabin->info);
+
+        log_msg(LOG_INFO, LOG_STEAL, id, call.floor, (int) call.type, owner, mine, theirs);
+
+        __atomic_add_fetch(&stats[id].claimed, 1, __ATOMIC_RELAXED);
+        notify(owner);
+        claimed++;
+    }
+
+    return claimed;
+}
+
+void steal_drop(int id)
+{
+    stop_queue *queue = cabins[id]->info.queue;
+    node_stop_queue *stop, *next;
+    FloorButtonPressDesc call;
+    struct steal_call *c;
+
+    /* Earlier stops for the same call are gone already, so it is this one */
+    for (stop = queue->first; stop; stop = next) {
+        next = stop->next;
+
+        if (!stop->direction)
+            continue;
+
+        call.floor = stop->floor;
+        call.type = (FloorButtonType) stop->direction;
+
+        c = slot(call.floor, call.type);
+        if (c && OWNER(__atomic_load_n(&c->word, __ATOMIC_ACQUIRE)) != id)
+            remove_stop_queue(queue, call.floor, (int) call.type);
+    }
+}
+
+void steal_stats(int id, struct steal_stats *copy)
+{
+    if (!stats) {
+        copy->claimed = copy->lost = 0;
+        return;
+    }
+
+    copy->claimed = __atomic_load_n(&stats[id].claimed, __ATOMIC_RELAXED);
+    copy->lost = __atomic_load_n(&stats[id].lost, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,184 @@
+/*
+ * Live telemetry in shared memory
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "telemetry.h"
+
+static struct telemetry_header *telemetry = NULL;
+static const char *telemetry_name;
+
+int telemetry_open(const char *name, int num_cabins, int num_floors)
+{
+    int fd;
+    uint32_t size = telemetry_size(num_cabins, num_floors);
+    struct telemetry_header *header;
+
+    if ((fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644)) < 0)
+        return 1;
+
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return 1;
+    }
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (header == MAP_FAILED) {
+        shm_unlink(name);
+        return 1;
+    }
+
+    memset(header, 0, size);
+    header->version = TELEMETRY_VERSION;
+    header->size = size;
+    header->num_cabins = num_cabins;
+    header->num_floors = num_floors;
+
+    /* Readers check magic last, the layout is complete once it is set */
+    __atomic_store_n(&header->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+
+    telemetry_name = name;
+    telemetry = header;
+
+    return 0;
+}
+
+void telemetry_close()
+{
+    if (!telemetry)
+        return;
+
+    munmap(telemetry, telemetry->size);
+    shm_unlink(telemetry_name);
+    telemetry = NULL;
+}
+
+void telemetry_cabin(int id, int position, int direction, int door_state,
+                     stop_queue *queue)
+{
+    int i;
+    node_stop_queue *stop;
+    struct telemetry_cabin *cabin;
+
+    if (!telemetry)
+        return;
+
+    cabin = &telemetry_cabins(telemetry)[id-1];
+
+    seqlock_write_begin(&cabin->seq);
+
+    cabin->position = (double) position/HW_POSITION_SCALE;
+    cabin->direction = direction;
+    cabin->door_state = door_state;
+    cabin->num_stops = queue->size;
+
+    for (i = 0, stop = queue->first; i < TELEMETRY_MAX_STOPS && stop; i++, stop = stop->next)
+        cabin->stops[i] = stop->floor;
+
+    seqlock_write_end(&cabin->seq);
+}
+
+void telemetry_count(int id, enum telemetry_counter counter)
+{
+    struct telemetry_cabin *cabin;
+    uint64_t *value;
+
+    if (!telemetry)
+        return;
+
+    cabin = &telemetry_cabins(telemetry)[id-1];
+
+    switch (counter) {
+    case TELEMETRY_STOPS:
+        value = &cabin->stops_served;
+        break;
+    case TELEMETRY_MOTOR:
+        value = &cabin->motor_commands;
+        break;
+    case TELEMETRY_CONFLATED:
+        value = &cabin->conflated;
+        break;
+    case TELEMETRY_MERGED:
+        value = &cabin->merged;
+        break;
+    case TELEMETRY_SHED:
+        value = &cabin->shed;
+        break;
+    case TELEMETRY_SATURATED:
+        value = &cabin->saturated;
+        break;
+    default:
+        value = &cabin->door_commands;
+    }
+
+    __atomic_fetch_add(value, 1, __ATOMIC_RELAXED);
+}
+
+void telemetry_events(int id, int queue_depth, int enqueued)
+{
+    struct telemetry_cabin *cabin;
+
+    if (!telemetry)
+        return;
+
+    cabin = &telemetry_cabins(telemetry)[id-1];
+
+    __atomic_store_n(&cabin->queue_depth, queue_depth, __ATOMIC_RELAXED);
+    if (enqueued)
+        __atomic_fetch_add(&cabin->events, enqueued, __ATOMIC_RELAXED);
+}
+
+int telemetry_read_cabin(int id, struct telemetry_cabin *copy)
+{
+    uint32_t seq;
+    struct telemetry_cabin *cabin;
+
+    if (!telemetry)
+        return 1;
+
+    cabin = &telemetry_cabins(telemetry)[id-1];
+
+    do {
+        seq = seqlock_read_begin(&cabin->seq);
+        memcpy(copy, cabin, sizeof(struct telemetry_cabin));
+    } while (seqlock_read_retry(&cabin->seq, seq));
+
+    return 0;
+}
+
+void telemetry_hall_call(int floor, FloorButtonType type)
+{
+    uint8_t bit = type == GoingUp ? TELEMETRY_HALL_UP : TELEMETRY_HALL_DOWN;
+
+    if (!telemetry || floor < 0 || floor >= telemetry->num_floors)
+        return;
+
+    __atomic_fetch_add(&telemetry->hall_calls, 1, __ATOMIC_RELAXED);
+
+    if (!(__atomic_fetch_or(&telemetry_hall(telemetry)[floor], bit, __ATOMIC_RELAXED) & bit))
+        __atomic_fetch_add(&telemetry->hall_call_backlog, 1, __ATOMIC_RELAXED);
+}
+
+void telemetry_floor_served(int floor, int direction)
+{
+    uint8_t bit = direction == GoingUp ? TELEMETRY_HALL_UP : TELEMETRY_HALL_DOWN;
+
+    /* Cabin calls light no hall button */
+    if (!telemetry || !direction || floor < 0 || floor >= telemetry->num_floors)
+        return;
+
+    if (__atomic_fetch_and(&telemetry_hall(telemetry)[floor], (uint8_t) ~bit,
+                           __ATOMIC_RELAXED) & bit)
+        __atomic_fetch_sub(&telemetry->hall_call_backlog, 1, __ATOMIC_RELAXED);
+}
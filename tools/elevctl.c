@@ -0,0 +1,63 @@
+/*
+ * Client for the controllers control socket
+ *
+ * Usage: elevctl <socket> <command ...>
+ *
+ * Sends the command, prints the reply and exits with 1 if it was an error.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+
+int main(int argc, char **argv)
+{
+    int i, fd, len = 0;
+    char line[CONTROL_LINE_SIZE];
+    struct sockaddr_un addr;
+    FILE *in;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <socket> <command ...>\n", argv[0]);
+        exit(1);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path)-1);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        perror(argv[1]);
+        exit(1);
+    }
+
+    /* Join the arguments to a single command line */
+    for (i = 2; i < argc && len < sizeof(line)-1; i++)
+        len += snprintf(line+len, sizeof(line)-len, i < argc-1 ? "%s " : "%s\n", argv[i]);
+
+    if (len >= sizeof(line) || write(fd, line, len) != len) {
+        fprintf(stderr, "Cannot send command\n");
+        exit(1);
+    }
+
+    in = fdopen(fd, "r");
+    while (fgets(line, sizeof(line), in)) {
+        fputs(line, stdout);
+
+        if (!strcmp(line, "ok\n"))
+            exit(0);
+        if (!strncmp(line, "error", 5))
+            exit(1);
+    }
+
+    exit(1);
+}
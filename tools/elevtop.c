@@ -0,0 +1,108 @@
+/*
+ * top-like viewer of the controllers shared memory telemetry
+ *
+ * Usage: elevtop [name] [interval ms]
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "telemetry.h"
+
+static const char *direction_name(int direction)
+{
+    return direction > 0 ? "up" : (direction < 0 ? "down" : "-");
+}
+
+static const char *door_name(int state)
+{
+    return state == DoorOpen ? "open" : (state == DoorClose ? "closed" : "moving");
+}
+
+int main(int argc, char **argv)
+{
+    int i, j, fd;
+    const char *name = TELEMETRY_DEFAULT_NAME;
+    int interval = 200;
+    struct stat st;
+    struct telemetry_header *header;
+    struct telemetry_cabin *cabins, cabin;
+    uint8_t *hall;
+    uint32_t seq;
+
+    if (argc > 1)
+        name = argv[1];
+    if (argc > 2)
+        interval = atoi(argv[2]);
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0 || fstat(fd, &st) < 0) {
+        perror(name);
+        exit(1);
+    }
+
+    header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (header == MAP_FAILED ||
+            __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC ||
+            header->version != TELEMETRY_VERSION || header->size > st.st_size) {
+        fprintf(stderr, "%s: no telemetry of version %d\n", name, TELEMETRY_VERSION);
+        exit(1);
+    }
+
+    cabins = telemetry_cabins(header);
+    hall = telemetry_hall(header);
+
+    while (1) {
+        /* Clear screen and home cursor */
+        printf("\033[H\033[J");
+        printf("%s: %d cabins, %d floors, hall call backlog %d (%llu total)\n\n",
+               name, header->num_cabins, header->num_floors,
+               __atomic_load_n(&header->hall_call_backlog, __ATOMIC_RELAXED),
+               (unsigned long long) __atomic_load_n(&header->hall_calls, __ATOMIC_RELAXED));
+
+        printf("%5s %9s %5s %7s %6s %6s %6s %8s %8s %8s  %s\n", "cabin", "position",
+               "dir", "door", "queue", "shed", "stops", "served", "motor", "door cmd",
+               "plan");
+
+        for (i = 0; i < header->num_cabins; i++) {
+            do {
+                seq = seqlock_read_begin(&cabins[i].seq);
+                memcpy(&cabin, &cabins[i], sizeof(cabin));
+            } while (seqlock_read_retry(&cabins[i].seq, seq));
+
+            printf("%5d %9.3f %5s %7s %6d %6llu %6d %8llu %8llu %8llu  ", i+1,
+                   cabin.position, direction_name(cabin.direction),
+                   door_name(cabin.door_state), cabin.queue_depth,
+                   (unsigned long long) cabin.shed, cabin.num_stops,
+                   (unsigned long long) cabin.stops_served,
+                   (unsigned long long) cabin.motor_commands,
+                   (unsigned long long) cabin.door_commands);
+
+            for (j = 0; j < cabin.num_stops && j < TELEMETRY_MAX_STOPS; j++)
+                printf("%d ", cabin.stops[j]);
+            printf("\n");
+        }
+
+        printf("\nhall calls:");
+        for (i = 0; i < header->num_floors; i++) {
+            if (hall[i])
+                printf(" %d%s%s", i, hall[i] & TELEMETRY_HALL_UP ? "^" : "",
+                       hall[i] & TELEMETRY_HALL_DOWN ? "v" : "");
+        }
+        printf("\n");
+
+        fflush(stdout);
+        usleep(interval*1000);
+    }
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Offline decoder of binary controller logs
+ *
+ * Usage: logdecode <file> [level]
+ *
+ * Prints every record of the log, or only those of at most the given level.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "log.h"
+
+int main(int argc, char **argv)
+{
+    FILE *in;
+    struct log_header header;
+    struct log_record record;
+    int level = LOG_DEBUG;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <file> [level]\n", argv[0]);
+        exit(1);
+    }
+
+    if (argc > 2)
+        level = atoi(argv[2]);
+
+    if ((in = fopen(argv[1], "rb")) == NULL) {
+        perror(argv[1]);
+        exit(1);
+    }
+
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != LOG_MAGIC) {
+        fprintf(stderr, "%s: not a controller log\n", argv[1]);
+        exit(1);
+    }
+
+    if (header.version != LOG_VERSION || header.record_size != sizeof(record)) {
+        fprintf(stderr, "%s: log version %u not supported\n", argv[1], header.version);
+        exit(1);
+    }
+
+    /* Formats appended since this decoder was built are unknown to it */
+    if (header.num_formats > LOG_NUM_FORMATS) {
+        fprintf(stderr, "%s: %u formats, only %d known, decoder too old\n", argv[1],
+                header.num_formats, LOG_NUM_FORMATS);
+        exit(1);
+    }
+
+    while (fread(&record, sizeof(record), 1, in) == 1) {
+        if (record.level <= level)
+            log_decode(stdout, &record);
+    }
+
+    fclose(in);
+
+    return 0;
+}
@@ -0,0 +1,785 @@
+/*
+ * Stand-in for the Java elevator simulator
+ *
+ * Speaks the same tcp protocol as 'java -jar elevator.jar -tcp', including
+ * the optional binary framing, without a GUI. Cabins move and doors open and
+ * close the way the Java simulator animates them, reporting positions on
+ * every time step.
+ *
+ * Passengers arrive at random floors, press the hall button, board the first
+ * cabin opening its doors there, press the cabin button of their destination
+ * and leave at it. Once all of them are delivered, or the duration has
+ * passed, statistics are printed and the connection is closed.
+ *
+ * If the controller asks for destination dispatch passengers instead report
+ * their floor and destination, and board the cabin they are assigned.
+ *
+ * Usage: simulator [-p port] [-e cabins] [-f floors] [-t tick ms]
+ *                  [-n passengers] [-r passengers/s] [-d seconds] [-s seed]
+ *                  [-u share arriving at the ground floor]
+ *                  [-o share leaving for the ground floor] [-c capacity]
+ *                  [-k emergency stops/s] [-a restarts] [-x] (no binary framing)
+ *
+ * Emergency stops are pressed in random cabins and released by a cabin call
+ * after ESTOP_HOLD seconds, the time until the motor stop arrives is reported.
+ *
+ * Given '-a' the controller may disconnect and connect again as many times,
+ * cabins and passengers carry on meanwhile and what is sent is lost. Buttons
+ * lit stay lit, as in the Java simulator, the controller has to remember the
+ * calls itself.
+ *
+ * The intervals between cabins arriving at the same floor are reported as
+ * well, their spread shows how bunched the cabins run, as is the spread of
+ * the waits.
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "hardwareAPI.h"
+
+/* Movement per time step, as the Java simulators default precision */
+#define STEP 0.04
+
+/* Door states, closed to fully open */
+#define DOOR_CLOSED 0
+#define DOOR_OPEN   4
+
+/* Cabin is considered at a floor within this distance */
+#define AT_FLOOR 0.05
+
+/* Seconds an emergency stopped cabin is held before a cabin call releases it */
+#define ESTOP_HOLD 2.0
+
+/* Cabin button floor of the emergency stop button */
+#define ESTOP_FLOOR 32000
+
+#define LINE_SIZE 80
+#define IN_SIZE   4096
+#define OUT_SIZE  65536
+
+struct sim_cabin {
+    double position;
+    int motor;
+    int door;                   /* DOOR_CLOSED .. DOOR_OPEN */
+    int door_dir;
+    int scale;
+    int door_was_open;
+    int stayed;                 /* opened its doors since it last moved */
+    int load;                   /* passengers aboard */
+    double estop;               /* time the emergency stop was pressed, or 0 */
+    double estop_release;       /* time to release it, or 0 */
+};
+
+struct passenger {
+    int origin;
+    int destination;
+    int assigned;               /* cabin to take with destination dispatch */
+    int cabin;                  /* 0 while waiting */
+    int done;
+    double arrived;
+    double boarded;
+    double delivered;
+};
+
+/* Settings */
+static int port = 4711;
+static int num_cabins = 1;
+static int num_floors = 6;
+static int tick = 40;
+static int num_passengers = 20;
+static double rate = 1.0;
+static double duration = 120.0;
+static unsigned int seed = 1;
+static int allow_binary = 1;
+static double up_peak = 0.0;
+static double down_peak = 0.0;
+static int capacity = 0;                /* passengers per cabin, 0 unlimited */
+static double estop_rate = 0.0;
+static int restarts = 0;                /* of the controller to accept */
+
+static struct sim_cabin *cabins;
+static struct passenger *passengers;
+static int num_arrived = 0;
+static int num_delivered = 0;
+
+/* Latencies from emergency stop to motor stop, s */
+static double *estops;
+static int num_estops = 0;
+static int size_estops = 0;
+
+/* Time a cabin last arrived at every floor, s, negative before the first */
+static double *arrivals;
+
+/* Intervals between cabins arriving at a floor, s */
+static double *intervals;
+static int num_intervals = 0;
+static int size_intervals = 0;
+
+/* Pending hall calls per floor, bit 1 up and bit 2 down */
+static unsigned char *hall;
+
+/* Cabin buttons pressed, num_cabins x num_floors */
+static unsigned char *pressed;
+
+static int fd = -1;                     /* -1 while the controller is down */
+static int binary = 0;
+static int destination = 0;
+static char in[IN_SIZE];
+static int in_len = 0;
+static char out[OUT_SIZE];
+static int out_len = 0;
+
+/* Message counters indexed by command/event letter */
+static long received[128];
+static long sent[128];
+static long bytes_received = 0;
+static long bytes_sent = 0;
+
+/* Controller restarts accepted and the time it was down, s */
+static int num_restarts = 0;
+static double down_since = 0.0;
+static double down_time = 0.0;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* The controller went away, wait for it to come back */
+static void disconnect()
+{
+    close(fd);
+    fd = -1;
+    out_len = in_len = 0;
+    binary = destination = 0;
+    down_since = now();
+    restarts--;
+}
+
+static void flush_out()
+{
+    int count, done = 0;
+
+    if (fd < 0) {
+        out_len = 0;
+        return;
+    }
+
+    while (done < out_len) {
+        if ((count = write(fd, out+done, out_len-done)) <= 0) {
+            if (restarts > 0) {
+                disconnect();
+                break;
+            }
+
+            perror("write");
+            exit(1);
+        }
+        done += count;
+    }
+
+    bytes_sent += out_len;
+    out_len = 0;
+}
+
+/* Queue an event, positions and speed are given in value_real */
+static void emit(char type, int cabin, int value, double value_real)
+{
+    HWFrame frame;
+
+    if (out_len > OUT_SIZE-LINE_SIZE)
+        flush_out();
+
+    sent[(int) type]++;
+
+    if (binary) {
+        frame.type = type;
+        frame.reserved = 0;
+        frame.cabin = htons(cabin);
+        frame.value = htonl((type == 'f' || type == 'v') ?
+                            (int) lround(value_real*HW_FRAME_SCALE) : value);
+        memcpy(out+out_len, &frame, sizeof(frame));
+        out_len += sizeof(frame);
+        return;
+    }
+
+    switch (type) {
+    case 'f':
+        out_len += sprintf(out+out_len, "f %d %.17g\n", cabin, value_real);
+        break;
+    case 'v':
+        out_len += sprintf(out+out_len, "v %.17g\n", value_real);
+        break;
+    default:
+        out_len += sprintf(out+out_len, "%c %d %d\n", type, cabin, value);
+    }
+}
+
+/*
+ * The next passenger waiting at floor for destination is to take cabin, one
+ * not assigned yet or else one assigned another cabin
+ */
+static void assign(int cabin, int floor, int destination)
+{
+    int i, other = -1;
+    struct passenger *p;
+
+    for (i = 0; i < num_arrived; i++) {
+        p = &passengers[i];
+
+        if (p->cabin || p->origin != floor || p->destination != destination)
+            continue;
+
+        if (!p->assigned) {
+            p->assigned = cabin;
+            return;
+        }
+
+        if (other < 0 && p->assigned != cabin)
+            other = i;
+    }
+
+    if (other >= 0)
+        passengers[other].assigned = cabin;
+}
+
+static void command(char type, int cabin, int value)
+{
+    struct sim_cabin *c = (cabin >= 1 && cabin <= num_cabins) ? &cabins[cabin-1] : NULL;
+
+    received[(int) type & 127]++;
+
+    switch (type) {
+    case 'm':
+        if (c && value >= -1 && value <= 1)
+            c->motor = value;
+
+        if (c && value == 0 && c->estop > 0) {
+            if (num_estops == size_estops) {
+                size_estops = size_estops ? 2*size_estops : 64;
+                estops = realloc(estops, size_estops*sizeof(double));
+            }
+            estops[num_estops++] = now()-c->estop;
+            c->estop = 0;
+        }
+        break;
+    case 'd':
+        if (c && value >= -1 && value <= 1)
+            c->door_dir = value;
+        break;
+    case 's':
+        if (c)
+            c->scale = value;
+        break;
+    case 'w':
+        if (c)
+            emit('f', cabin, 0, c->position);
+        break;
+    case 'v':
+        emit('v', 0, 0, STEP*1000.0/tick);
+        break;
+    case 'a':
+        if (c)
+            assign(cabin, HW_DESTINATION_FLOOR(value), HW_DESTINATION_TO(value));
+        break;
+    case 'q':
+        flush_out();
+        exit(0);
+    default:
+        fprintf(stderr, "simulator: illegal command %c\n", type);
+    }
+}
+
+/* Execute everything complete in the input buffer */
+static void parse_input()
+{
+    HWFrame frame;
+    char *end, line[LINE_SIZE];
+    int used = 0, len, cabin, value, to;
+    char type;
+
+    while (used < in_len) {
+        if (binary) {
+            if (in_len-used < (int) sizeof(frame))
+                break;
+
+            memcpy(&frame, in+used, sizeof(frame));
+            used += sizeof(frame);
+            command(frame.type, ntohs(frame.cabin), (int) ntohl(frame.value));
+            continue;
+        }
+
+        if ((end = memchr(in+used, '\n', in_len-used)) == NULL)
+            break;
+
+        len = end-(in+used)+1;
+        if (len >= LINE_SIZE)
+            len = LINE_SIZE-1;
+        memcpy(line, in+used, len);
+        line[len] = '\0';
+        used = end-in+1;
+
+        /* Answer and switch, everything after is framed */
+        if (!strcmp(line, HW_BINARY_REQUEST)) {
+            if (allow_binary) {
+                out_len += sprintf(out+out_len, HW_BINARY_REQUEST);
+                binary = 1;
+            }
+            continue;
+        }
+
+        if (!strcmp(line, HW_DESTINATION_REQUEST)) {
+            out_len += sprintf(out+out_len, HW_DESTINATION_REQUEST);
+            destination = 1;
+            continue;
+        }
+
+        /* The only command with three arguments, packed as in frames */
+        cabin = value = to = 0;
+        if (sscanf(line, "a %d %d %d", &cabin, &value, &to) == 3) {
+            command('a', cabin, HW_DESTINATION(value, to));
+            continue;
+        }
+
+        if (sscanf(line, "%c %d %d", &type, &cabin, &value) >= 1)
+            command(type, cabin, value);
+    }
+
+    memmove(in, in+used, in_len-used);
+    in_len -= used;
+}
+
+static void press_hall(struct passenger *p)
+{
+    int up = p->destination > p->origin;
+    unsigned char bit = up ? 1 : 2;
+
+    /* Every passenger reports at the destination panel */
+    if (destination) {
+        emit('g', p->origin, p->destination, 0);
+        return;
+    }
+
+    if (hall[p->origin] & bit)
+        return;
+
+    hall[p->origin] |= bit;
+    emit('b', p->origin, up ? GoingUp : GoingDown, 0);
+}
+
+/* Let passengers off and on at a cabin that just opened its doors */
+static void open_at_floor(int id, int floor, double t)
+{
+    int i;
+    struct passenger *p;
+
+    for (i = 0; i < num_arrived; i++) {
+        p = &passengers[i];
+
+        if (p->done)
+            continue;
+
+        if (p->cabin == id && p->destination == floor) {
+            p->done = 1;
+            p->delivered = t;
+            num_delivered++;
+            cabins[id-1].load--;
+        }
+    }
+
+    hall[floor] = 0;
+
+    for (i = 0; i < num_arrived; i++) {
+        p = &passengers[i];
+
+        if (p->done || p->cabin || p->origin != floor)
+            continue;
+
+        /* Left behind, call again */
+        if (capacity && cabins[id-1].load >= capacity) {
+            if (!destination)
+                press_hall(p);
+            continue;
+        }
+
+        if (!destination || p->assigned == id) {
+            p->cabin = id;
+            p->boarded = t;
+            cabins[id-1].load++;
+
+            /* The controller already knows where they are going */
+            if (destination)
+                continue;
+
+            if (!pressed[(id-1)*num_floors+p->destination]) {
+                pressed[(id-1)*num_floors+p->destination] = 1;
+                emit('p', id, p->destination, 0);
+            }
+        }
+    }
+
+    pressed[(id-1)*num_floors+floor] = 0;
+}
+
+/* A cabin stopped at floor, count the interval since the one before it */
+static void arrive(int floor, double t)
+{
+    if (arrivals[floor] >= 0) {
+        if (num_intervals == size_intervals) {
+            size_intervals = size_intervals ? 2*size_intervals : 64;
+            intervals = realloc(intervals, size_intervals*sizeof(double));
+        }
+        intervals[num_intervals++] = t-arrivals[floor];
+    }
+
+    arrivals[floor] = t;
+}
+
+/* One animation step, as the Java simulator does on each timer event */
+static void step(double t)
+{
+    int i, floor;
+    struct sim_cabin *c;
+
+    for (i = 0; i < num_cabins; i++) {
+        c = &cabins[i];
+
+        if (c->motor) {
+            c->position += c->motor*STEP;
+            c->stayed = 0;
+
+            if (c->position < 0.0) {
+                c->position = 0.0;
+                c->motor = 0;
+            }
+            if (c->position > num_floors-1) {
+                c->position = num_floors-1;
+                c->motor = 0;
+            }
+        }
+
+        if (c->door_dir) {
+            if ((c->door == DOOR_CLOSED && c->door_dir < 0) ||
+                    (c->door == DOOR_OPEN && c->door_dir > 0))
+                c->door_dir = 0;
+
+            c->door += c->door_dir;
+        }
+
+        if (c->motor || c->door_dir)
+            emit('f', i+1, 0, c->position);
+
+        /* Doors fully open at a floor */
+        floor = (int) lround(c->position);
+        if (c->door == DOOR_OPEN && !c->door_was_open &&
+                fabs(c->position-floor) < AT_FLOOR) {
+            if (!c->stayed)
+                arrive(floor, t);
+            c->stayed = 1;
+
+            open_at_floor(i+1, floor, t);
+        }
+
+        c->door_was_open = c->door == DOOR_OPEN;
+    }
+}
+
+/*
+ * Press the emergency stop of a random moving cabin, and release the cabins
+ * held long enough by a call to the destination of a passenger aboard, or
+ * the closest floor
+ */
+static void emergency(double t, int press)
+{
+    int i, j, floor;
+    struct sim_cabin *c;
+
+    for (i = 0; i < num_cabins; i++) {
+        c = &cabins[i];
+
+        if (c->estop_release == 0 || t < c->estop_release)
+            continue;
+
+        floor = (int) lround(c->position);
+        for (j = 0; j < num_arrived; j++)
+            if (passengers[j].cabin == i+1 && !passengers[j].done)
+                floor = passengers[j].destination;
+
+        c->estop_release = 0;
+        emit('p', i+1, floor, 0);
+    }
+
+    if (!press)
+        return;
+
+    i = rand() % num_cabins;
+    c = &cabins[i];
+
+    if (!c->motor || c->estop_release)
+        return;
+
+    c->estop = now();
+    c->estop_release = t+ESTOP_HOLD;
+    emit('p', i+1, ESTOP_FLOOR, 0);
+    flush_out();
+}
+
+/* Sorts doubles for percentiles */
+static int compare(const void *a, const void *b)
+{
+    double x = *(double*) a, y = *(double*) b;
+
+    return (x > y) - (x < y);
+}
+
+static void report(double start, double end)
+{
+    int i, n = 0;
+    double *wait = malloc(num_passengers*sizeof(double));
+    double *trip = malloc(num_passengers*sizeof(double));
+    double wait_sum = 0, trip_sum = 0, mean, var;
+    char c;
+
+    for (i = 0; i < num_arrived; i++) {
+        if (!passengers[i].done)
+            continue;
+
+        wait[n] = passengers[i].boarded-passengers[i].arrived;
+        trip[n] = passengers[i].delivered-passengers[i].arrived;
+        wait_sum += wait[n];
+        trip_sum += trip[n];
+        n++;
+    }
+
+    qsort(wait, n, sizeof(double), compare);
+    qsort(trip, n, sizeof(double), compare);
+
+    printf("protocol:   %s%s\n", binary ? "binary" : "text",
+           destination ? ", destination dispatch" : "");
+    printf("duration:   %.1f s\n", end-start);
+    if (num_restarts)
+        printf("restarts:   %d, controller down %.1f s\n", num_restarts, down_time);
+    printf("passengers: %d of %d delivered\n", n, num_passengers);
+    if (n) {
+        printf("wait:       mean %.2f s, p95 %.2f s, max %.2f s\n",
+               wait_sum/n, wait[(int) (0.95*(n-1))], wait[n-1]);
+        printf("trip:       mean %.2f s, p95 %.2f s, max %.2f s\n",
+               trip_sum/n, trip[(int) (0.95*(n-1))], trip[n-1]);
+        printf("wait dist:  p50 %.2f s, p75 %.2f s, p90 %.2f s, p99 %.2f s\n",
+               wait[(int) (0.5*(n-1))], wait[(int) (0.75*(n-1))],
+               wait[(int) (0.9*(n-1))], wait[(int) (0.99*(n-1))]);
+    }
+
+    if (num_intervals) {
+        for (mean = 0, i = 0; i < num_intervals; i++)
+            mean += intervals[i];
+        mean /= num_intervals;
+
+        for (var = 0, i = 0; i < num_intervals; i++)
+            var += (intervals[i]-mean)*(intervals[i]-mean);
+        var /= num_intervals;
+
+        printf("headway:    %d intervals, mean %.2f s, variance %.2f s^2, cv %.2f\n",
+               num_intervals, mean, var, mean > 0 ? sqrt(var)/mean : 0.0);
+    }
+
+    if (num_estops) {
+        qsort(estops, num_estops, sizeof(double), compare);
+        printf("estop:      %d, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", num_estops,
+               estops[num_estops/2]*1e3, estops[(int) (0.99*(num_estops-1))]*1e3,
+               estops[num_estops-1]*1e3);
+    }
+
+    printf("received:   %ld bytes,", bytes_received);
+    for (c = 'a'; c <= 'z'; c++)
+        if (received[(int) c])
+            printf(" %c %ld", c, received[(int) c]);
+    printf("\nsent:       %ld bytes,", bytes_sent);
+    for (c = 'a'; c <= 'z'; c++)
+        if (sent[(int) c])
+            printf(" %c %ld", c, sent[(int) c]);
+    printf("\n");
+    fflush(stdout);
+
+    free(wait);
+    free(trip);
+}
+
+static void parse_args(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:e:f:t:n:r:d:s:u:o:c:k:a:x")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'e': num_cabins = atoi(optarg); break;
+        case 'f': num_floors = atoi(optarg); break;
+        case 't': tick = atoi(optarg); break;
+        case 'n': num_passengers = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 's': seed = atoi(optarg); break;
+        case 'u': up_peak = atof(optarg); break;
+        case 'o': down_peak = atof(optarg); break;
+        case 'c': capacity = atoi(optarg); break;
+        case 'k': estop_rate = atof(optarg); break;
+        case 'a': restarts = atoi(optarg); break;
+        case 'x': allow_binary = 0; break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-e cabins] [-f floors] [-t tick ms] "
+                    "[-n passengers] [-r passengers/s] [-d seconds] [-s seed] [-u share] [-o share] "
+                    "[-c capacity] [-k estops/s] [-a restarts] [-x]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+
+    if (num_cabins < 1 || num_floors < 2 || tick < 1 || rate <= 0 ||
+            up_peak < 0 || down_peak < 0 || up_peak+down_peak > 1 || capacity < 0 ||
+            estop_rate < 0 || restarts < 0) {
+        fprintf(stderr, "Bad settings\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int i, srv, one = 1, count, down;
+    struct sockaddr_in addr;
+    struct pollfd pfd;
+    struct passenger *p;
+    double start, t, next_tick, next_arrival, next_estop, share;
+
+    parse_args(argc, argv);
+    srand(seed);
+
+    cabins = calloc(num_cabins, sizeof(struct sim_cabin));
+    passengers = calloc(num_passengers, sizeof(struct passenger));
+    hall = calloc(num_floors, 1);
+    arrivals = malloc(num_floors*sizeof(double));
+    for (i = 0; i < num_floors; i++)
+        arrivals[i] = -1;
+    pressed = calloc(num_cabins*num_floors, 1);
+
+    if ((srv = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (bind(srv, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(srv, 1) < 0) {
+        perror("bind");
+        exit(1);
+    }
+
+    if ((fd = accept(srv, NULL, NULL)) < 0) {
+        perror("accept");
+        exit(1);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (restarts)
+        signal(SIGPIPE, SIG_IGN);
+    else
+        close(srv);
+
+    start = now();
+    next_tick = start;
+    next_arrival = start + 0.2;
+    next_estop = start + 1.0;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (num_delivered < num_passengers && now()-start < duration) {
+        t = now();
+
+        /* Exponential inter-arrival times */
+        while (num_arrived < num_passengers && t >= next_arrival) {
+            p = &passengers[num_arrived++];
+            share = up_peak > 0 || down_peak > 0 ? rand() : RAND_MAX;
+            down = share >= up_peak*RAND_MAX && share < (up_peak+down_peak)*RAND_MAX;
+            if (share < up_peak*RAND_MAX)
+                p->origin = 0;
+            else if (down)
+                p->origin = 1 + rand() % (num_floors-1);
+            else
+                p->origin = rand() % num_floors;
+            do {
+                p->destination = down ? 0 : rand() % num_floors;
+            } while (p->destination == p->origin);
+            p->arrived = next_arrival;
+            press_hall(p);
+
+            next_arrival += -log((rand()+1.0)/(RAND_MAX+2.0))/rate;
+        }
+
+        if (estop_rate > 0) {
+            emergency(t, t >= next_estop);
+            while (t >= next_estop)
+                next_estop += -log((rand()+1.0)/(RAND_MAX+2.0))/estop_rate;
+        }
+
+        while (t >= next_tick) {
+            step(t);
+            next_tick += tick/1000.0;
+        }
+
+        flush_out();
+
+        count = (int) ((next_tick-t)*1000)+1;
+        pfd.fd = fd < 0 ? srv : fd;
+        if (poll(&pfd, 1, count) > 0) {
+            if (fd < 0) {
+                if ((fd = accept(srv, NULL, NULL)) < 0)
+                    continue;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                down_time += now()-down_since;
+                num_restarts++;
+                continue;
+            }
+
+            if ((count = read(fd, in+in_len, IN_SIZE-in_len)) <= 0) {
+                if (restarts > 0) {
+                    disconnect();
+                    continue;
+                }
+                break;
+            }
+
+            bytes_received += count;
+            in_len += count;
+            parse_input();
+            flush_out();
+        }
+    }
+
+    report(start, now());
+    close(fd);
+
+    return 0;
+}
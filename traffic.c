@@ -0,0 +1,476 @@
+/*
+ * Traffic patterns and operating modes, see include/traffic.h
+ *
+ * Authors: Rasmus Linusson <raslin@kth.se>
+ *          Karl Gäfvert <kalleg@kth.se>
+ */
+
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "hardwareAPI.h"
+#include "cabin.h"
+#include "controller.h"
+#include "group.h"
+#include "log.h"
+#include "rt.h"
+#include "traffic.h"
+
+/* Sectors are kept as low << 16 | high, to be read in one go */
+#define SECTOR(low, high) ((low) << 16 | (high))
+#define SECTOR_LOW(sector) ((sector) >> 16)
+#define SECTOR_HIGH(sector) ((sector) & 0xffff)
+
+static const char *pattern_names[] = { "off-peak", "up-peak", "down-peak", "lunch",
+                                       "inter-floor" };
+static const char *mode_names[] = { "collective", "express", "sectors" };
+
+/* Mode run by every pattern */
+static const int pattern_modes[] = { TRAFFIC_COLLECTIVE, TRAFFIC_EXPRESS, TRAFFIC_SECTORS,
+                                     TRAFFIC_SECTORS, TRAFFIC_SECTORS };
+
+static pthread_mutex_t traffic_mutex;
+
+/* Decayed counts, hall calls per floor */
+static double *demand = NULL;
+static double hall_calls = 0;
+static double hall_down = 0;
+static double trips = 0;
+static double from_lobby = 0;
+
+static int pattern = TRAFFIC_OFF_PEAK;
+static int pending = TRAFFIC_OFF_PEAK;
+static int mode = TRAFFIC_COLLECTIVE;
+static int pinned = -1;
+static uint64_t switches = 0;
+static uint64_t ms[TRAFFIC_NUM_MODES];
+
+/* When counts were last decayed, the pattern classified, the pending one
+   first classified and the sectors split, ms */
+static int64_t decayed_at, classified_at, pending_since, split_at;
+
+/* Per cabin, indexed by id */
+static int *sectors = NULL;
+static int *express = NULL;
+static int *headings = NULL;            /* by the elevator thread alone */
+
+static int traffic_floors;
+static int traffic_cabins;
+
+static int64_t now_ms()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t) now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+int traffic_parse(const char *name)
+{
+    int m;
+
+    if (!strcmp(name, "auto")) {
+        pinned = -1;
+        return 0;
+    }
+
+    for (m = 0; m < TRAFFIC_NUM_MODES; m++) {
+        if (!strcmp(name, mode_names[m])) {
+            pinned = m;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int traffic_open(int num_floors, int num_cabins)
+{
+    int i;
+    double *counts;
+
+    sectors = malloc((num_cabins+1)*sizeof(int));
+    express = calloc(num_cabins+1, sizeof(int));
+    headings = calloc(num_cabins+1, sizeof(int));
+    counts = calloc(num_floors, sizeof(double));
+
+    if (!sectors || !express || !headings || !counts) {
+        free(sectors);
+        free(express);
+        free(headings);
+        free(counts);
+        sectors = express = headings = NULL;
+        return -1;
+    }
+
+    for (i = 0; i <= num_cabins; i++)
+        sectors[i] = SECTOR(0, num_floors-1);
+
+    traffic_floors = num_floors;
+    traffic_cabins = num_cabins;
+
+    rt_mutex_init(&traffic_mutex);
+
+    decayed_at = classified_at = pending_since = split_at = now_ms();
+    mode = pinned >= 0 ? pinned : pattern_modes[pattern];
+
+    __atomic_store_n(&demand, counts, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void traffic_close()
+{
+    if (!traffic_enabled())
+        return;
+
+    free(demand);
+    free(sectors);
+    free(express);
+    free(headings);
+    demand = NULL;
+    sectors = express = headings = NULL;
+
+    pthread_mutex_destroy(&traffic_mutex);
+}
+
+int traffic_enabled()
+{
+    return __atomic_load_n(&demand, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/* Forget the counts by e every TRAFFIC_WINDOW ms */
+static void decay(int64_t now)
+{
+    int f;
+    double factor = exp(-(double) (now-decayed_at)/TRAFFIC_WINDOW);
+
+    for (f = 0; f < traffic_floors; f++)
+        demand[f] *= factor;
+
+    hall_calls *= factor;
+    hall_down *= factor;
+    trips *= factor;
+    from_lobby *= factor;
+
+    decayed_at = now;
+}
+
+/* Whether the counts match pattern p, its thresholds missed by up to slack */
+static int matches(int p, int slack)
+{
+    double rate = hall_calls*60000/TRAFFIC_WINDOW;
+    double in = 0, down = 0;
+    int q;
+
+    if (trips >= TRAFFIC_MIN_TRIPS)
+        in = 100*from_lobby/trips;
+    if (hall_calls >= TRAFFIC_MIN_TRIPS)
+        down = 100*hall_down/hall_calls;
+
+    if (p == TRAFFIC_OFF_PEAK)
+        return rate*100 < TRAFFIC_QUIET*(100+slack);
+    if (rate*100 < TRAFFIC_QUIET*(100-slack))
+        return 0;
+
+    switch (p) {
+    case TRAFFIC_UP_PEAK:
+        return in >= TRAFFIC_UP_SHARE-slack;
+    case TRAFFIC_DOWN_PEAK:
+        return down >= TRAFFIC_DOWN_SHARE-slack;
+    case TRAFFIC_LUNCH:
+        return in >= TRAFFIC_LUNCH_UP_SHARE-slack && down >= TRAFFIC_LUNCH_DOWN_SHARE-slack;
+    default:
+        for (q = TRAFFIC_OFF_PEAK; q < TRAFFIC_INTERFLOOR; q++)
+            if (matches(q, 0))
+                return 0;
+        return 1;
+    }
+}
+
+/* Pattern of the counts, the one running while it matches with slack */
+static int match()
+{
+    static const int order[] = { TRAFFIC_OFF_PEAK, TRAFFIC_LUNCH, TRAFFIC_UP_PEAK,
+                                 TRAFFIC_DOWN_PEAK };
+    int i;
+
+    if (matches(pattern, TRAFFIC_HYSTERESIS))
+        return pattern;
+
+    for (i = 0; i < sizeof(order)/sizeof(order[0]); i++)
+        if (matches(order[i], 0))
+            return order[i];
+
+    return TRAFFIC_INTERFLOOR;
+}
+
+/*
+ * Split floors low to high among cabins first to last, by the calls at them.
+ * Read while split, every sector is published once complete.
+ */
+static void split_zone(int first, int last, int low, int high)
+{
+    int f, id, i, n = last-first+1;
+    int zone[n];
+    double total = 0, sum = 0, share;
+
+    /* Half a call at every floor, even split without any */
+    for (f = low; f <= high; f++)
+        total += demand[f] + 0.5;
+
+    for (i = 0; i < n; i++)
+        zone[i] = -1;
+
+    for (f = low; f <= high; f++) {
+        share = sum + (demand[f] + 0.5)/2;
+        sum += demand[f] + 0.5;
+
+        i = (int) (share*n/total);
+        if (i >= n)
+            i = n-1;
+
+        if (zone[i] < 0)
+            zone[i] = SECTOR(f, f);
+        else
+            zone[i] = SECTOR(SECTOR_LOW(zone[i]), f);
+    }
+
+    /* Cabins left without a floor share the busy one their share falls on */
+    for (i = 0; i < n; i++) {
+        if (zone[i] >= 0)
+            continue;
+
+        share = (i + 0.5)*total/n;
+        for (sum = 0, f = low; f < high && sum + demand[f] + 0.5 < share; f++)
+            sum += demand[f] + 0.5;
+
+        zone[i] = SECTOR(f, f);
+    }
+
+    for (id = first; id <= last; id++)
+        __atomic_store_n(&sectors[id], zone[id-first], __ATOMIC_RELAXED);
+}
+
+static void split(int64_t now)
+{
+    int g;
+    struct group_stats zone;
+
+    if (!group_count())
+        split_zone(1, traffic_cabins, 0, traffic_floors-1);
+
+    for (g = 0; g < group_count(); g++) {
+        group_stats(g, &zone);
+        split_zone(zone.first, zone.last, zone.low, zone.high);
+    }
+
+    split_at = now;
+}
+
+/* Take the time since last, and switch pattern if another one held on */
+static void classify(int64_t now)
+{
+    int candidate;
+
+    ms[mode] += now - classified_at;
+    classified_at = now;
+
+    decay(now);
+    candidate = match();
+
+    if (candidate == pattern)
+        pending = pattern;
+    else if (candidate != pending) {
+        pending = candidate;
+        pending_since = now;
+    }
+    else if (now - pending_since >= TRAFFIC_HOLD) {
+        __atomic_store_n(&pattern, candidate, __ATOMIC_RELAXED);
+        switches++;
+
+        if (pinned < 0)
+            __atomic_store_n(&mode, pattern_modes[pattern], __ATOMIC_RELAXED);
+
+        log_msg(LOG_INFO, LOG_TRAFFIC, pattern, mode, hall_calls*60000/TRAFFIC_WINDOW,
+                trips ? from_lobby/trips : 0, hall_calls ? hall_down/hall_calls : 0);
+
+        split_at = 0;
+    }
+
+    /* Sectors follow the calls */
+    if (mode == TRAFFIC_SECTORS && now - split_at >= TRAFFIC_HOLD)
+        split(now);
+}
+
+void traffic_hall(int floor, int type)
+{
+    int64_t now;
+
+    if (!traffic_enabled() || floor < 0 || floor >= traffic_floors)
+        return;
+
+    pthread_mutex_lock(&traffic_mutex);
+
+    now = now_ms();
+    decay(now);
+    demand[floor]++;
+    hall_calls++;
+    hall_down += type == GoingDown;
+    classify(now);
+
+    pthread_mutex_unlock(&traffic_mutex);
+}
+
+void traffic_trip(int origin, int destination)
+{
+    int64_t now;
+
+    if (!traffic_enabled() || origin == destination)
+        return;
+
+    pthread_mutex_lock(&traffic_mutex);
+
+    now = now_ms();
+    decay(now);
+    trips++;
+    from_lobby += origin == 0;
+    classify(now);
+
+    pthread_mutex_unlock(&traffic_mutex);
+}
+
+void traffic_tick()
+{
+    if (!traffic_enabled())
+        return;
+
+    /* Some other thread is at it already */
+    if (pthread_mutex_trylock(&traffic_mutex))
+        return;
+
+    classify(now_ms());
+
+    pthread_mutex_unlock(&traffic_mutex);
+}
+
+int traffic_mode()
+{
+    if (!traffic_enabled())
+        return TRAFFIC_COLLECTIVE;
+
+    return __atomic_load_n(&mode, __ATOMIC_RELAXED);
+}
+
+int traffic_penalty(int id, int floor)
+{
+    int sector, stops, per_floor, per_stop;
+
+    switch (traffic_mode()) {
+    case TRAFFIC_SECTORS:
+        sector = __atomic_load_n(&sectors[id], __ATOMIC_RELAXED);
+        if (floor >= SECTOR_LOW(sector) && floor <= SECTOR_HIGH(sector))
+            return 0;
+
+        stops = TRAFFIC_SECTOR_STOPS;
+        break;
+    case TRAFFIC_EXPRESS:
+        if (!__atomic_load_n(&express[id], __ATOMIC_RELAXED))
+            return 0;
+
+        stops = TRAFFIC_EXPRESS_STOPS;
+        break;
+    default:
+        return 0;
+    }
+
+    score_weights(&per_floor, &per_stop);
+
+    return stops*per_stop;
+}
+
+void traffic_update(int id, int floor, int heading)
+{
+    if (!traffic_enabled())
+        return;
+
+    /* Express from leaving the lobby upwards until turning around */
+    if (heading <= 0)
+        __atomic_store_n(&express[id], 0, __ATOMIC_RELAXED);
+    else if (headings[id] <= 0 && floor == 0 && traffic_mode() == TRAFFIC_EXPRESS)
+        __atomic_store_n(&express[id], 1, __ATOMIC_RELAXED);
+
+    headings[id] = heading;
+}
+
+int traffic_park(int id)
+{
+    int floor, sector;
+
+    if (!traffic_enabled() || !cabin_available(cabins[id]))
+        return -1;
+
+    floor = position_floor(__atomic_load_n(&cabins[id]->info.position, __ATOMIC_RELAXED));
+
+    switch (traffic_mode()) {
+    case TRAFFIC_EXPRESS:
+        return floor ? 0 : -1;
+    case TRAFFIC_SECTORS:
+        sector = __atomic_load_n(&sectors[id], __ATOMIC_RELAXED);
+        if (floor >= SECTOR_LOW(sector) && floor <= SECTOR_HIGH(sector))
+            return -1;
+
+        return (SECTOR_LOW(sector) + SECTOR_HIGH(sector))/2;
+    default:
+        return -1;
+    }
+}
+
+void traffic_sector(int id, int *low, int *high)
+{
+    int sector = __atomic_load_n(&sectors[id], __ATOMIC_RELAXED);
+
+    *low = SECTOR_LOW(sector);
+    *high = SECTOR_HIGH(sector);
+}
+
+int traffic_express(int id)
+{
+    return __atomic_load_n(&express[id], __ATOMIC_RELAXED);
+}
+
+void traffic_stats(struct traffic_stats *stats)
+{
+    pthread_mutex_lock(&traffic_mutex);
+
+    classify(now_ms());
+
+    stats->pattern = pattern;
+    stats->mode = mode;
+    stats->pinned = pinned >= 0;
+    stats->rate = hall_calls*60000/TRAFFIC_WINDOW;
+    stats->from_lobby = trips ? from_lobby/trips : 0;
+    stats->down = hall_calls ? hall_down/hall_calls : 0;
+    stats->switches = switches;
+    memcpy(stats->ms, ms, sizeof(ms));
+
+    pthread_mutex_unlock(&traffic_mutex);
+}
+
+const char *traffic_pattern_name(int pattern)
+{
+    return pattern >= 0 && pattern < TRAFFIC_NUM_PATTERNS ? pattern_names[pattern] : "?";
+}
+
+const char *traffic_mode_name(int mode)
+{
+    return mode >= 0 && mode < TRAFFIC_NUM_MODES ? mode_names[mode] : "?";
+}